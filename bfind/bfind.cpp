@@ -10,9 +10,34 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <libgen.h>
-
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "decompress.h"
+#include "dfa.h"
+#include "index.h"
+#include "matcher.h"
+#include "output.h"
+#include "search.h"
+#include "uring.h"
+#include "walk.h"
+
+using namespace bfind;
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) < (b) ? (b) : (a))
@@ -27,12 +52,24 @@ enum status_code
     k_status_error
 };
 
-enum format
+enum io_engine
+{
+    k_io_read,   // read() into one buffer
+    k_io_uring,  // io_uring with several reads in flight
+};
+
+enum report_mode
 {
-    k_ascii,   // ASCII text
-    k_dec,     // decimal
-    k_hex,     // hexadecimal
-    k_bin,     // binary
+    k_report_lines,    // offset and neighboring data of each match
+    k_report_offsets,  // offset of each match
+    k_report_count,    // number of matches only
+};
+
+enum output_format
+{
+    k_output_text,  // lines for people to read
+    k_output_json,  // one JSON object per match
+    k_output_bin,   // array of match_record
 };
 
 class configuration
@@ -42,33 +79,56 @@ class configuration
     {
     }
 
-    FILE * file = nullptr;              // The input file
-    uint8_t * pattern = nullptr;        // The pattern to search for
-    uint64_t pattern_length = 0;        // Search pattern length (bytes)
+    std::vector<std::string> paths;     // The input files and directories
+    walk_options walk;                  // How to find files in directories
+    bool print_paths = false;           // Print the file name of each match
+    std::vector<pattern> patterns;      // The patterns to search for
     format pattern_format = k_ascii;    // Search pattern format ASCII, Hex, or Binary
     bool use_color = true;              // Enables color printing
     bool case_sensitive = true;         // Enables case sensitive search
+    bool bit_offsets = false;           // Binary patterns may start at any bit
     format file_offset_format = k_hex;  // Format for printing file offsets
+    report_mode report = k_report_lines; // What to print for each match
+    output_format match_output = k_output_text; // How to print matches
+    uint64_t max_count = 0;             // Stop after this many matches, or 0
+    bool use_mmap = true;               // Memory map regular files
+    io_engine io = k_io_read;           // How to read files that are not mapped
+    bool direct_io = false;             // Bypass the page cache with O_DIRECT
+    unsigned queue_depth = 4;           // Reads in flight with io_uring
+    uint64_t buffer_size = 1 << 20;     // Bytes per read
+    uint64_t jobs = 1;                  // Number of search threads
+    algorithm algo = k_algo_auto;       // Search algorithm
+    bool print_stats = false;           // Print search statistics
+    bool build_index = false;           // Index the files instead of searching
+    bool use_index = true;              // Only search the blocks an index allows
+    bool decompress = true;             // Search compressed files decompressed
+    search_range range;                 // --start, --end and --stride
+    output_buffer * output = nullptr;   // Buffered standard output
 };
 
 void
-print_02x(const uint8_t * buffer,
+print_02x(char * & dst,
+          const uint8_t * buffer,
           uint64_t & position,
           const uint64_t & stop)
 {
     for (; position < stop; position++)
-        printf("%02x ", buffer[position]);
+    {
+        dst = format_hex_byte(dst, buffer[position]);
+        *dst++ = ' ';
+    }
 }
 
 void
-set_color(const configuration & config, const char * sequence)
+set_color(const configuration & config, char * & dst, const char * sequence)
 {
     if (config.use_color)
-        printf("%s", sequence);
+        dst = format_text(dst, sequence, strlen(sequence));
 }
 
 // Print hexadecimal version of a matching line
 void print_hex(const configuration & config,
+               char * & dst,
                uint64_t position,
                uint64_t start,
                uint64_t length,
@@ -77,33 +137,30 @@ void print_hex(const configuration & config,
 {
     uint64_t i = 0;
     // bytes prior to match
-    print_02x(buffer, i, position - start);
+    print_02x(dst, buffer, i, position - start);
 
     // the match
-    set_color(config, COLOR_FG_RED);
-    print_02x(buffer, i, match_length + (position - start));
-    set_color(config, COLOR_RESET);
+    set_color(config, dst, COLOR_FG_RED);
+    print_02x(dst, buffer, i, match_length + (position - start));
+    set_color(config, dst, COLOR_RESET);
 
     // bytes after match
-    print_02x(buffer, i, length);
+    print_02x(dst, buffer, i, length);
 }
 
 void
-print_chars(const uint8_t * buffer,
+print_chars(char * & dst,
+            const uint8_t * buffer,
             uint64_t & position,
             const uint64_t & stop)
 {
     for (; position < stop; position++)
-    {
-        if (isprint(buffer[position]))
-            printf("%c", buffer[position]);
-        else
-            printf(".");
-    }
+        *dst++ = printable(buffer[position]);
 }
 
 // Print decimal version of a matching line
 void print_ascii(const configuration & config,
+                 char * & dst,
                  uint64_t position,
                  uint64_t start,
                  uint64_t length,
@@ -114,88 +171,198 @@ void print_ascii(const configuration & config,
     uint64_t i = 0;
 
     // bytes prior to match
-    print_chars(buffer, i, position - start);
+    print_chars(dst, buffer, i, position - start);
 
     // the match
-    set_color(config, COLOR_FG_RED);
-    print_chars(buffer, i, match_length + (position - start));
-    set_color(config, COLOR_RESET);
+    set_color(config, dst, COLOR_FG_RED);
+    print_chars(dst, buffer, i, match_length + (position - start));
+    set_color(config, dst, COLOR_RESET);
 
     // bytes after match
-    print_chars(buffer, i, length);
+    print_chars(dst, buffer, i, length);
 
-    for (i = 0; i < (uint64_t)trim; i++)
-        printf(" ");
+    memset(dst, ' ', trim);
+    dst += trim;
 }
 
 
+// Number of bytes printed on each side of a match
+static const int k_side_data = 6;
+
+// Compute the file range [start, stop) printed around a match
+void
+context_range(uint64_t position,
+              uint64_t match_length,
+              uint64_t file_size,
+              uint64_t & start,
+              uint64_t & stop)
+{
+    start = position > (uint64_t) k_side_data ? position - k_side_data : 0;
+    stop = min(position + match_length + k_side_data, file_size);
+}
+
+// Print a match and its neighboring bytes. context holds the file bytes in
+// the range computed by context_range(). The path is printed first unless
+// it is null.
 void
 print_match(const configuration & config,
-            uint64_t position,
+            const char * path,
+            const match & found,
+            uint64_t match_length,
             uint64_t file_size,
-            uint64_t match_length)
-{
-    int side_data = 6; // num bytes presented around match
-    uint64_t start = max(((long long)position - side_data), 0);
-    uint64_t stop = position + match_length + side_data;
-    int64_t trim = stop - file_size; // How much output is trimmed
-    trim = max(trim, 0);
-    stop = min(((long long)(stop)), (long long)file_size);
+            const uint8_t * context)
+{
+    uint64_t position = found.position;
+    uint64_t start = 0;
+    uint64_t stop = 0;
+    context_range(position, match_length, file_size, start, stop);
+    // How much output is trimmed at the end of the file
+    int64_t trim = position + match_length + k_side_data - stop;
     uint64_t length = stop - start;
-    uint8_t * buffer = (uint8_t *) malloc (match_length + 2 * side_data);
-    uint64_t position_backup = ftello(config.file);
-    uint64_t i = 0;
 
-    fseeko(config.file, start, SEEK_SET);
-    size_t bytes_read = fread(buffer, 1, length, config.file);
-    if (bytes_read != length)
-        std::cerr << "error: could not read " << length
-                  << " bytes @ " << start << std::endl;
+    // Format the whole line into the output buffer: the path, 40 bytes for
+    // the offsets, 4 bytes per byte of data, and the color sequences
+    uint64_t path_length = path ? strlen(path) : 0;
+    uint64_t line_length = path_length + 40 + 4 * (length + trim) + 32;
+    char * line = config.output->reserve(line_length);
+    char * dst = line;
+
+    if (path)
+    {
+        dst = format_text(dst, path, path_length);
+        dst = format_text(dst, ": ", 2);
+    }
 
     if (config.file_offset_format == k_hex)
-        printf("match @ 0x%08lX  ", position);
+    {
+        dst = format_text(dst, "match @ 0x", 10);
+        dst = format_hex(dst, position, 8);
+    }
     else
-        printf("match @ %08ld  ", position);
+    {
+        dst = format_text(dst, "match @ ", 8);
+        dst = format_decimal(dst, position, 8);
+    }
+    dst = format_text(dst, "  ", 2);
+
+    // first matching bit, 0 is the most significant
+    if (config.bit_offsets)
+    {
+        dst = format_text(dst, "bit ", 4);
+        *dst++ = '0' + found.bit;
+        dst = format_text(dst, "  ", 2);
+    }
+
+    // pattern number, when there is more than one
+    if (config.patterns.size() > 1)
+    {
+        *dst++ = '#';
+        char * number = dst;
+        dst = format_decimal(dst, found.pattern + 1, 1);
+        while (dst - number < 4)
+            *dst++ = ' ';
+    }
 
     // hex in left column
-    print_hex(config, position, start, length, match_length, buffer);
+    print_hex(config, dst, position, start, length, match_length, context);
 
-    for (i = 0; i < (uint64_t)trim; i++)
-        printf("   ");
+    memset(dst, ' ', 3 * trim);
+    dst += 3 * trim;
 
-    printf(" | ");
+    dst = format_text(dst, " | ", 3);
 
     // ascii in right column
-    print_ascii(config, position, start, length, match_length, trim, buffer);
+    print_ascii(config, dst, position, start, length, match_length, trim,
+                context);
 
-    printf(" |\n");
-    free(buffer);
-
-    fseeko(config.file, position_backup, SEEK_SET);
+    dst = format_text(dst, " |\n", 3);
+    config.output->commit(dst);
 }
 
+// Return true if matches are printed with their neighboring bytes
 bool
-is_hex_character(uint8_t c)
+prints_context(const configuration & config)
 {
-    c = toupper(c);
-    if (isalpha(c))
-        return c <= 'F' && c >= 'A';
-    else
-        return c <= '9' && c >= '0';
+    return config.report == k_report_lines &&
+           config.match_output == k_output_text;
 }
 
-uint8_t
-nibble2byte(uint8_t c)
+// Print a match without its neighboring bytes: a line with its offset for
+// --offsets-only, or a record for --output-format json and bin. The path is
+// printed in text lines only when more than one file is searched.
+void
+print_record(const configuration & config,
+             const char * path,
+             const match & found,
+             uint64_t match_length)
 {
-    uint8_t d = 0;
-    c = toupper(c);
+    if (config.match_output == k_output_bin)
+    {
+        match_record record;
+        record.offset = found.position;
+        record.pattern = found.pattern;
+        record.length = match_length;
+        record.bit = found.bit;
+        record.reserved = 0;
+        config.output->put((const char *) &record, sizeof(record));
+        return;
+    }
+
+    uint64_t path_length = strlen(path);
+    char * line = config.output->reserve(6 * path_length + 128);
+    char * dst = line;
+
+    if (config.match_output == k_output_json)
+    {
+        dst = format_text(dst, "{\"path\":", 8);
+        dst = format_json_string(dst, path, path_length);
+        dst = format_text(dst, ",\"offset\":", 10);
+        dst = format_decimal(dst, found.position, 1);
+        dst = format_text(dst, ",\"length\":", 10);
+        dst = format_decimal(dst, match_length, 1);
+        dst = format_text(dst, ",\"pattern\":", 11);
+        dst = format_decimal(dst, found.pattern, 1);
+        if (config.bit_offsets)
+        {
+            dst = format_text(dst, ",\"bit\":", 7);
+            *dst++ = '0' + found.bit;
+        }
+        dst = format_text(dst, "}\n", 2);
+        config.output->commit(dst);
+        return;
+    }
+
+    // Decimal offsets are not zero padded
+    if (config.print_paths)
+    {
+        dst = format_text(dst, path, path_length);
+        dst = format_text(dst, ": ", 2);
+    }
 
-    if (isalpha(c))
-        d = c - 'A' + 10; // 'A' should equal 10
+    if (config.file_offset_format == k_hex)
+    {
+        dst = format_text(dst, "0x", 2);
+        dst = format_hex(dst, found.position, 8);
+    }
     else
-        d = c - '0';      // the value of the digit
+    {
+        dst = format_decimal(dst, found.position, 1);
+    }
+
+    if (config.bit_offsets)
+    {
+        dst = format_text(dst, " bit ", 5);
+        *dst++ = '0' + found.bit;
+    }
 
-    return d;
+    if (config.patterns.size() > 1)
+    {
+        dst = format_text(dst, " #", 2);
+        dst = format_decimal(dst, found.pattern + 1, 1);
+    }
+
+    *dst++ = '\n';
+    config.output->commit(dst);
 }
 
 void
@@ -217,12 +384,23 @@ print_usage(char ** argv)
      bfind - search binary files quickly
 
   SYNOPSIS
-     bfind [OPTIONS] <string> <file> 
+     bfind [OPTIONS] <string> <file> [<file> ...]
+     bfind [OPTIONS] -e <string> [-e <string> ...] <file> [<file> ...]
+     bfind [OPTIONS] -p <pattern file> <file> [<file> ...]
+     bfind --build-index [-r] <file> [<file> ...]
 
   DESCRIPTION
-     Search files for ASCII, hexadecimal, or binary search strings.
+     Search files for ASCII, hexadecimal, or binary search strings, or for
+     regular expressions.
      The offset, and some neighboring data, of each match is printed to stdout.
-     All search patterns must start at a byte boundary.
+     Search patterns must start at a byte boundary, unless -b is given.
+     When more than one file is searched, each match is prefixed with the
+     path of its file.
+
+     A file named - is standard input. Pipes and devices are read once,
+     from start to end, without seeking and in constant memory. Each match
+     is printed as soon as its neighboring data has been read, so that
+     live captures can be followed.
 
      bfind returns 0 if at least one match is found, and 1 otherwise.
 
@@ -230,16 +408,29 @@ print_usage(char ** argv)
      --help
            Display this help.
 
-     -f <ascii|hex|bin>
-     --format <ascii|hex|bin>
+     -f <ascii|hex|bin|regex>
+     --format <ascii|hex|bin|regex>
            Specify the format of the search string.
 
              ascii:  ASCII text search string, e.g. hello
                hex:  Hexadecimal search string, e.g. 4d5601c0
                bin:  Binary search string, e.g. 0110111011110100
+             regex:  Regular expression over bytes, e.g. \x47.{187}\x47
 
            The default format is ascii.
 
+           A ? in a hexadecimal search string matches any nibble, e.g.
+           4d5a??00. A mask of the same length can follow a slash, and
+           then only the bits set in the mask must match, e.g. 4d5a/fff0.
+
+           A regular expression can use ., [...] and [^...] classes,
+           \xHH, \n, \r, \t, \0, \d, \w, \s and their negations, groups
+           with (...) and |, and bounded repetition with ?, {n} and
+           {n,m}. The length of a match must be bounded, so * and + are
+           not supported, and there are no anchors. A match is reported
+           at each offset where one starts, with its longest length.
+           -i can be used with regular expressions.
+
      -c <yes|no>
      --color <yes|no>
            Print matching file content using ANSI color escape codes.
@@ -253,12 +444,186 @@ print_usage(char ** argv)
                hex:  Prints file offsets in hexadecimal format
            The default is hexadecimal.
 
+     --count
+           Only count the matches, and print nothing but the number of
+           matches found. No file data is read for printing, so the
+           search runs at the speed of the matcher.
+
+     --offsets-only
+           Print only the offset of each match, one per line, followed
+           by the bit offset with -b and by the number of the matching
+           string when there is more than one. No neighboring data is
+           printed, and the number of matches found is printed to
+           stderr, so that the output can be piped to wc -l or xargs.
+
+     --output-format <text|json|bin>
+           Select how matches are printed, for other programs to read.
+               text:  Lines as described above
+               json:  One JSON object per line and match, with the path,
+                      offset, length and pattern index of the match, and
+                      the bit offset with -b, e.g.
+                      {"path":"a.bin","offset":4096,"length":2,"pattern":0}
+                bin:  An array of 16 byte records in native byte order:
+                      the offset as a 64 bit integer, the pattern index
+                      as a 32 bit integer, the length as a 16 bit integer,
+                      the bit offset as a byte and a zero byte. The
+                      output can be memory mapped as it is. Only one
+                      input file can be searched.
+           Pattern indexes start at 0. With json and bin, no neighboring
+           data is printed, and the number of matches found is printed
+           to stderr. The default is text.
+
+     -m <N>
+     --max-count <N>
+           Stop searching after N matches. No more data is read once N
+           matches are found.
+
+     --start <offset>
+     --end <offset>
+           Only search the bytes from offset --start up to, but not
+           including, offset --end, e.g. --start 0x1000 --end 1M.
+           Matches must lie within the range. Offsets are decimal, or
+           hexadecimal with a 0x prefix, and can end in K, M or G.
+           Regular files are only read within the range, and other
+           files up to its end. The default is the whole file.
+
+     --stride <N[K|M|G]>
+           Only report matches that start at --start plus a multiple of
+           N, e.g. 512 for structures at the start of disk sectors. With
+           large strides only the aligned offsets are checked, and most
+           of a memory mapped file is never read.
+           The default is 1.
+
+     -b
+     --bits
+           Let binary search strings have any number of bits and start at
+           any bit of a byte, e.g. to search bitstreams. The bit offset of
+           each match is printed after the byte offset, where bit 0 is the
+           most significant bit. Other search strings still start at a byte
+           boundary.
+
      -i
      --ignore-case
            Enable case-insensitive search.
-           Only applicable to ASCII search strings.
+           Only applicable to ASCII search strings and regular expressions.
+           The file data is printed as it is, in its original case.
            Case-sensitive search is the default.
 
+     -M <yes|no>
+     --mmap <yes|no>
+           Memory map regular files instead of reading them into a buffer.
+           Pipes and other non-regular files are always read.
+           This is the default.
+
+     --io <read|uring>
+           Select how files that are not memory mapped are read.
+               read:  Read the file block by block into one buffer
+              uring:  Keep several reads in flight with io_uring, and
+                      search each block while the next ones are read
+           With uring, regular files are not memory mapped when searching
+           with one thread. The default is read.
+
+     --direct
+           Read files with O_DIRECT, bypassing the page cache, on file
+           systems that support it. Implies --io uring.
+
+     --queue-depth <N>
+           Number of reads in flight with --io uring.
+           The default is 4.
+
+     --buffer-size <N[K|M|G]>
+           Number of bytes per read, e.g. 4M.
+           The default is 1M.
+
+     -j <N>
+     --jobs <N>
+           Search regular files with N threads. Matches are printed in
+           file order, just like for a single thread.
+           The default is 1.
+
+     -r
+     --recursive
+           Search the files in directories, and in their subdirectories.
+           Symbolic links inside directories are not followed, and only
+           regular files are searched there. Files are searched in name
+           order.
+
+     --include <glob>
+           Only search files whose names match the glob, e.g. '*.dll',
+           when searching directories. Can be given several times.
+
+     --exclude <glob>
+           Skip files and directories whose names match the glob, e.g.
+           .git, when searching directories. Can be given several times.
+
+     -e <string>
+     --pattern <string>
+           Add a search string. Can be given several times to search for
+           all of the strings in one pass over the file. The format given
+           with -f can be overridden with an ascii:, hex:, bin: or regex:
+           prefix, e.g. hex:4d5a. When more than one search string is
+           given, the number of the matching string is printed after the
+           offset. Together with regular expressions, each string is
+           searched for in its own pass over each buffer.
+
+     -p <file>
+     --pattern-file <file>
+           Read search strings from a file, one per line, in the same
+           format as for -e. Empty lines and lines starting with # are
+           skipped.
+
+     --algo <auto|simd|horspool|two-way|rare|aho-corasick|bits|regex>
+           Select the search algorithm.
+                     auto:  Pick one based on the search strings
+                     simd:  Vectorized first and last byte filter
+                 horspool:  Boyer-Moore-Horspool skip table
+                  two-way:  Two-Way, linear also for repetitive strings
+                     rare:  Anchor on the rarest byte of the string
+             aho-corasick:  Automaton for any number of strings
+                     bits:  Shifted strings, used for -b
+                    regex:  Lazy DFA, used for regular expressions
+           Only auto, aho-corasick, bits and regex can search for several
+           strings.
+           Masked hexadecimal strings are searched for with simd, one
+           string at a time. With -i, several strings can also be
+           searched for with aho-corasick.
+           The default is auto.
+
+     --stats
+           Print the algorithm in use, the time spent searching and the
+           throughput to stderr.
+
+     --build-index
+           Write an index of each file instead of searching, to speed up
+           later searches of the same files. The index of file.bin is
+           written to file.bin.bfi. It lists the 256 KiB blocks in which
+           each 3 byte string occurs, and a search only reads the blocks
+           that can hold a match. Blocks with many distinct 3 byte
+           strings, like compressed or encrypted data, are always read.
+           An index is ignored once the size or the modification time of
+           its file changes. No search string is given with
+           --build-index. Files whose name ends in .bfi are taken for
+           index files, and are neither indexed nor searched.
+           Building an index takes about 150 MB of memory, or more for
+           files over 16 GB with many distinct 3 byte strings. Large
+           files also need temporary disk space next to the index, at
+           most half the size of the file.
+
+     --index <yes|no>
+           Use the index of a file when it has one. Search strings need
+           3 consecutive fully known bytes to be looked up, otherwise the
+           whole file is searched, as it is for regular expressions.
+           This is the default.
+
+     --decompress <yes|no>
+           Search gzip, xz and zstd files as the data they decompress
+           to. The compression is detected from the first bytes of each
+           regular file. The file is decompressed on a separate thread,
+           while the data decompressed so far is searched, and offsets
+           are in the decompressed data. zstd files need libzstd.so.1.
+           Compressed files are not split between threads with -j, and
+           their index is not used. This is the default.
+
   EXAMPLES
      Find the ASCII string banana in file.bin.
            bfind banana file.bin
@@ -269,28 +634,129 @@ print_usage(char ** argv)
      Search for the binary string 0110100110011001 in file.bin.
            bfind -f bin 0110100110011001 file.bin
 
+     Search for the 23 bit string 00000000000000000000001 at any bit.
+           bfind -b -f bin 00000000000000000000001 stream.264
+
+     Print the offsets of the first 10 MPEG-2 sequence headers.
+           bfind --offsets-only -m 10 -f hex 000001b3 video.mpg
+
+     Search for an MZ header and the ASCII string PE in one pass.
+           bfind -e hex:4d5a90 -e PE file.bin
+
+     Search for a PE header with any value in its third byte.
+           bfind -f hex 5045??00 file.bin
+
+     Find NTFS boot sectors in the first GiB of a disk image.
+           bfind --end 1G --stride 512 -f hex eb52904e544653 disk.img
+
+     Find MPEG transport stream packets, 188 bytes apart.
+           bfind -f regex '\x47.{187}\x47' stream.ts
+
+     Search a compressed memory dump without writing it out first.
+           bfind -f hex 4d5a9000 memory.dmp.zst
+
+     Follow HTTP GET requests in a live packet capture.
+           tcpdump -w - | bfind --offsets-only 'GET /' -
+
+     Search all DLL files below the directory lib on four threads.
+           bfind -r -j 4 --include '*.dll' -f hex 4d5a90 lib
+
+     Index a disk image once, then search only the blocks that can match.
+           bfind --build-index disk.img
+           bfind -f hex 89504e470d0a1a0a disk.img
+
   AUTHOR
      Written by Nils Andgren, 2014.
     )xxx";
     std::cerr << usage << std::endl;
 }
 
-void
-to_lower_case(uint8_t * buffer,
-              uint64_t position,
-              uint64_t stop)
+// Parse a byte count with an optional K, M or G suffix, e.g. 256K
+status_code
+parse_size(const char * text, uint64_t & dst)
 {
-    for (; position < stop; position++)
-        buffer[position] = tolower(buffer[position]);
+    char * end = nullptr;
+    long long size = strtoll(text, &end, 10);
+    uint64_t unit = 1;
+    if (*end == 'K' || *end == 'k')
+        unit = 1 << 10;
+    else if (*end == 'M' || *end == 'm')
+        unit = 1 << 20;
+    else if (*end == 'G' || *end == 'g')
+        unit = 1 << 30;
+    if (unit > 1)
+        end++;
+
+    if (end == text || *end != '\0' || size < 1)
+    {
+        std::cerr << "error: " << text << " is not a valid size" << std::endl;
+        return k_status_error;
+    }
+    dst = size * unit;
+    return k_status_ok;
+}
+
+// Parse a file offset, in decimal or with a 0x prefix in hexadecimal, with
+// an optional K, M or G suffix
+status_code
+parse_offset(const char * text, uint64_t & dst)
+{
+    char * end = nullptr;
+    bool hex = 0 == strncmp(text, "0x", 2) || 0 == strncmp(text, "0X", 2);
+    uint64_t offset = strtoull(text, &end, hex ? 16 : 10);
+    uint64_t unit = 1;
+    if (*end == 'K' || *end == 'k')
+        unit = 1 << 10;
+    else if (*end == 'M' || *end == 'm')
+        unit = 1 << 20;
+    else if (*end == 'G' || *end == 'g')
+        unit = 1 << 30;
+    if (unit > 1)
+        end++;
+
+    if (end == text || *end != '\0' || !isxdigit(text[hex ? 2 : 0]) ||
+        offset > UINT64_MAX / unit)
+    {
+        std::cerr << "error: " << text << " is not a valid offset"
+                  << std::endl;
+        return k_status_error;
+    }
+    dst = offset * unit;
+    return k_status_ok;
 }
 
+// Append the patterns in a pattern file, one per line, to dst. Empty lines
+// and lines starting with # are skipped.
+status_code
+read_pattern_file(const char * path, std::vector<std::string> & dst)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "error: Failed to open " << path << std::endl;
+        return k_status_error;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (line.empty() || line[0] == '#')
+            continue;
+        dst.push_back(line);
+    }
+
+    return k_status_ok;
+}
 
 status_code
 apply_command_line_options(configuration * dst_conf, int argc, char * argv [])
 {
     int index = 1;
-    char * file_path = NULL;
-    char * pattern = NULL;
+    char * search_string = NULL;
+    std::vector<std::string> pattern_args; // given with -e or -p
+    std::string error;
 
     while (index < argc)
     {
@@ -313,6 +779,8 @@ apply_command_line_options(configuration * dst_conf, int argc, char * argv [])
                 dst_conf->pattern_format = k_hex;
             else if (0 == strncmp(option, "bin", 3))
                 dst_conf->pattern_format = k_bin;
+            else if (0 == strcmp(option, "regex"))
+                dst_conf->pattern_format = k_regex;
             else
             {
                 std::cerr << "error: " << option
@@ -366,249 +834,1510 @@ apply_command_line_options(configuration * dst_conf, int argc, char * argv [])
                 }
             }
         }
-        else if (0 == strcmp(option, "-i") ||
-                 0 == strcmp(option, "--ignore-case"))
+        else if (0 == strcmp(option, "-M") ||
+                 0 == strcmp(option, "--mmap"))
         {
-            dst_conf->case_sensitive = false;
+            dst_conf->use_mmap = true;
+            if (index + 1 < argc)
+            {
+                char * use_mmap = argv[index + 1];
+                if (0 == strcmp(use_mmap, "no") ||
+                    0 == strcmp(use_mmap, "off"))
+                {
+                    dst_conf->use_mmap = false;
+                    index++;
+                }
+                else if (0 == strcmp(use_mmap, "yes") ||
+                         0 == strcmp(use_mmap, "on"))
+                {
+                    dst_conf->use_mmap = true;
+                    index++;
+                }
+            }
         }
-        else if (option[0] == '-')
+        else if (0 == strcmp(option, "-j") ||
+                 0 == strcmp(option, "--jobs"))
         {
-            std::cerr << "error: Unknown option - " << option << std::endl;
-            return k_status_error;
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            char * end = nullptr;
+            long long jobs = strtoll(argv[index], &end, 10);
+            if (*end != '\0' || jobs < 1)
+            {
+                std::cerr << "error: " << argv[index]
+                          << " is not a valid number of jobs" << std::endl;
+                return k_status_error;
+            }
+            dst_conf->jobs = jobs;
         }
-        else if (pattern == NULL)
+        else if (0 == strcmp(option, "--algo"))
         {
-            // We assume the following command line format:
-            //   bfind [options] pattern [file]
-            pattern = option;
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            dst_conf->algo = k_algo_count;
+            for (int algo = 0; algo < k_algo_count; algo++)
+            {
+                if (0 == strcmp(argv[index], algorithm_name((algorithm) algo)))
+                    dst_conf->algo = (algorithm) algo;
+            }
+            if (dst_conf->algo == k_algo_count)
+            {
+                std::cerr << "error: " << argv[index]
+                          << " is not a valid algorithm" << std::endl;
+                return k_status_error;
+            }
         }
-        else if (file_path == NULL)
+        else if (0 == strcmp(option, "--io"))
         {
-            // We assume the following command line format:
-            //   bfind [options] pattern file
-            file_path = option;
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            if (0 == strcmp(argv[index], "read"))
+                dst_conf->io = k_io_read;
+            else if (0 == strcmp(argv[index], "uring"))
+                dst_conf->io = k_io_uring;
+            else
+            {
+                std::cerr << "error: " << argv[index]
+                          << " is not a valid I/O engine" << std::endl;
+                return k_status_error;
+            }
         }
-        else
+        else if (0 == strcmp(option, "--direct"))
         {
-            std::cerr << "error: bad command line format" << std::endl;
-            print_usage(argv);
-            return k_status_error;
+            dst_conf->direct_io = true;
+            dst_conf->io = k_io_uring;
         }
-        index++;
-    }
-
-    if (pattern == NULL)
-    {
-        std::cerr << "error: No search string specified" << std::endl;
-        return k_status_error;
-    }
-    else
-    {
-        if (k_ascii == dst_conf->pattern_format)
+        else if (0 == strcmp(option, "--queue-depth"))
         {
-            uint64_t length = strlen(pattern);
-            dst_conf->pattern = (uint8_t*) calloc(length+1, 1);
-            memcpy(dst_conf->pattern, pattern, length);
-            dst_conf->pattern_length = length;
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
 
-            if (dst_conf->case_sensitive == false)
+            index++;
+            char * end = nullptr;
+            long long depth = strtoll(argv[index], &end, 10);
+            if (*end != '\0' || depth < 1 || depth > 4096)
             {
-                // We use lower case for the search string and for the file
-                // buffer in the search() function.
-                uint8_t * buffer = dst_conf->pattern;
-                to_lower_case(buffer, 0, length);
+                std::cerr << "error: " << argv[index]
+                          << " is not a valid queue depth" << std::endl;
+                return k_status_error;
             }
+            dst_conf->queue_depth = depth;
         }
-        else if (k_hex == dst_conf->pattern_format)
+        else if (0 == strcmp(option, "--buffer-size"))
         {
-            uint64_t length = strlen(pattern);
-            if (length & 1)
+            if (index + 1 >= argc)
             {
-                std::cerr << "error: Hexadecimal search string length should "
-                          << "be a multiple of two." << std::endl;
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
                 return k_status_error;
             }
 
-            dst_conf->pattern = (uint8_t*) malloc (length/2);
-            dst_conf->pattern_length = length/2;
-
-            uint8_t msb = 0;
-            uint8_t lsb = 0;
-            uint64_t o = 0;
-            for (uint64_t i = 0; i < length; i+=2, o++)
-            {
-                msb = pattern[i+0];
-                lsb = pattern[i+1];
-
-                if (!is_hex_character(msb) || !is_hex_character(lsb))
-                {
-                    std::cerr << "error: Non-hexadecimal character in search "
-                              << "pattern" << std::endl;
-                    return k_status_error;
-                }
-
-                dst_conf->pattern[o] = (nibble2byte(msb) << 4) |
-                                        nibble2byte(lsb);
-            }
+            index++;
+            if (k_status_ok != parse_size(argv[index], dst_conf->buffer_size))
+                return k_status_error;
         }
-        else if (k_bin == dst_conf->pattern_format)
+        else if (0 == strcmp(option, "--start") ||
+                 0 == strcmp(option, "--end"))
         {
-            uint32_t length = strlen(pattern);
-            if (length % 8)
+            if (index + 1 >= argc)
             {
-                std::cerr << "error: Binary search string length should "
-                          << "be a multiple of eight." << std::endl;
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
                 return k_status_error;
             }
 
-            dst_conf->pattern = (uint8_t*) calloc(length/8, 1);
-            dst_conf->pattern_length = length/8;
-
-            uint64_t o = 0;
-            for (uint64_t i = 0; i < length; i+=8, o++)
+            index++;
+            uint64_t & dst = 0 == strcmp(option, "--start") ?
+                             dst_conf->range.start : dst_conf->range.end;
+            if (k_status_ok != parse_offset(argv[index], dst))
+                return k_status_error;
+        }
+        else if (0 == strcmp(option, "--stride"))
+        {
+            if (index + 1 >= argc)
             {
-                uint8_t dst_value = 0;
-                for (uint64_t j = 0; j < 8; j++)
-                {
-                    dst_value <<= 1;
-                    uint8_t bit_char = pattern[i + j];
-                    if ('1' == bit_char)
-                    {
-                        dst_value |= 1;
-                    }
-                    else if ('0' != bit_char)
-                    {
-                        std::cerr << "error: Non-binary character in search "
-                                  << "pattern" << std::endl;
-                        return k_status_error;
-                    }
-                }
-                dst_conf->pattern[o] = dst_value;
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
             }
-        }
-    }
-
-    if (dst_conf->pattern_format != k_ascii &&
-        dst_conf->case_sensitive == false)
-    {
-        std::cerr << "error: Case can only be ignored when searching "
-                  << "for ASCII strings." << std::endl;
-        return k_status_error;
-    }
 
-    if (file_path == NULL)
-    {
-        std::cerr << "No input file specified." << std::endl;
-        return k_status_error;
-    }
-    else
-    {
-        dst_conf->file = fopen(file_path, "rb");
-        if (dst_conf->file == NULL)
+            index++;
+            if (k_status_ok != parse_size(argv[index],
+                                          dst_conf->range.stride))
+                return k_status_error;
+        }
+        else if (0 == strcmp(option, "--stats"))
         {
-            std::cerr << "error: Failed to open " << file_path << std::endl;
-            return k_status_error;
+            dst_conf->print_stats = true;
         }
-    }
-
-    return k_status_ok;
-}
-
-// Search the file while printing matching file content
-status_code search(const configuration & config)
-{
-    const uint64_t k_buffer_size = 4096;
-    uint8_t * pattern = config.pattern;
-    uint64_t pattern_length = config.pattern_length;
-    uint64_t buffer_bytes = k_buffer_size + pattern_length;
-    uint8_t * buffer = (uint8_t*) malloc(buffer_bytes);
-    uint64_t buffer_pos = 0;    // current read position
-    uint64_t buffer_offset = 0; // where to write data in buffer
-
-    uint8_t * match_buffer = (uint8_t*) malloc(buffer_bytes);
-
-    bool match = true;   // match at this position
-    int match_count = 0; // match count so far
-    bool end_of_data = false;
-    uint64_t bytes_read = 0;
-
-    uint64_t file_pos = 0;
-    uint64_t file_size = 0;
-
-    fseeko(config.file, 0, SEEK_END);
-    file_size = ftello(config.file);
-    rewind(config.file);
-
-    bytes_read = fread(buffer + buffer_offset,
-                       1, k_buffer_size + pattern_length,
-                       config.file);
-
-    if (bytes_read < k_buffer_size)
-    {
-        end_of_data = true;
-    }
-    else
-    {
-        bytes_read = k_buffer_size;
-    }
-
-    do
-    {
-        if (bytes_read < k_buffer_size)
-            end_of_data = true;
-
-        if (config.case_sensitive == false)
-            to_lower_case(buffer, 0, bytes_read);
-
-        // search through the buffer up to last possible complete match
-        for (buffer_pos = 0; buffer_pos <= bytes_read; buffer_pos++)
+        else if (0 == strcmp(option, "--build-index"))
+        {
+            dst_conf->build_index = true;
+        }
+        else if (0 == strcmp(option, "--index"))
         {
-            uint8_t * buffer_ptr = buffer + buffer_pos;
-            match = true;
-            uint64_t pattern_pos = 0;
-            for (; pattern_pos < pattern_length; pattern_pos++)
+            if (index + 1 >= argc)
             {
-                if (buffer_ptr[pattern_pos] != pattern[pattern_pos])
-                {
-                    match = false;
-                    break;
-                }
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
             }
 
-            if (match)
+            index++;
+            if (0 == strcmp(argv[index], "yes") ||
+                0 == strcmp(argv[index], "on"))
+                dst_conf->use_index = true;
+            else if (0 == strcmp(argv[index], "no") ||
+                     0 == strcmp(argv[index], "off"))
+                dst_conf->use_index = false;
+            else
             {
-                uint64_t match_pos = file_pos + (uint64_t) buffer_pos;
-                print_match(config, match_pos, file_size, pattern_length);
-                match_count++;
+                std::cerr << "error: " << option << " takes yes or no"
+                          << std::endl;
+                return k_status_error;
             }
         }
-
-        // copy tail to beginning and set offset for next read
-        if (bytes_read > pattern_length)
+        else if (0 == strcmp(option, "--decompress"))
         {
-            memcpy(buffer, buffer + buffer_pos, pattern_length);
-            buffer_offset = pattern_length;
-        }
-
-        file_pos += bytes_read;
-        bytes_read = fread(buffer + buffer_offset, 
-                           1, k_buffer_size, 
-                           config.file);
-    } 
-    while (!end_of_data);
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            if (0 == strcmp(argv[index], "yes") ||
+                0 == strcmp(argv[index], "on"))
+                dst_conf->decompress = true;
+            else if (0 == strcmp(argv[index], "no") ||
+                     0 == strcmp(argv[index], "off"))
+                dst_conf->decompress = false;
+            else
+            {
+                std::cerr << "error: " << option << " takes yes or no"
+                          << std::endl;
+                return k_status_error;
+            }
+        }
+        else if (0 == strcmp(option, "--count"))
+        {
+            dst_conf->report = k_report_count;
+        }
+        else if (0 == strcmp(option, "--offsets-only"))
+        {
+            dst_conf->report = k_report_offsets;
+        }
+        else if (0 == strcmp(option, "--output-format"))
+        {
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            if (0 == strcmp(argv[index], "text"))
+                dst_conf->match_output = k_output_text;
+            else if (0 == strcmp(argv[index], "json"))
+                dst_conf->match_output = k_output_json;
+            else if (0 == strcmp(argv[index], "bin"))
+                dst_conf->match_output = k_output_bin;
+            else
+            {
+                std::cerr << "error: Unknown output format "
+                          << argv[index] << std::endl;
+                return k_status_error;
+            }
+        }
+        else if (0 == strcmp(option, "-m") ||
+                 0 == strcmp(option, "--max-count"))
+        {
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            char * end = nullptr;
+            long long count = strtoll(argv[index], &end, 10);
+            if (*end != '\0' || count < 1)
+            {
+                std::cerr << "error: " << argv[index]
+                          << " is not a valid number of matches" << std::endl;
+                return k_status_error;
+            }
+            dst_conf->max_count = count;
+        }
+        else if (0 == strcmp(option, "-e") ||
+                 0 == strcmp(option, "--pattern"))
+        {
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            pattern_args.push_back(argv[index]);
+        }
+        else if (0 == strcmp(option, "-p") ||
+                 0 == strcmp(option, "--pattern-file"))
+        {
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            if (k_status_ok != read_pattern_file(argv[index], pattern_args))
+                return k_status_error;
+        }
+        else if (0 == strcmp(option, "-r") ||
+                 0 == strcmp(option, "--recursive"))
+        {
+            dst_conf->walk.recursive = true;
+        }
+        else if (0 == strcmp(option, "--include") ||
+                 0 == strcmp(option, "--exclude"))
+        {
+            if (index + 1 >= argc)
+            {
+                std::cerr << "error: No argument given for "
+                          << option << std::endl;
+                return k_status_error;
+            }
+
+            index++;
+            if (0 == strcmp(option, "--include"))
+                dst_conf->walk.include.push_back(argv[index]);
+            else
+                dst_conf->walk.exclude.push_back(argv[index]);
+        }
+        else if (0 == strcmp(option, "-b") ||
+                 0 == strcmp(option, "--bits"))
+        {
+            dst_conf->bit_offsets = true;
+        }
+        else if (0 == strcmp(option, "-i") ||
+                 0 == strcmp(option, "--ignore-case"))
+        {
+            dst_conf->case_sensitive = false;
+        }
+        else if (option[0] == '-' && option[1] != '\0')
+        {
+            std::cerr << "error: Unknown option - " << option << std::endl;
+            return k_status_error;
+        }
+        else if (search_string == NULL && pattern_args.empty())
+        {
+            // We assume the following command line format:
+            //   bfind [options] pattern [file]
+            search_string = option;
+        }
+        else
+        {
+            // We assume the following command line format:
+            //   bfind [options] pattern file [file ...]
+            dst_conf->paths.push_back(option);
+        }
+        index++;
+    }
+
+    // Only files are given when indexing
+    if (dst_conf->build_index && search_string != NULL)
+    {
+        dst_conf->paths.insert(dst_conf->paths.begin(), search_string);
+        search_string = NULL;
+    }
+
+    if (search_string != NULL)
+    {
+        if (!pattern_args.empty())
+        {
+            // The search string was taken for a file path
+            std::cerr << "error: bad command line format" << std::endl;
+            return k_status_error;
+        }
+
+        // Format prefixes only apply to -e and -p patterns
+        dst_conf->patterns.push_back(pattern());
+        if (!parse_pattern(search_string, dst_conf->pattern_format,
+                           dst_conf->case_sensitive, dst_conf->bit_offsets,
+                           dst_conf->patterns.back(), error))
+        {
+            std::cerr << "error: " << error << std::endl;
+            return k_status_error;
+        }
+    }
+
+    for (const std::string & pattern_arg : pattern_args)
+    {
+        const char * text = pattern_arg.c_str();
+        format pattern_format = dst_conf->pattern_format;
+        if (0 == strncmp(text, "ascii:", 6))
+        {
+            pattern_format = k_ascii;
+            text += 6;
+        }
+        else if (0 == strncmp(text, "hex:", 4))
+        {
+            pattern_format = k_hex;
+            text += 4;
+        }
+        else if (0 == strncmp(text, "bin:", 4))
+        {
+            pattern_format = k_bin;
+            text += 4;
+        }
+        else if (0 == strncmp(text, "regex:", 6))
+        {
+            pattern_format = k_regex;
+            text += 6;
+        }
+
+        dst_conf->patterns.push_back(pattern());
+        if (!parse_pattern(text, pattern_format, dst_conf->case_sensitive,
+                           dst_conf->bit_offsets, dst_conf->patterns.back(),
+                           error))
+        {
+            std::cerr << "error: " << error << std::endl;
+            return k_status_error;
+        }
+    }
+
+    if (dst_conf->patterns.empty() && !dst_conf->build_index)
+    {
+        std::cerr << "error: No search string specified" << std::endl;
+        return k_status_error;
+    }
+
+    bool masked = false;
+    for (const pattern & p : dst_conf->patterns)
+        masked = masked || !p.mask.empty();
+
+    if (dst_conf->patterns.size() > 1 &&
+        dst_conf->algo != k_algo_auto &&
+        dst_conf->algo != k_algo_aho_corasick &&
+        dst_conf->algo != k_algo_bits &&
+        dst_conf->algo != k_algo_regex &&
+        !(dst_conf->algo == k_algo_simd && masked))
+    {
+        std::cerr << "error: " << algorithm_name(dst_conf->algo)
+                  << " can only search for one string" << std::endl;
+        return k_status_error;
+    }
+
+    if (dst_conf->bit_offsets &&
+        dst_conf->algo != k_algo_auto &&
+        dst_conf->algo != k_algo_bits)
+    {
+        std::cerr << "error: " << algorithm_name(dst_conf->algo)
+                  << " can not search for bits" << std::endl;
+        return k_status_error;
+    }
+
+    for (const pattern & p : dst_conf->patterns)
+    {
+        if (p.mask.empty())
+            continue;
+
+        if (dst_conf->bit_offsets)
+        {
+            std::cerr << "error: Masked search strings can not be used "
+                      << "with -b" << std::endl;
+            return k_status_error;
+        }
+
+        // -i masks out the case bit of letters
+        if (dst_conf->algo != k_algo_auto && dst_conf->algo != k_algo_simd &&
+            dst_conf->algo != k_algo_regex &&
+            !(dst_conf->algo == k_algo_aho_corasick &&
+              !dst_conf->case_sensitive))
+        {
+            std::cerr << "error: " << algorithm_name(dst_conf->algo)
+                      << " can not search for masked or case-insensitive "
+                      << "strings" << std::endl;
+            return k_status_error;
+        }
+    }
+
+    for (const pattern & p : dst_conf->patterns)
+    {
+        if (!p.regex)
+            continue;
+
+        if (dst_conf->bit_offsets)
+        {
+            std::cerr << "error: Regular expressions can not be used "
+                      << "with -b" << std::endl;
+            return k_status_error;
+        }
+
+        if (dst_conf->algo != k_algo_auto && dst_conf->algo != k_algo_regex)
+        {
+            std::cerr << "error: " << algorithm_name(dst_conf->algo)
+                      << " can not search for regular expressions"
+                      << std::endl;
+            return k_status_error;
+        }
+    }
+
+    if (dst_conf->range.start >= dst_conf->range.end)
+    {
+        std::cerr << "error: --start must be below --end" << std::endl;
+        return k_status_error;
+    }
+
+    if (dst_conf->paths.empty())
+    {
+        std::cerr << "No input file specified." << std::endl;
+        return k_status_error;
+    }
+
+    // Tell matches in different files apart
+    dst_conf->print_paths = dst_conf->walk.recursive ||
+                            dst_conf->paths.size() > 1;
+
+    // Binary records have no room for the path, or for long matches
+    if (dst_conf->match_output == k_output_bin)
+    {
+        if (dst_conf->print_paths)
+        {
+            std::cerr << "error: --output-format bin can only be used "
+                      << "with a single input file" << std::endl;
+            return k_status_error;
+        }
+
+        for (const pattern & p : dst_conf->patterns)
+        {
+            if (p.bytes.size() >= UINT16_MAX)
+            {
+                std::cerr << "error: --output-format bin can only be used "
+                          << "for search strings shorter than 64 KiB"
+                          << std::endl;
+                return k_status_error;
+            }
+        }
+    }
+
+    return k_status_ok;
+}
+
+// Return true if regular files are memory mapped. io_uring reads into
+// buffers, but it is only used by the single threaded search.
+bool
+maps_files(const configuration & config)
+{
+    return config.use_mmap && (config.io != k_io_uring || config.jobs > 1);
+}
+
+// An input file. It is opened on first use, by whichever thread gets there
+// first, and closed when the last reference to it is dropped. Compressed
+// files are not mapped, and their size is unknown until they are searched.
+class input_file
+{
+    public:
+    input_file(const std::string & file_path, uint64_t file_size) :
+        path(file_path),
+        size(file_size)
+    {
+    }
+
+    ~input_file()
+    {
+        if (data)
+            munmap((void *) data, size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Open the file and memory map it if the configuration allows it.
+    // Returns false, after printing an error, if it could not be opened.
+    bool open_once(const configuration & config)
+    {
+        std::call_once(m_opened, [&]
+        {
+            fd = open_input(path);
+            if (fd < 0)
+            {
+                std::cerr << "error: Failed to open " << path << std::endl;
+                return;
+            }
+
+            if (config.decompress && size != k_unknown_size)
+                compressed = detect_compression(fd);
 
-    free (match_buffer);
-    free (buffer);
+            if (maps_files(config) && size > 0 && size != k_unknown_size &&
+                compressed == k_compression_none)
+            {
+                void * mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE,
+                                      fd, 0);
+                if (mapping != MAP_FAILED)
+                {
+                    madvise(mapping, size, MADV_SEQUENTIAL);
+                    data = (const uint8_t *) mapping;
+                }
+            }
+        });
+        return fd >= 0;
+    }
+
+    static const uint64_t k_unknown_size = UINT64_MAX; // pipes, devices
+
+    std::string path;
+    uint64_t size = 0;
+    int fd = -1;
+    const uint8_t * data = nullptr;     // The mapped file, if mapped
+    compression compressed = k_compression_none;
+
+    private:
+    std::once_flag m_opened;
+};
+
+// Copy the file bytes [start, stop) to dst, from the mapping if the file is
+// mapped and with pread otherwise
+void
+read_context(const input_file & in,
+             uint64_t start,
+             uint64_t stop,
+             uint8_t * dst)
+{
+    uint64_t length = stop - start;
+    if (in.data)
+    {
+        memcpy(dst, in.data + start, length);
+    }
+    else if (pread(in.fd, dst, length, start) != (ssize_t) length)
+    {
+        std::cerr << "error: could not read " << length
+                  << " bytes @ " << start << std::endl;
+        memset(dst, 0, length);
+    }
+}
+
+// Print a match found in the input file. The neighboring bytes are taken
+// from buffer, which holds the file data from file_pos on, when it has them.
+void
+print_file_match(const configuration & config,
+                 const matcher & engine,
+                 const input_file & in,
+                 const match & found,
+                 const uint8_t * buffer,
+                 uint64_t buffer_length,
+                 uint64_t file_pos)
+{
+    uint64_t match_length = engine.match_length(found);
+    uint64_t start = 0;
+    uint64_t stop = 0;
+    const char * path = config.print_paths ? in.path.c_str() : nullptr;
+    context_range(found.position, match_length, in.size, start, stop);
+
+    if (in.data)
+    {
+        print_match(config, path, found, match_length, in.size,
+                    in.data + start);
+    }
+    else if (start >= file_pos && stop <= file_pos + buffer_length)
+    {
+        print_match(config, path, found, match_length, in.size,
+                    buffer + (start - file_pos));
+    }
+    else
+    {
+        std::vector<uint8_t> context(stop - start);
+        read_context(in, start, stop, context.data());
+        print_match(config, path, found, match_length, in.size,
+                    context.data());
+    }
+}
+
+// Return true once the matches asked for with -m have been found
+bool
+limit_reached(const configuration & config, uint64_t match_count)
+{
+    return config.max_count && match_count >= config.max_count;
+}
+
+// Report all complete matches in buffer that start in [search_start,
+// start_limit), up to the -m limit, and add them to match_count. The bytes
+// before search_start are only printed as neighboring data. file_pos is the
+// file offset of buffer[0]. With -m, the buffer is searched in steps, so that
+// the search stops soon after the last match. Returns the number of start
+// offsets searched.
+uint64_t
+search_buffer(const configuration & config,
+              const matcher & engine,
+              const input_file & in,
+              const uint8_t * buffer,
+              uint64_t buffer_length,
+              uint64_t search_start,
+              uint64_t start_limit,
+              uint64_t file_pos,
+              uint64_t & match_count)
+{
+    const uint64_t k_limited_step = 64 << 10;
+    uint64_t step = config.max_count ? k_limited_step : start_limit;
+    std::vector<match> matches;
+    uint64_t offset = search_start;
+
+    for (; offset < start_limit && !limit_reached(config, match_count);
+         offset += step)
+    {
+        matches.clear();
+        find_in_range(engine, config.range, buffer, buffer_length, offset,
+                      min(offset + step, start_limit), file_pos, matches);
+        if (config.max_count)
+            matches.resize(min(matches.size(),
+                               config.max_count - match_count));
+        match_count += matches.size();
+        if (config.report == k_report_count)
+            continue;
+
+        for (match & found : matches)
+        {
+            found.position += file_pos;
+            if (prints_context(config))
+                print_file_match(config, engine, in, found,
+                                 buffer, buffer_length, file_pos);
+            else
+                print_record(config, in.path.c_str(), found,
+                             engine.match_length(found));
+        }
+    }
+    return min(offset, start_limit) - min(search_start, start_limit);
+}
+
+// Search each buffer that scan_blocks() passes on, until the -m limit is
+// reached
+block_scanner
+buffer_scanner(const configuration & config,
+               const matcher & engine,
+               const input_file & in,
+               uint64_t & match_count)
+{
+    return [&config, &engine, &in, &match_count](const uint8_t * data,
+                                                 uint64_t length,
+                                                 uint64_t search_start,
+                                                 uint64_t start_limit,
+                                                 uint64_t data_pos,
+                                                 bool)
+    {
+        search_buffer(config, engine, in, data, length, search_start,
+                      start_limit, data_pos, match_count);
+        return !limit_reached(config, match_count);
+    };
+}
+
+// Search the file by reading it into a buffer, block by block. Returns the
+// number of bytes read.
+uint64_t
+search_stream(const configuration & config,
+              const matcher & engine,
+              const input_file & in,
+              uint64_t & match_count)
+{
+    uint64_t overlap = engine.max_length() - 1; // bytes carried between reads
+    uint64_t headroom = block_headroom(overlap, 0);
+    std::vector<uint8_t> buffer(headroom + config.buffer_size);
+
+    block_source next_block = [&](uint8_t * & block, uint64_t & length)
+    {
+        ssize_t bytes_read = read(in.fd, buffer.data() + headroom,
+                                  config.buffer_size);
+        if (bytes_read < 0)
+            std::cerr << "error: Failed to read " << in.path << std::endl;
+
+        block = buffer.data() + headroom;
+        length = bytes_read > 0 ? bytes_read : 0;
+        return bytes_read > 0;
+    };
+    return scan_blocks(next_block, overlap, 0, config.range.end,
+                       buffer_scanner(config, engine, in, match_count));
+}
+
+// Search a memory mapped file. The kernel is asked to read ahead one window
+// while the current window is scanned. Returns the number of bytes searched.
+uint64_t
+search_mapped(const configuration & config,
+              const matcher & engine,
+              const input_file & in,
+              uint64_t & match_count)
+{
+    const uint64_t k_window_size = 8 << 20;
+    const uint8_t * file_data = in.data;
+    uint64_t file_size = in.size;
+    uint64_t overlap = engine.max_length() - 1;
+    uint64_t searched = 0;
+
+    madvise((void *) file_data, min(k_window_size, file_size), MADV_WILLNEED);
+
+    for (uint64_t window = 0;
+         window < file_size && !limit_reached(config, match_count);
+         window += k_window_size)
+    {
+        uint64_t next_window = window + k_window_size;
+        if (next_window < file_size)
+            madvise((void *) (file_data + next_window),
+                    min(k_window_size, file_size - next_window),
+                    MADV_WILLNEED);
+
+        // matches starting in this window may end in the next one
+        uint64_t length = min(k_window_size + overlap, file_size - window);
+        uint64_t start_limit = min(k_window_size, file_size - window);
+        searched += search_buffer(config, engine, in, file_data + window,
+                                  length, 0, start_limit, window,
+                                  match_count);
+    }
+    return searched;
+}
+
+// Search a regular file with io_uring, scanning each block while the next
+// ones are read. Falls back to search_stream() if io_uring is not available.
+// Returns the number of bytes read.
+uint64_t
+search_uring(const configuration & config,
+             const matcher & engine,
+             const input_file & in,
+             uint64_t & match_count)
+{
+    uint64_t overlap = engine.max_length() - 1; // bytes carried between reads
+    int fd = in.fd;
+    int direct_fd = -1;
+    if (config.direct_io)
+    {
+        // Not all file systems support O_DIRECT, e.g. tmpfs
+        direct_fd = open(in.path.c_str(), O_RDONLY | O_DIRECT);
+        if (direct_fd >= 0)
+            fd = direct_fd;
+    }
+
+    async_reader reader(fd, in.size, config.buffer_size, config.queue_depth,
+                        block_headroom(overlap, 0), in.fd);
+    if (!reader.start())
+    {
+        if (direct_fd >= 0)
+            close(direct_fd);
+        return search_stream(config, engine, in, match_count);
+    }
+
+    block_source next_block = [&](uint8_t * & block, uint64_t & length)
+    {
+        // the reader leaves room for the carried bytes
+        return reader.next(block, length);
+    };
+    uint64_t bytes_read = scan_blocks(next_block, overlap, 0,
+                                      config.range.end,
+                                      buffer_scanner(config, engine, in,
+                                                     match_count));
+
+    if (direct_fd >= 0)
+        close(direct_fd);
+    return bytes_read;
+}
+
+// Room needed in front of each block by search_blocks()
+uint64_t
+block_headroom(const matcher & engine)
+{
+    return block_headroom(engine.max_length() - 1, k_side_data);
+}
+
+// Search data that can only be read once, block by block, like a pipe or a
+// file as it is decompressed. The data is never read back, so the
+// neighboring bytes of a match are kept in the buffer, which scan_blocks()
+// does with k_side_data bytes on each side of the part that is searched.
+// Memory use does not depend on the size of the data, whose size is set in
+// in.size once it is known. Returns the size of the data read.
+uint64_t
+search_blocks(const configuration & config,
+              const matcher & engine,
+              input_file & in,
+              const block_source & next_block,
+              uint64_t & match_count)
+{
+    in.size = input_file::k_unknown_size;
+
+    // no data is needed past --end and the neighboring bytes of a match
+    uint64_t data_end = config.range.end > UINT64_MAX - k_side_data ?
+                        UINT64_MAX : config.range.end + k_side_data;
+
+    in.size = scan_blocks(next_block, engine.max_length() - 1, k_side_data,
+                          data_end,
+                          [&](const uint8_t * data,
+                              uint64_t length,
+                              uint64_t search_start,
+                              uint64_t start_limit,
+                              uint64_t data_pos,
+                              bool last)
+                          {
+                              if (last)
+                                  in.size = data_pos + length;
+                              search_buffer(config, engine, in, data, length,
+                                            search_start, start_limit,
+                                            data_pos, match_count);
+                              return !limit_reached(config, match_count);
+                          });
+    return in.size;
+}
+
+// Search a compressed file while it is decompressed on another thread.
+// Offsets are in the decompressed data. Returns the number of bytes
+// decompressed.
+uint64_t
+search_compressed(const configuration & config,
+                  const matcher & engine,
+                  input_file & in,
+                  uint64_t & match_count)
+{
+    decompressor reader(in.fd, in.compressed, config.buffer_size,
+                        block_headroom(engine));
+    if (!reader.start())
+    {
+        std::cerr << "error: " << reader.error() << std::endl;
+        in.size = 0;
+        return 0;
+    }
+
+    bool ended = false;         // next() failed, at the end or on bad data
+    block_source next_block = [&](uint8_t * & block, uint64_t & length)
+    {
+        ended = !reader.next(block, length);
+        return !ended;
+    };
+    uint64_t bytes_read = search_blocks(config, engine, in, next_block,
+                                        match_count);
+    if (ended && !reader.error().empty())
+        std::cerr << "error: " << reader.error() << std::endl;
+    return bytes_read;
+}
+
+// Search a pipe, socket or device as it is read, without seeking. Matches
+// are printed as soon as the data after them has arrived, so that live
+// captures can be followed. Returns the number of bytes read.
+uint64_t
+search_pipe(const configuration & config,
+            const matcher & engine,
+            input_file & in,
+            uint64_t & match_count)
+{
+    uint64_t headroom = block_headroom(engine);
+    std::vector<uint8_t> buffer(headroom + config.buffer_size);
+
+    block_source next_block = [&](uint8_t * & block, uint64_t & length)
+    {
+        // show the matches found so far before waiting
+        config.output->flush();
+
+        ssize_t bytes_read;
+        do
+        {
+            bytes_read = read(in.fd, buffer.data() + headroom,
+                              config.buffer_size);
+        } while (bytes_read < 0 && errno == EINTR);
+        if (bytes_read < 0)
+            std::cerr << "error: Failed to read " << in.path << std::endl;
+
+        block = buffer.data() + headroom;
+        length = bytes_read > 0 ? bytes_read : 0;
+        return bytes_read > 0;
+    };
+    return search_blocks(config, engine, in, next_block, match_count);
+}
+
+// Set ranges to the parts of a file that can hold matches, according to its
+// index and to --start and --end. Returns false if the whole file has to be
+// searched, e.g. because it has no up to date index.
+bool
+file_ranges(const configuration & config,
+            const std::string & path,
+            const struct stat & file_stat,
+            std::vector<file_range> & ranges)
+{
+    if (!S_ISREG(file_stat.st_mode))
+        return false;
+
+    file_index index;
+    bool indexed = config.use_index && index.open(path, file_stat) &&
+                   index.candidate_ranges(config.patterns, ranges);
+    if (!indexed)
+    {
+        if (config.range.start == 0 && config.range.end == UINT64_MAX)
+            return false;
+        ranges.assign(1, {0, (uint64_t) file_stat.st_size});
+    }
+
+    std::vector<file_range> restricted;
+    for (const file_range & range : ranges)
+    {
+        uint64_t start = max(range.start, config.range.start);
+        uint64_t stop = min(range.stop, config.range.end);
+        if (start < stop)
+            restricted.push_back({start, stop});
+    }
+    ranges.swap(restricted);
+    return true;
+}
+
+// Search the given ranges of a regular file, from the mapping or with one
+// read per buffer size. Returns the number of bytes searched.
+uint64_t
+search_ranges(const configuration & config,
+              const matcher & engine,
+              const input_file & in,
+              const std::vector<file_range> & ranges,
+              uint64_t & match_count)
+{
+    uint64_t overlap = engine.max_length() - 1;
+    std::vector<uint8_t> buffer;
+    uint64_t searched = 0;
+
+    for (const file_range & range : ranges)
+    {
+        for (uint64_t start = range.start;
+             start < range.stop && !limit_reached(config, match_count);
+             start += config.buffer_size)
+        {
+            uint64_t start_limit = min(config.buffer_size, range.stop - start);
+            uint64_t length = min(start_limit + overlap, in.size - start);
+            const uint8_t * data = in.data + start;
+            if (!in.data)
+            {
+                buffer.resize(length);
+                if (pread(in.fd, buffer.data(), length, start) !=
+                    (ssize_t) length)
+                {
+                    std::cerr << "error: Failed to read " << in.path
+                              << std::endl;
+                    return searched;
+                }
+                data = buffer.data();
+            }
+            searched += search_buffer(config, engine, in, data, length, 0,
+                                      start_limit, start, match_count);
+        }
+    }
+    return searched;
+}
+
+// Search the files one at a time, printing matches as they are found
+uint64_t
+search_serial(const configuration & config,
+              const matcher & engine,
+              uint64_t & bytes_searched)
+{
+    uint64_t match_count = 0;
+    walk_paths(config.paths, config.walk,
+               [&](const std::string & path, const struct stat & file_stat)
+               {
+                   if (is_index_file(path))
+                       return true;
+
+                   bool regular = S_ISREG(file_stat.st_mode);
+                   input_file in(path, regular ? file_stat.st_size
+                                               : input_file::k_unknown_size);
+                   if (!in.open_once(config))
+                       return true;
+
+                   if (in.compressed != k_compression_none)
+                   {
+                       bytes_searched += search_compressed(config, engine, in,
+                                                           match_count);
+                       return !limit_reached(config, match_count);
+                   }
+
+                   std::vector<file_range> ranges;
+                   if (file_ranges(config, path, file_stat, ranges))
+                   {
+                       bytes_searched += search_ranges(config, engine, in, ranges,
+                                                       match_count);
+                       return !limit_reached(config, match_count);
+                   }
+
+                   if (in.data)
+                       bytes_searched += search_mapped(config, engine, in,
+                                                       match_count);
+                   else if (!regular)
+                       bytes_searched += search_pipe(config, engine, in,
+                                                     match_count);
+                   else if (config.io == k_io_uring)
+                       bytes_searched += search_uring(config, engine, in,
+                                                      match_count);
+                   else
+                       bytes_searched += search_stream(config, engine, in,
+                                                       match_count);
+                   return !limit_reached(config, match_count);
+               });
+    return match_count;
+}
+
+// Return the compression of the regular file at path, or k_compression_none
+// if compressed files are searched as they are
+compression
+file_compression(const configuration & config, const std::string & path)
+{
+    if (!config.decompress)
+        return k_compression_none;
+
+    int fd = open_input(path);
+    if (fd < 0)
+        return k_compression_none;
+    compression kind = detect_compression(fd);
+    close(fd);
+    return kind;
+}
+
+// A part of a file to search. Match positions in [start, stop) are
+// searched, the data may extend past stop for matches that begin before it.
+struct segment
+{
+    std::shared_ptr<input_file> file;  // Dropped once the segment is searched
+    std::string path;
+    uint64_t size;
+    uint64_t start;
+    uint64_t stop;
+};
+
+// A match found by a search thread, with its neighboring bytes
+struct found_match
+{
+    size_t segment;     // Index in search_task::segments
+    match found;        // Match with file offset
+    size_t context;     // Offset of the neighboring bytes in search_task::context
+};
+
+// A unit of work for the search threads. Small files are batched into one
+// task and large files are split into several.
+struct search_task
+{
+    std::vector<segment> segments;
+    bool stream = false;            // Non-regular or compressed file, searched
+                                    // when printed
+    std::vector<found_match> matches;
+    std::vector<uint8_t> context;
+    uint64_t bytes = 0;             // Bytes of the segments searched
+    bool done = false;
+};
+
+// Search the segments of a task and store the matches, with their neighboring
+// bytes when they are printed, in the task. No more than the -m limit of
+// matches is stored. buffer is used for files that are not mapped.
+void
+search_task_segments(const configuration & config,
+                     const matcher & engine,
+                     search_task & task,
+                     std::vector<uint8_t> & buffer)
+{
+    uint64_t overlap = engine.max_length() - 1;
+    std::vector<match> matches;
+
+    for (size_t index = 0; index < task.segments.size(); index++)
+    {
+        segment & part = task.segments[index];
+        input_file & in = *part.file;
+        if (limit_reached(config, task.matches.size()) ||
+            !in.open_once(config))
+        {
+            part.file.reset();
+            continue;
+        }
+
+        uint64_t length = min(part.stop - part.start + overlap,
+                              in.size - part.start);
+        length = min(length, config.range.end - part.start);
+        const uint8_t * data = nullptr;
+        if (in.data)
+        {
+            data = in.data + part.start;
+        }
+        else
+        {
+            buffer.resize(max(buffer.size(), length));
+            if (pread(in.fd, buffer.data(), length, part.start) !=
+                (ssize_t) length)
+            {
+                std::cerr << "error: Failed to read " << in.path << std::endl;
+                part.file.reset();
+                continue;
+            }
+            data = buffer.data();
+        }
+
+        matches.clear();
+        find_in_range(engine, config.range, data, length, 0,
+                      part.stop - part.start, part.start, matches);
+        task.bytes += part.stop - part.start;
+        if (config.max_count)
+            matches.resize(min(matches.size(),
+                               config.max_count - task.matches.size()));
+        for (match & found : matches)
+        {
+            uint64_t start = 0;
+            uint64_t stop = 0;
+            found.position += part.start;
+            if (!prints_context(config))
+            {
+                task.matches.push_back({index, found, 0});
+                continue;
+            }
+
+            context_range(found.position, engine.match_length(found),
+                          in.size, start, stop);
+            size_t context = task.context.size();
+            task.context.resize(context + stop - start);
+            read_context(in, start, stop, task.context.data() + context);
+            task.matches.push_back({index, found, context});
+        }
+
+        // close the file as soon as no other task needs it
+        part.file.reset();
+    }
+}
+
+// Search the files on config.jobs threads. A walker thread finds the files
+// and packs them into tasks: small files are batched, large files are split
+// into chunks that overlap by the longest pattern length - 1 bytes. Search
+// threads take the tasks in order from a shared queue, which balances the
+// load as well as per-thread queues would since the tasks are large. The
+// calling thread prints the matches task by task, so the output is the same
+// as for a serial search. Once the -m limit is reached, the walker and the
+// search threads stop at their next task.
+uint64_t
+search_parallel(const configuration & config,
+                const matcher & engine,
+                uint64_t & bytes_searched)
+{
+    const uint64_t k_chunk_size = 4 << 20;  // also the batch size
+    const size_t k_batch_files = 64;
+    const size_t max_pending = 2 * config.jobs; // tasks not yet printed
+
+    std::deque<std::shared_ptr<search_task>> tasks; // in file order
+    size_t next_task = 0;       // index in tasks of the next task to search
+    bool walk_done = false;
+    bool stopped = false;       // the -m limit is reached
+    std::mutex mutex;
+    std::condition_variable task_ready;
+    std::condition_variable task_done;
+    std::condition_variable slot_free;
+
+    auto push_task = [&](std::shared_ptr<search_task> & task)
+    {
+        if (!task || task->segments.empty())
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        slot_free.wait(lock, [&]
+        {
+            return tasks.size() < max_pending || stopped;
+        });
+        if (!stopped)
+            tasks.push_back(task);
+        task.reset();
+        task_ready.notify_one();
+    };
+
+    auto is_stopped = [&]()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stopped;
+    };
+
+    auto walker = [&]()
+    {
+        std::shared_ptr<search_task> batch;
+        uint64_t batch_bytes = 0;
+
+        walk_paths(config.paths, config.walk,
+                   [&](const std::string & path, const struct stat & file_stat)
+                   {
+                       if (is_stopped())
+                           return false;
+                       if (is_index_file(path))
+                           return true;
+
+                       std::shared_ptr<search_task> task(new search_task());
+                       if (!S_ISREG(file_stat.st_mode) ||
+                           file_compression(config, path) !=
+                           k_compression_none)
+                       {
+                           uint64_t size = S_ISREG(file_stat.st_mode) ?
+                                           file_stat.st_size :
+                                           input_file::k_unknown_size;
+                           task->stream = true;
+                           task->segments.push_back(
+                               {std::make_shared<input_file>(path, size),
+                                path, size, 0, 0});
+                           push_task(batch);
+                           push_task(task);
+                           return true;
+                       }
+
+                       uint64_t size = file_stat.st_size;
+                       if (size == 0)
+                           return true;
+
+                       std::vector<file_range> ranges;
+                       bool restricted = file_ranges(config, path,
+                                                     file_stat, ranges);
+                       if (!restricted)
+                           ranges.push_back({0, size});
+
+                       auto file = std::make_shared<input_file>(path, size);
+                       if (restricted || size > k_chunk_size)
+                       {
+                           push_task(batch);
+                           for (const file_range & range : ranges)
+                           {
+                               for (uint64_t start = range.start;
+                                    start < range.stop;
+                                    start += k_chunk_size)
+                               {
+                                   task.reset(new search_task());
+                                   uint64_t stop = min(start + k_chunk_size,
+                                                       range.stop);
+                                   task->segments.push_back(
+                                       {file, path, size, start, stop});
+                                   push_task(task);
+                               }
+                           }
+                           return true;
+                       }
+
+                       if (!batch)
+                       {
+                           batch.reset(new search_task());
+                           batch_bytes = 0;
+                       }
+                       batch->segments.push_back({file, path, size, 0, size});
+                       batch_bytes += size;
+                       if (batch_bytes >= k_chunk_size ||
+                           batch->segments.size() >= k_batch_files)
+                           push_task(batch);
+                       return true;
+                   });
+
+        push_task(batch);
+        std::lock_guard<std::mutex> lock(mutex);
+        walk_done = true;
+        task_ready.notify_all();
+        task_done.notify_all();
+    };
+
+    auto worker = [&]()
+    {
+        std::vector<uint8_t> buffer;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            task_ready.wait(lock, [&]
+            {
+                return next_task < tasks.size() || walk_done || stopped;
+            });
+            if (next_task >= tasks.size() || stopped)
+                break;
+            std::shared_ptr<search_task> task = tasks[next_task++];
+            lock.unlock();
+
+            if (!task->stream)
+                search_task_segments(config, engine, *task, buffer);
+
+            lock.lock();
+            task->done = true;
+            task_done.notify_all();
+        }
+    };
+
+    std::thread walker_thread(walker);
+    std::vector<std::thread> workers;
+    for (uint64_t i = 0; i < config.jobs; i++)
+        workers.push_back(std::thread(worker));
+
+    uint64_t match_count = 0;
+    while (!limit_reached(config, match_count))
+    {
+        std::shared_ptr<search_task> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task_done.wait(lock, [&]
+            {
+                return (!tasks.empty() && tasks.front()->done) ||
+                       (walk_done && tasks.empty());
+            });
+            if (tasks.empty())
+                break;
+            task = tasks.front();
+            tasks.pop_front();
+            next_task--;
+            slot_free.notify_all();
+        }
+
+        if (task->stream)
+        {
+            input_file & in = *task->segments[0].file;
+            if (!in.open_once(config))
+                continue;
+            if (in.compressed != k_compression_none)
+                bytes_searched += search_compressed(config, engine, in,
+                                                    match_count);
+            else
+                bytes_searched += search_pipe(config, engine, in,
+                                              match_count);
+            continue;
+        }
+
+        bytes_searched += task->bytes;
+        uint64_t count = task->matches.size();
+        if (config.max_count)
+            count = min(count, config.max_count - match_count);
+        match_count += count;
+        if (config.report == k_report_count)
+            continue;
+
+        for (uint64_t i = 0; i < count; i++)
+        {
+            const found_match & result = task->matches[i];
+            const segment & part = task->segments[result.segment];
+            uint64_t match_length = engine.match_length(result.found);
+            if (!prints_context(config))
+            {
+                print_record(config, part.path.c_str(), result.found,
+                             match_length);
+                continue;
+            }
+
+            const char * path = config.print_paths ? part.path.c_str()
+                                                   : nullptr;
+            print_match(config, path, result.found, match_length, part.size,
+                        task->context.data() + result.context);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        task_ready.notify_all();
+        slot_free.notify_all();
+    }
+
+    walker_thread.join();
+    for (std::thread & thread : workers)
+        thread.join();
+
+    return match_count;
+}
+
+// Write the index of each regular file, for --build-index. Index files found
+// in directories are skipped.
+status_code
+build_indexes(const configuration & config)
+{
+    status_code status = k_status_ok;
+    bool walked = walk_paths(config.paths, config.walk,
+               [&](const std::string & path, const struct stat & file_stat)
+               {
+                   if (!S_ISREG(file_stat.st_mode) || path == "-")
+                   {
+                       std::cerr << "error: " << path << " is not a regular "
+                                 << "file" << std::endl;
+                       status = k_status_error;
+                       return true;
+                   }
+
+                   if (is_index_file(path))
+                       return true;
+
+                   uint64_t index_size = 0;
+                   if (!build_index(path, index_size))
+                   {
+                       status = k_status_error;
+                       return true;
+                   }
+
+                   std::cout << "Indexed " << path << " in "
+                             << index_path(path) << ", " << index_size
+                             << " bytes." << std::endl;
+                   return true;
+               });
+    return walked ? status : k_status_error;
+}
+
+// Search the files while printing matching file content
+status_code search(const configuration & config)
+{
+    uint64_t match_count = 0;
+    uint64_t bytes_searched = 0;
+    matcher engine(config.patterns, config.algo);
+    auto start_time = std::chrono::steady_clock::now();
+
+    if (config.jobs > 1)
+        match_count = search_parallel(config, engine, bytes_searched);
+    else
+        match_count = search_serial(config, engine, bytes_searched);
+
+    if (config.print_stats)
+    {
+        using namespace std::chrono;
+        double seconds =
+            duration<double>(steady_clock::now() - start_time).count();
+        char input[128] = "mapped";
+        if (!maps_files(config) && config.io == k_io_uring && config.jobs == 1)
+            snprintf(input, sizeof(input), "io_uring%s, depth %u, %lu KiB",
+                     config.direct_io ? " O_DIRECT" : "", config.queue_depth,
+                     config.buffer_size >> 10);
+        else if (!maps_files(config))
+            snprintf(input, sizeof(input), "buffered, %lu KiB",
+                     config.buffer_size >> 10);
+        fprintf(stderr, "stats: algorithm....: %s\n",
+                engine.describe().c_str());
+        fprintf(stderr, "stats: input........: %s, %lu thread%s\n",
+                input, config.jobs, config.jobs > 1 ? "s" : "");
+        fprintf(stderr, "stats: time.........: %.3f s\n", seconds);
+        fprintf(stderr, "stats: bytes........: %lu\n", bytes_searched);
+        fprintf(stderr, "stats: throughput...: %.1f MB/s\n",
+                bytes_searched / seconds / 1e6);
+    }
     
+    // Keep the summary out of machine-readable output
+    config.output->flush();
+    bool machine_readable = config.match_output != k_output_text ||
+                            config.report == k_report_offsets;
+    std::ostream & summary = machine_readable ? std::cerr : std::cout;
     if (!match_count)
     {
-        std::cout << "No match found." << std::endl;
+        summary << "No match found." << std::endl;
         return k_status_error;
     }
     else
     {
         std::string es = match_count > 1 ? "es" : "";
-        std::cout << match_count << " match" << es << " found." << std::endl;
+        summary << match_count << " match" << es << " found." << std::endl;
         return k_status_ok;
     }
 }
@@ -620,6 +2349,8 @@ main (int argc, char * argv [])
     status_code status = k_status_ok;
 
     configuration config;
+    output_buffer output(STDOUT_FILENO);
+    config.output = &output;
     status = apply_command_line_options(&config, argc, argv);
     if (k_status_ok != status)
     {
@@ -629,10 +2360,10 @@ main (int argc, char * argv [])
         goto exit;
     }
 
-    status = search(config);
-
-    free(config.pattern);
-    fclose(config.file);
+    if (config.build_index)
+        status = build_indexes(config);
+    else
+        status = search(config);
 
     exit:
 
@@ -0,0 +1,170 @@
+// bfind - bit granular pattern search
+
+#include <algorithm>
+
+#include "bits.h"
+#include "matcher.h"
+#include "scan.h"
+
+namespace bfind
+{
+
+// Positions searched for all shifted patterns at a time, so that each pass
+// after the first reads the data from the cache
+static const uint64_t k_block_size = 64 << 10;
+
+bit_searcher::bit_searcher(const uint8_t * bits,
+                           uint64_t bit_length,
+                           bool aligned)
+{
+    int shift_count = aligned ? 1 : 8;
+    m_shifts.resize(shift_count);
+
+    for (int shift = 0; shift < shift_count; shift++)
+    {
+        shifted_pattern & shifted = m_shifts[shift];
+        uint64_t length = (shift + bit_length + 7) / 8;
+        shifted.bytes.assign(length, 0);
+        shifted.mask.assign(length, 0);
+
+        for (uint64_t i = 0; i < bit_length; i++)
+        {
+            uint64_t position = shift + i;
+            uint8_t bit = 0x80 >> (position % 8);
+            shifted.mask[position / 8] |= bit;
+            if (bits[i / 8] & (0x80 >> (i % 8)))
+                shifted.bytes[position / 8] |= bit;
+        }
+
+        shifted.core_start = 0;
+        shifted.core_length = 0;
+        uint64_t run = 0;
+        for (uint64_t i = 0; i < length; i++)
+        {
+            run = shifted.mask[i] == 0xff ? run + 1 : 0;
+            if (run > shifted.core_length)
+            {
+                shifted.core_start = i + 1 - run;
+                shifted.core_length = run;
+            }
+        }
+    }
+
+    // The patterns without a full byte span at most two bytes, since a
+    // third byte would put a full one in the middle
+    for (int shift = 0; shift < shift_count; shift++)
+    {
+        const shifted_pattern & shifted = m_shifts[shift];
+        if (shifted.core_length)
+            continue;
+
+        m_pair_table.resize(1 << 16);
+        for (int pair = 0; pair < (1 << 16); pair++)
+        {
+            uint8_t data[2] = {(uint8_t) (pair >> 8), (uint8_t) pair};
+            if (matches_at(shifted, data))
+                m_pair_table[pair] |= 1 << shift;
+        }
+    }
+}
+
+bool
+bit_searcher::matches_at(const shifted_pattern & shifted,
+                         const uint8_t * data) const
+{
+    for (uint64_t i = 0; i < shifted.bytes.size(); i++)
+    {
+        if ((data[i] & shifted.mask[i]) != shifted.bytes[i])
+            return false;
+    }
+    return true;
+}
+
+void
+bit_searcher::find(const uint8_t * buffer,
+                   uint64_t length,
+                   uint64_t start_limit,
+                   uint32_t index,
+                   std::vector<match> & matches) const
+{
+    start_limit = std::min(start_limit, length);
+    for (uint64_t block = 0; block < start_limit; block += k_block_size)
+    {
+        uint64_t block_limit = std::min(start_limit, block + k_block_size);
+        find_block(buffer, length, block, block_limit, index, matches);
+    }
+}
+
+void
+bit_searcher::find_block(const uint8_t * buffer,
+                         uint64_t length,
+                         uint64_t start,
+                         uint64_t start_limit,
+                         uint32_t index,
+                         std::vector<match> & matches) const
+{
+    for (uint8_t shift = 0; shift < m_shifts.size(); shift++)
+    {
+        const shifted_pattern & shifted = m_shifts[shift];
+        uint64_t pattern_length = shifted.bytes.size();
+        if (shifted.core_length == 0 || length < pattern_length)
+            continue;
+
+        // Match positions p are searched for the core at p + core_start
+        uint64_t positions = std::min(start_limit,
+                                      length - pattern_length + 1);
+        const uint8_t * core = buffer + shifted.core_start;
+        const uint8_t * core_pattern =
+            shifted.bytes.data() + shifted.core_start;
+        uint64_t position = start;
+
+        while (position < positions)
+        {
+            const uint8_t * hit =
+                find_pattern(core + position,
+                             positions - position + shifted.core_length - 1,
+                             core_pattern, shifted.core_length);
+            if (!hit)
+                break;
+
+            position = hit - core;
+            if (matches_at(shifted, buffer + position))
+                matches.push_back({position, index, shift});
+            position++;
+        }
+    }
+
+    if (m_pair_table.empty())
+        return;
+
+    const uint8_t * table = m_pair_table.data();
+    for (uint64_t position = start; position < start_limit; position++)
+    {
+        uint8_t next = position + 1 < length ? buffer[position + 1] : 0;
+        uint8_t shifts = table[(buffer[position] << 8) | next];
+        while (shifts)
+        {
+            uint8_t shift = __builtin_ctz(shifts);
+            shifts &= shifts - 1;
+            if (position + m_shifts[shift].bytes.size() <= length)
+                matches.push_back({position, index, shift});
+        }
+    }
+}
+
+uint64_t
+bit_searcher::match_length(uint8_t bit) const
+{
+    return m_shifts[bit].bytes.size();
+}
+
+uint64_t
+bit_searcher::max_length() const
+{
+    uint64_t length = 0;
+    for (const shifted_pattern & shifted : m_shifts)
+        length = std::max(length, (uint64_t) shifted.bytes.size());
+    return length;
+}
+
+} // namespace bfind
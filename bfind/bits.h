@@ -0,0 +1,73 @@
+#pragma once
+
+// bfind - bit granular pattern search
+//
+// A pattern of n bits can start at any of the 8 bit offsets in a byte. For
+// each offset, the pattern is shifted once, up front, into a byte string with
+// a mask for the partial first and last bytes. A shifted pattern with at least
+// one fully known byte is found with the vector scan (scan.h) for its longest
+// run of such bytes, and then checked under the mask. The remaining shifted
+// patterns are at most two bytes long, and are all found in one pass with a
+// table indexed by two data bytes.
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace bfind
+{
+
+struct match;
+
+class bit_searcher
+{
+    public:
+        // Search for bit_length bits, stored most significant bit first in
+        // bits. An aligned searcher only matches at bit offset 0.
+        bit_searcher(const uint8_t * bits, uint64_t bit_length, bool aligned);
+
+        // Append the matches that start in buffer[0, start_limit) and end
+        // in buffer[0, length) to matches, as pattern number index.
+        // Positions are relative to buffer and the matches are not sorted.
+        void find(const uint8_t * buffer,
+                  uint64_t length,
+                  uint64_t start_limit,
+                  uint32_t index,
+                  std::vector<match> & matches) const;
+
+        // Number of bytes covered by a match at bit offset bit
+        uint64_t match_length(uint8_t bit) const;
+
+        // Number of bytes covered by a match at the worst bit offset
+        uint64_t max_length() const;
+
+    private:
+        // The pattern shifted to one bit offset
+        struct shifted_pattern
+        {
+            std::vector<uint8_t> bytes;  // Pattern bits, zero outside mask
+            std::vector<uint8_t> mask;   // Bits that belong to the pattern
+            uint64_t core_start;         // Longest run of fully masked bytes
+            uint64_t core_length;        // 0 if there is none
+        };
+
+        bool matches_at(const shifted_pattern & shifted,
+                        const uint8_t * data) const;
+
+        // find() for the match positions [start, start_limit)
+        void find_block(const uint8_t * buffer,
+                        uint64_t length,
+                        uint64_t start,
+                        uint64_t start_limit,
+                        uint32_t index,
+                        std::vector<match> & matches) const;
+
+        std::vector<shifted_pattern> m_shifts;  // Indexed by bit offset
+
+        // For the shifted patterns without a fully known byte: bit b of
+        // m_pair_table[(x << 8) | y] is set if the pattern shifted to bit
+        // offset b matches the bytes x, y. Empty if no such pattern.
+        std::vector<uint8_t> m_pair_table;
+};
+
+} // namespace bfind
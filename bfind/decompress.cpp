@@ -0,0 +1,451 @@
+// bfind - streaming decompression of gzip, xz and zstd files
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <lzma.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+#include "decompress.h"
+
+namespace bfind
+{
+
+// Number of blocks decompressed ahead of the caller, plus the one it holds
+static const unsigned k_slots = 4;
+
+// Compressed bytes per read
+static const uint64_t k_input_size = 256 << 10;
+
+// The part of the libzstd API that is used, as declared in zstd.h
+struct zstd_in_buffer
+{
+    const void * src;
+    size_t size;
+    size_t pos;
+};
+
+struct zstd_out_buffer
+{
+    void * dst;
+    size_t size;
+    size_t pos;
+};
+
+struct zstd_library
+{
+    void * (*create_dctx)();
+    size_t (*free_dctx)(void * dctx);
+    size_t (*decompress_stream)(void * dctx,
+                                zstd_out_buffer * output,
+                                zstd_in_buffer * input);
+    unsigned (*is_error)(size_t code);
+    const char * (*get_error_name)(size_t code);
+};
+
+// Load libzstd on first use. Returns nullptr if it is not installed.
+static const zstd_library *
+load_zstd()
+{
+    static zstd_library library;
+    static bool loaded = false;
+    static std::once_flag once;
+    std::call_once(once, []
+    {
+        void * handle = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (!handle)
+            return;
+
+        library.create_dctx =
+            (void * (*)()) dlsym(handle, "ZSTD_createDCtx");
+        library.free_dctx =
+            (size_t (*)(void *)) dlsym(handle, "ZSTD_freeDCtx");
+        library.decompress_stream =
+            (size_t (*)(void *, zstd_out_buffer *, zstd_in_buffer *))
+            dlsym(handle, "ZSTD_decompressStream");
+        library.is_error =
+            (unsigned (*)(size_t)) dlsym(handle, "ZSTD_isError");
+        library.get_error_name =
+            (const char * (*)(size_t)) dlsym(handle, "ZSTD_getErrorName");
+        loaded = library.create_dctx && library.free_dctx &&
+                 library.decompress_stream && library.is_error &&
+                 library.get_error_name;
+    });
+    return loaded ? &library : nullptr;
+}
+
+static const char *
+lzma_message(lzma_ret result)
+{
+    switch (result)
+    {
+        case LZMA_MEM_ERROR:     return "out of memory";
+        case LZMA_FORMAT_ERROR:  return "not in xz format";
+        case LZMA_OPTIONS_ERROR: return "unsupported options";
+        case LZMA_DATA_ERROR:    return "corrupt data";
+        case LZMA_BUF_ERROR:     return "unexpected end of data";
+        default:                 return "decoder error";
+    }
+}
+
+const char *
+compression_name(compression kind)
+{
+    switch (kind)
+    {
+        case k_compression_none: return "none";
+        case k_compression_gzip: return "gzip";
+        case k_compression_xz:   return "xz";
+        case k_compression_zstd: return "zstd";
+        default:                 return "unknown";
+    }
+}
+
+compression
+detect_compression(int fd)
+{
+    static const uint8_t k_gzip_magic[] = {0x1f, 0x8b};
+    static const uint8_t k_xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+    static const uint8_t k_zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+    uint8_t magic[6];
+    ssize_t length = pread(fd, magic, sizeof(magic), 0);
+    if (length >= (ssize_t) sizeof(k_xz_magic) &&
+        0 == memcmp(magic, k_xz_magic, sizeof(k_xz_magic)))
+        return k_compression_xz;
+    if (length >= (ssize_t) sizeof(k_zstd_magic) &&
+        0 == memcmp(magic, k_zstd_magic, sizeof(k_zstd_magic)))
+        return k_compression_zstd;
+    if (length >= (ssize_t) sizeof(k_gzip_magic) &&
+        0 == memcmp(magic, k_gzip_magic, sizeof(k_gzip_magic)))
+        return k_compression_gzip;
+    return k_compression_none;
+}
+
+decompressor::decompressor(int fd,
+                           compression kind,
+                           uint64_t block_size,
+                           uint64_t headroom) :
+    m_fd(fd),
+    m_kind(kind),
+    m_block_size(block_size),
+    m_headroom(headroom)
+{
+}
+
+decompressor::~decompressor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_freed.notify_all();
+    }
+    if (m_thread.joinable())
+        m_thread.join();
+
+    end_decoder();
+    free(m_memory);
+}
+
+bool
+decompressor::start()
+{
+    switch (m_kind)
+    {
+        case k_compression_gzip:
+        {
+            z_stream * stream = new z_stream();
+            // 32 lets zlib detect the gzip header
+            if (inflateInit2(stream, 15 + 32) != Z_OK)
+            {
+                delete stream;
+                m_error = "Failed to set up the gzip decoder";
+                return false;
+            }
+            m_decoder = stream;
+            break;
+        }
+        case k_compression_xz:
+        {
+            lzma_stream * stream = new lzma_stream();
+            *stream = LZMA_STREAM_INIT;
+            lzma_ret result = lzma_stream_decoder(stream, UINT64_MAX,
+                                                  LZMA_CONCATENATED);
+            if (result != LZMA_OK)
+            {
+                delete stream;
+                m_error = std::string("Failed to set up the xz decoder: ") +
+                          lzma_message(result);
+                return false;
+            }
+            m_decoder = stream;
+            break;
+        }
+        case k_compression_zstd:
+        {
+            const zstd_library * zstd = load_zstd();
+            if (zstd)
+                m_decoder = zstd->create_dctx();
+            if (!m_decoder)
+            {
+                m_error = "zstd files need libzstd.so.1";
+                return false;
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+
+    uint64_t slot_size = m_headroom + m_block_size;
+    m_memory = (uint8_t *) malloc(k_slots * slot_size);
+    for (unsigned i = 0; i < k_slots; i++)
+        m_slots.push_back({m_memory + i * slot_size + m_headroom, 0});
+    m_input.resize(k_input_size);
+
+    m_thread = std::thread(&decompressor::produce, this);
+    return true;
+}
+
+void
+decompressor::end_decoder()
+{
+    if (!m_decoder)
+        return;
+
+    switch (m_kind)
+    {
+        case k_compression_gzip:
+            inflateEnd((z_stream *) m_decoder);
+            delete (z_stream *) m_decoder;
+            break;
+        case k_compression_xz:
+            lzma_end((lzma_stream *) m_decoder);
+            delete (lzma_stream *) m_decoder;
+            break;
+        case k_compression_zstd:
+            load_zstd()->free_dctx(m_decoder);
+            break;
+        default:
+            break;
+    }
+    m_decoder = nullptr;
+}
+
+bool
+decompressor::next(uint8_t * & data, uint64_t & length)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // the caller is done with the previous block, reuse its buffer
+    if (m_released < m_consumed)
+    {
+        m_released++;
+        m_freed.notify_one();
+    }
+
+    m_filled.wait(lock, [&]
+    {
+        return m_consumed < m_produced || m_finished;
+    });
+    if (m_consumed == m_produced)
+        return false;
+
+    slot & s = m_slots[m_consumed++ % k_slots];
+    data = s.buffer;
+    length = s.length;
+    return true;
+}
+
+void
+decompressor::produce()
+{
+    bool decoded = true;
+    while (decoded && !m_stream_end)
+    {
+        slot * s = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_freed.wait(lock, [&]
+            {
+                return m_produced - m_released < k_slots || m_stop;
+            });
+            if (m_stop)
+                break;
+            s = &m_slots[m_produced % k_slots];
+        }
+
+        decoded = decode(s->buffer, m_block_size, s->length);
+        if (s->length)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_produced++;
+            m_filled.notify_one();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!decoded)
+        m_error = std::string("Failed to decompress ") +
+                  compression_name(m_kind) + " data: " + m_error;
+    m_finished = true;
+    m_filled.notify_one();
+}
+
+std::string
+decompressor::error()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_error;
+}
+
+bool
+decompressor::refill()
+{
+    // keep the bytes that are not decoded yet
+    memmove(m_input.data(), m_input.data() + m_input_pos,
+            m_input_length - m_input_pos);
+    m_input_length -= m_input_pos;
+    m_input_pos = 0;
+
+    while (!m_input_end && m_input_length < m_input.size())
+    {
+        ssize_t bytes_read = read(m_fd, m_input.data() + m_input_length,
+                                  m_input.size() - m_input_length);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0)
+        {
+            m_error = strerror(errno);
+            return false;
+        }
+        if (bytes_read == 0)
+            m_input_end = true;
+        m_input_length += bytes_read;
+        if (bytes_read > 0)
+            break;
+    }
+    return true;
+}
+
+bool
+decompressor::decode(uint8_t * dst, uint64_t capacity, uint64_t & length)
+{
+    length = 0;
+    while (length < capacity && !m_stream_end)
+    {
+        if (m_input_pos == m_input_length && !m_input_end && !refill())
+            return false;
+
+        const uint8_t * input = m_input.data() + m_input_pos;
+        uint64_t input_length = m_input_length - m_input_pos;
+        uint64_t used = 0;          // input bytes decoded by this step
+        uint64_t produced = 0;      // output bytes of this step
+
+        switch (m_kind)
+        {
+            case k_compression_gzip:
+            {
+                z_stream * stream = (z_stream *) m_decoder;
+                stream->next_in = (Bytef *) input;
+                stream->avail_in = std::min(input_length,
+                                            (uint64_t) UINT32_MAX);
+                stream->next_out = dst + length;
+                stream->avail_out = std::min(capacity - length,
+                                             (uint64_t) UINT32_MAX);
+                uInt avail_in = stream->avail_in;
+                uInt avail_out = stream->avail_out;
+                int result = inflate(stream, Z_NO_FLUSH);
+                used = avail_in - stream->avail_in;
+                produced = avail_out - stream->avail_out;
+
+                if (result == Z_STREAM_END)
+                {
+                    // gzip files can hold several members, anything else
+                    // after the last one is ignored like gzip does
+                    m_input_pos += used;
+                    length += produced;
+                    while (m_input_length - m_input_pos < 2 && !m_input_end)
+                    {
+                        if (!refill())
+                            return false;
+                    }
+                    if (m_input_length - m_input_pos >= 2 &&
+                        m_input[m_input_pos] == 0x1f &&
+                        m_input[m_input_pos + 1] == 0x8b)
+                        inflateReset(stream);
+                    else
+                        m_stream_end = true;
+                    continue;
+                }
+                if (result != Z_OK && result != Z_BUF_ERROR)
+                {
+                    m_error = stream->msg ? stream->msg : "corrupt data";
+                    return false;
+                }
+                break;
+            }
+            case k_compression_xz:
+            {
+                lzma_stream * stream = (lzma_stream *) m_decoder;
+                stream->next_in = input;
+                stream->avail_in = input_length;
+                stream->next_out = dst + length;
+                stream->avail_out = capacity - length;
+                // the decoder only knows that no stream follows at the end
+                lzma_ret result = lzma_code(stream, m_input_end ? LZMA_FINISH
+                                                                : LZMA_RUN);
+                used = input_length - stream->avail_in;
+                produced = capacity - length - stream->avail_out;
+
+                if (result == LZMA_STREAM_END)
+                    m_stream_end = true;
+                else if (result != LZMA_OK)
+                {
+                    m_error = lzma_message(result);
+                    return false;
+                }
+                break;
+            }
+            case k_compression_zstd:
+            {
+                const zstd_library * zstd = load_zstd();
+                zstd_in_buffer in = {input, input_length, 0};
+                zstd_out_buffer out = {dst + length, capacity - length, 0};
+                size_t result = zstd->decompress_stream(m_decoder, &out, &in);
+                if (zstd->is_error(result))
+                {
+                    m_error = zstd->get_error_name(result);
+                    return false;
+                }
+                used = in.pos;
+                produced = out.pos;
+
+                // 0 once a frame is complete, and another one may follow
+                if (used || produced)
+                    m_frame_end = result == 0;
+                if (m_frame_end && m_input_end && in.pos == in.size)
+                    m_stream_end = true;
+                break;
+            }
+            default:
+                m_error = "unknown compression";
+                return false;
+        }
+
+        m_input_pos += used;
+        length += produced;
+        if (!used && !produced && m_input_end && !m_stream_end)
+        {
+            m_error = "unexpected end of data";
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace bfind
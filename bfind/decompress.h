@@ -0,0 +1,114 @@
+#pragma once
+
+// bfind - streaming decompression of gzip, xz and zstd files
+//
+// A decompressor inflates a file on its own thread, into a few blocks that
+// the caller scans while the next ones are decompressed. gzip and xz use
+// zlib and liblzma. libzstd is loaded when a zstd file is first found, so
+// that bfind neither needs its headers to build nor the library to run.
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bfind
+{
+
+enum compression
+{
+    k_compression_none,
+    k_compression_gzip,
+    k_compression_xz,
+    k_compression_zstd,
+};
+
+const char *
+compression_name(compression kind);
+
+// Detect the compression of the file fd from its first bytes. Files that can
+// not be read from offset 0, like pipes, are reported as not compressed.
+compression
+detect_compression(int fd);
+
+class decompressor
+{
+    public:
+        // Decompress the file fd, read from its current offset, in blocks of
+        // block_size bytes. At least headroom bytes in front of each block
+        // are free for the caller.
+        decompressor(int fd,
+                     compression kind,
+                     uint64_t block_size,
+                     uint64_t headroom);
+        ~decompressor();
+
+        decompressor(const decompressor &) = delete;
+        decompressor & operator=(const decompressor &) = delete;
+
+        // Set up the decoder and start the decompression thread. Returns
+        // false if the decoder is not available, see error().
+        bool start();
+
+        // Wait for the next block of decompressed data. The block stays
+        // valid until the next call. Returns false at the end of the data,
+        // and if the file could not be decompressed, see error().
+        bool next(uint8_t * & data, uint64_t & length);
+
+        // Why start() or next() failed, or empty if they did not
+        std::string error();
+
+    private:
+        struct slot
+        {
+            uint8_t * buffer;    // Block data, after the headroom
+            uint64_t length;     // Decompressed bytes in the block
+        };
+
+        // The decompression thread: fill free slots until the end
+        void produce();
+
+        // Decompress up to capacity bytes to dst. Returns false, with
+        // m_error set, if the data is corrupt or could not be read.
+        bool decode(uint8_t * dst, uint64_t capacity, uint64_t & length);
+
+        // Read more compressed data once the input buffer is used up. Sets
+        // m_input_end at the end of the file.
+        bool refill();
+
+        void end_decoder();
+
+        int m_fd;
+        compression m_kind;
+        uint64_t m_block_size;
+        uint64_t m_headroom;
+        std::vector<slot> m_slots;
+        uint8_t * m_memory = nullptr;
+
+        // Compressed input, [m_input_pos, m_input_length) is not decoded yet
+        std::vector<uint8_t> m_input;
+        uint64_t m_input_pos = 0;
+        uint64_t m_input_length = 0;
+        bool m_input_end = false;
+
+        void * m_decoder = nullptr;     // z_stream, lzma_stream or ZSTD_DCtx
+        bool m_stream_end = false;      // The last stream or frame is done
+        bool m_frame_end = false;       // The input ends a zstd frame
+        std::string m_error;
+
+        // Shared between the threads
+        std::thread m_thread;
+        std::mutex m_mutex;
+        std::condition_variable m_filled;
+        std::condition_variable m_freed;
+        uint64_t m_produced = 0;        // Blocks decompressed
+        uint64_t m_consumed = 0;        // Blocks returned by next()
+        uint64_t m_released = 0;        // Blocks the caller is done with
+        bool m_finished = false;        // No more blocks will be produced
+        bool m_stop = false;            // The caller stopped early
+};
+
+} // namespace bfind
@@ -0,0 +1,1121 @@
+// bfind - regular expressions over bytes with a lazy DFA
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <bitset>
+#include <map>
+
+#include "dfa.h"
+#include "matcher.h"
+#include "scan.h"
+
+namespace bfind
+{
+
+// Longest match, and number of NFA states, an expression may compile to
+static const uint64_t k_max_match_length = 65535;
+static const uint64_t k_max_nfa_states = 1 << 20;
+
+// DFA states kept per cache, the cache is flushed when it is full
+static const size_t k_max_dfa_states = 4096;
+
+// Flushes in one buffer after which the reversed DFA is given up on, since
+// it builds a new state for almost every byte
+static const int k_max_flushes = 4;
+
+// Fixed bytes at the start of an expression that are searched for
+static const uint64_t k_max_prefix = 64;
+
+typedef std::bitset<256> byte_set;
+
+enum nfa_op
+{
+    k_op_bytes,  // Consume a byte in a set
+    k_op_split,  // Continue at both out and out2, without consuming a byte
+    k_op_match,  // A match ends here
+};
+
+struct nfa_state
+{
+    nfa_op op;
+    uint32_t out;    // Next state for k_op_bytes and k_op_split
+    uint32_t out2;   // Other next state for k_op_split
+    uint32_t bytes;  // Index in dfa_program::sets for k_op_bytes
+};
+
+struct dfa_program
+{
+    std::vector<nfa_state> states;
+    std::vector<byte_set> sets;
+    uint32_t start = 0;
+};
+
+// DFA state flags
+static const uint8_t k_accepting = 1;  // Some NFA state is k_op_match
+static const uint8_t k_dead = 2;       // No NFA state is left
+
+// The lazily built DFA of a program. The next state for byte b in state s is
+// next[s * 256 + b], or -1 if it was not built yet.
+struct dfa_cache
+{
+    const dfa_program * program = nullptr;
+    bool unanchored = false;    // A match may start at every byte
+    std::vector<int32_t> next;
+    std::vector<uint8_t> flags;
+    std::vector<std::vector<uint32_t>> sets;  // NFA states of each state
+    std::map<std::vector<uint32_t>, int32_t> ids;
+    int32_t start = -1;         // -1 until built
+    std::vector<uint32_t> start_set;
+    std::vector<uint8_t> seen;  // Scratch space for closures
+    std::vector<uint32_t> visited;
+    std::vector<uint32_t> stack;
+    int flushes = 0;
+};
+
+struct regex_searcher::caches
+{
+    dfa_cache forward;
+    dfa_cache reversed;
+    std::vector<uint64_t> starts;
+};
+
+// A node of the syntax tree of an expression
+struct regex_node
+{
+    enum kind
+    {
+        k_bytes,      // One byte of a set
+        k_concat,     // The children in order
+        k_alternate,  // One of the children
+        k_repeat,     // The child min to max times
+    };
+
+    kind type;
+    byte_set bytes;
+    std::vector<uint32_t> children;  // Indexes in regex_parser::nodes
+    uint64_t min = 0;
+    uint64_t max = 0;
+};
+
+// Recursive descent parser for
+//   alternation := concatenation ('|' concatenation)*
+//   concatenation := (atom quantifier*)*
+//   atom := byte | '.' | '\' escape | '[' class ']' | '(' alternation ')'
+//   quantifier := '?' | '{n}' | '{n,m}'
+class regex_parser
+{
+    public:
+        regex_parser(const std::string & text, bool fold_case) :
+            m_text(text),
+            m_fold_case(fold_case)
+        {
+        }
+
+        // Parse the whole text. Returns false, and sets error, if it is not
+        // a supported expression.
+        bool parse(uint32_t & root)
+        {
+            if (!alternation(root))
+                return false;
+            if (m_position < m_text.size())
+                return fail("unmatched )");
+            return true;
+        }
+
+        std::vector<regex_node> nodes;
+        std::string error;
+
+    private:
+        bool fail(const std::string & message)
+        {
+            error = message;
+            return false;
+        }
+
+        bool at_end() const
+        {
+            return m_position >= m_text.size();
+        }
+
+        char peek() const
+        {
+            return m_text[m_position];
+        }
+
+        uint32_t add(regex_node::kind type)
+        {
+            nodes.push_back(regex_node());
+            nodes.back().type = type;
+            return nodes.size() - 1;
+        }
+
+        uint32_t add_bytes(const byte_set & bytes)
+        {
+            uint32_t node = add(regex_node::k_bytes);
+            nodes[node].bytes = bytes;
+            return node;
+        }
+
+        // Add the other case of the letters in bytes
+        void fold(byte_set & bytes) const
+        {
+            if (!m_fold_case)
+                return;
+            for (int byte = 'A'; byte <= 'Z'; byte++)
+            {
+                if (bytes[byte] || bytes[byte | 0x20])
+                {
+                    bytes.set(byte);
+                    bytes.set(byte | 0x20);
+                }
+            }
+        }
+
+        bool alternation(uint32_t & node)
+        {
+            uint32_t first = 0;
+            if (!concatenation(first))
+                return false;
+            if (at_end() || peek() != '|')
+            {
+                node = first;
+                return true;
+            }
+
+            node = add(regex_node::k_alternate);
+            nodes[node].children.push_back(first);
+            while (!at_end() && peek() == '|')
+            {
+                m_position++;
+                uint32_t next = 0;
+                if (!concatenation(next))
+                    return false;
+                nodes[node].children.push_back(next);
+            }
+            return true;
+        }
+
+        bool concatenation(uint32_t & node)
+        {
+            node = add(regex_node::k_concat);
+            while (!at_end() && peek() != '|' && peek() != ')')
+            {
+                uint32_t item = 0;
+                if (!atom(item) || !quantifiers(item))
+                    return false;
+                nodes[node].children.push_back(item);
+            }
+            return true;
+        }
+
+        bool number(uint64_t & value)
+        {
+            if (at_end() || !isdigit(peek()))
+                return fail("expected a number in {}");
+            value = 0;
+            while (!at_end() && isdigit(peek()))
+            {
+                value = value * 10 + (peek() - '0');
+                if (value > k_max_match_length)
+                    return fail("repetition count too large");
+                m_position++;
+            }
+            return true;
+        }
+
+        bool quantifiers(uint32_t & node)
+        {
+            while (!at_end())
+            {
+                uint64_t min = 0;
+                uint64_t max = 0;
+                char c = peek();
+                if (c == '*' || c == '+')
+                {
+                    return fail(std::string("unbounded repetition ") + c +
+                                " is not supported, use {n,m}");
+                }
+                else if (c == '?')
+                {
+                    m_position++;
+                    max = 1;
+                }
+                else if (c == '{')
+                {
+                    m_position++;
+                    if (!number(min))
+                        return false;
+                    max = min;
+                    if (!at_end() && peek() == ',')
+                    {
+                        m_position++;
+                        if (!at_end() && peek() == '}')
+                            return fail("unbounded repetition {n,} is not "
+                                        "supported, use {n,m}");
+                        if (!number(max))
+                            return false;
+                    }
+                    if (at_end() || peek() != '}')
+                        return fail("expected } after repetition count");
+                    m_position++;
+                    if (max < min)
+                        return fail("repetition {n,m} with m < n");
+                }
+                else
+                {
+                    return true;
+                }
+
+                uint32_t repeat = add(regex_node::k_repeat);
+                nodes[repeat].children.push_back(node);
+                nodes[repeat].min = min;
+                nodes[repeat].max = max;
+                node = repeat;
+            }
+            return true;
+        }
+
+        static int hex_digit(char c)
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            c = tolower(c);
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            return -1;
+        }
+
+        // Parse the escape after a backslash into bytes. single is set if
+        // it stands for one byte, which can end a range in a class.
+        bool escape(byte_set & bytes, bool & single)
+        {
+            if (at_end())
+                return fail("trailing backslash");
+            char c = m_text[m_position++];
+            bytes.reset();
+            single = false;
+            switch (c)
+            {
+                case 'd':
+                case 'D':
+                    for (int byte = '0'; byte <= '9'; byte++)
+                        bytes.set(byte);
+                    break;
+                case 'w':
+                case 'W':
+                    for (int byte = 0; byte < 256; byte++)
+                        bytes[byte] = isalnum(byte) || byte == '_';
+                    break;
+                case 's':
+                case 'S':
+                    for (const char * space = " \t\n\r\f\v"; *space; space++)
+                        bytes.set(*space);
+                    break;
+                case 'x':
+                {
+                    if (m_position + 2 > m_text.size() ||
+                        hex_digit(m_text[m_position]) < 0 ||
+                        hex_digit(m_text[m_position + 1]) < 0)
+                        return fail("\\x needs two hexadecimal digits");
+                    bytes.set(hex_digit(m_text[m_position]) * 16 +
+                              hex_digit(m_text[m_position + 1]));
+                    m_position += 2;
+                    single = true;
+                    break;
+                }
+                case 'n': bytes.set('\n'); single = true; break;
+                case 'r': bytes.set('\r'); single = true; break;
+                case 't': bytes.set('\t'); single = true; break;
+                case 'f': bytes.set('\f'); single = true; break;
+                case 'v': bytes.set('\v'); single = true; break;
+                case '0': bytes.set(0); single = true; break;
+                default:
+                    if (isalnum(c))
+                        return fail(std::string("unknown escape \\") + c);
+                    bytes.set((uint8_t) c);
+                    single = true;
+                    break;
+            }
+
+            if (c == 'D' || c == 'W' || c == 'S')
+                bytes.flip();
+            return true;
+        }
+
+        bool byte_class(byte_set & bytes)
+        {
+            bool negate = !at_end() && peek() == '^';
+            if (negate)
+                m_position++;
+
+            bytes.reset();
+            bool first = true;
+            while (true)
+            {
+                if (at_end())
+                    return fail("unmatched [");
+                if (peek() == ']' && !first)
+                    break;
+                first = false;
+
+                byte_set item;
+                bool single = true;
+                uint8_t low = m_text[m_position++];
+                if (low == '\\')
+                {
+                    if (!escape(item, single))
+                        return false;
+                    low = single ? item._Find_first() : 0;
+                }
+                else
+                {
+                    item.set(low);
+                }
+
+                if (m_position + 1 < m_text.size() && peek() == '-' &&
+                    m_text[m_position + 1] != ']')
+                {
+                    m_position++;
+                    uint8_t high = m_text[m_position++];
+                    if (high == '\\')
+                    {
+                        byte_set end;
+                        bool end_single = true;
+                        if (!escape(end, end_single))
+                            return false;
+                        if (!end_single)
+                            return fail("bad range in []");
+                        high = end._Find_first();
+                    }
+                    if (!single || high < low)
+                        return fail("bad range in []");
+                    for (int byte = low; byte <= high; byte++)
+                        item.set(byte);
+                }
+                bytes |= item;
+            }
+            m_position++;
+
+            fold(bytes);
+            if (negate)
+                bytes.flip();
+            return true;
+        }
+
+        bool atom(uint32_t & node)
+        {
+            char c = m_text[m_position++];
+            byte_set bytes;
+            bool single = true;
+            switch (c)
+            {
+                case '(':
+                    if (m_text.compare(m_position, 2, "?:") == 0)
+                        m_position += 2;
+                    if (!alternation(node))
+                        return false;
+                    if (at_end() || peek() != ')')
+                        return fail("unmatched (");
+                    m_position++;
+                    return true;
+                case '[':
+                    if (!byte_class(bytes))
+                        return false;
+                    break;
+                case '.':
+                    bytes.set();
+                    break;
+                case '\\':
+                    if (!escape(bytes, single))
+                        return false;
+                    fold(bytes);
+                    break;
+                case '^':
+                case '$':
+                    return fail("anchors are not supported");
+                case '*':
+                case '+':
+                case '?':
+                case '{':
+                    return fail(std::string("nothing to repeat before ") + c);
+                default:
+                    bytes.set((uint8_t) c);
+                    fold(bytes);
+                    break;
+            }
+            node = add_bytes(bytes);
+            return true;
+        }
+
+        const std::string & m_text;
+        bool m_fold_case;
+        size_t m_position = 0;
+};
+
+// Shortest and longest match of a node, saturated at k_max_match_length + 1
+static void
+match_lengths(const std::vector<regex_node> & nodes,
+              uint32_t index,
+              uint64_t & min,
+              uint64_t & max)
+{
+    const uint64_t k_limit = k_max_match_length + 1;
+    const regex_node & node = nodes[index];
+    switch (node.type)
+    {
+        case regex_node::k_bytes:
+            min = max = 1;
+            break;
+        case regex_node::k_concat:
+            min = max = 0;
+            for (uint32_t child : node.children)
+            {
+                uint64_t child_min = 0;
+                uint64_t child_max = 0;
+                match_lengths(nodes, child, child_min, child_max);
+                min = std::min(min + child_min, k_limit);
+                max = std::min(max + child_max, k_limit);
+            }
+            break;
+        case regex_node::k_alternate:
+            min = k_limit;
+            max = 0;
+            for (uint32_t child : node.children)
+            {
+                uint64_t child_min = 0;
+                uint64_t child_max = 0;
+                match_lengths(nodes, child, child_min, child_max);
+                min = std::min(min, child_min);
+                max = std::max(max, child_max);
+            }
+            break;
+        case regex_node::k_repeat:
+            match_lengths(nodes, node.children[0], min, max);
+            min = std::min(min * node.min, k_limit);
+            max = std::min(max * node.max, k_limit);
+            break;
+    }
+}
+
+// Number of NFA states a node compiles to, saturated at k_max_nfa_states + 1
+static uint64_t
+nfa_size(const std::vector<regex_node> & nodes, uint32_t index)
+{
+    const uint64_t k_limit = k_max_nfa_states + 1;
+    const regex_node & node = nodes[index];
+    uint64_t size = 1;
+    switch (node.type)
+    {
+        case regex_node::k_bytes:
+            break;
+        case regex_node::k_concat:
+        case regex_node::k_alternate:
+            for (uint32_t child : node.children)
+                size = std::min(size + nfa_size(nodes, child), k_limit);
+            break;
+        case regex_node::k_repeat:
+            size = std::min((nfa_size(nodes, node.children[0]) + 1) *
+                            std::max(node.max, (uint64_t) 1), k_limit);
+            break;
+    }
+    return size;
+}
+
+// An NFA fragment under construction. outs are the unset next states, as
+// state * 2 for out and state * 2 + 1 for out2.
+struct nfa_fragment
+{
+    uint32_t start;
+    std::vector<uint32_t> outs;
+};
+
+class nfa_builder
+{
+    public:
+        nfa_builder(const std::vector<regex_node> & nodes,
+                    dfa_program & program) :
+            m_nodes(nodes),
+            m_program(program)
+        {
+        }
+
+        // Compile the expression, with concatenations reversed if reversed
+        // is set, so that the program matches the data read backward
+        void build(uint32_t root, bool reversed)
+        {
+            nfa_fragment fragment = emit(root, reversed);
+            uint32_t match = add(k_op_match);
+            patch(fragment.outs, match);
+            m_program.start = fragment.start;
+        }
+
+    private:
+        uint32_t add(nfa_op op)
+        {
+            m_program.states.push_back({op, 0, 0, 0});
+            return m_program.states.size() - 1;
+        }
+
+        void patch(const std::vector<uint32_t> & outs, uint32_t target)
+        {
+            for (uint32_t out : outs)
+            {
+                nfa_state & state = m_program.states[out / 2];
+                if (out % 2)
+                    state.out2 = target;
+                else
+                    state.out = target;
+            }
+        }
+
+        nfa_fragment empty()
+        {
+            uint32_t split = add(k_op_split);
+            return {split, {split * 2, split * 2 + 1}};
+        }
+
+        // Append next to fragment, which is unset if !started
+        void append(nfa_fragment & fragment,
+                    bool & started,
+                    nfa_fragment & next)
+        {
+            if (started)
+            {
+                patch(fragment.outs, next.start);
+                fragment.outs.swap(next.outs);
+            }
+            else
+            {
+                fragment = next;
+                started = true;
+            }
+        }
+
+        nfa_fragment emit(uint32_t index, bool reversed)
+        {
+            const regex_node & node = m_nodes[index];
+            nfa_fragment fragment;
+            bool started = false;
+
+            switch (node.type)
+            {
+                case regex_node::k_bytes:
+                {
+                    uint32_t state = add(k_op_bytes);
+                    m_program.states[state].bytes = m_program.sets.size();
+                    m_program.sets.push_back(node.bytes);
+                    return {state, {state * 2}};
+                }
+                case regex_node::k_concat:
+                {
+                    size_t count = node.children.size();
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        uint32_t child =
+                            node.children[reversed ? count - 1 - i : i];
+                        nfa_fragment next = emit(child, reversed);
+                        append(fragment, started, next);
+                    }
+                    break;
+                }
+                case regex_node::k_alternate:
+                {
+                    for (uint32_t child : node.children)
+                    {
+                        nfa_fragment next = emit(child, reversed);
+                        if (!started)
+                        {
+                            fragment = next;
+                            started = true;
+                            continue;
+                        }
+                        uint32_t split = add(k_op_split);
+                        m_program.states[split].out = fragment.start;
+                        m_program.states[split].out2 = next.start;
+                        fragment.start = split;
+                        fragment.outs.insert(fragment.outs.end(),
+                                             next.outs.begin(),
+                                             next.outs.end());
+                    }
+                    break;
+                }
+                case regex_node::k_repeat:
+                {
+                    for (uint64_t i = 0; i < node.min; i++)
+                    {
+                        nfa_fragment next = emit(node.children[0], reversed);
+                        append(fragment, started, next);
+                    }
+
+                    // Each optional copy is entered from a split, which can
+                    // also skip it and the ones after it
+                    std::vector<uint32_t> skips;
+                    for (uint64_t i = node.min; i < node.max; i++)
+                    {
+                        uint32_t split = add(k_op_split);
+                        nfa_fragment next = emit(node.children[0], reversed);
+                        m_program.states[split].out = next.start;
+                        skips.push_back(split * 2 + 1);
+                        nfa_fragment entry = {split, next.outs};
+                        append(fragment, started, entry);
+                    }
+                    if (started)
+                        fragment.outs.insert(fragment.outs.end(),
+                                             skips.begin(), skips.end());
+                    break;
+                }
+            }
+
+            if (!started)
+                return empty();
+            return fragment;
+        }
+
+        const std::vector<regex_node> & m_nodes;
+        dfa_program & m_program;
+};
+
+// Return true if the bytes are those b with (b & mask) == value, for a mask
+// with at least one bit set
+static bool
+masked_byte(const byte_set & bytes, uint8_t & value, uint8_t & mask)
+{
+    if (bytes.none())
+        return false;
+
+    uint8_t all_and = 0xff;
+    uint8_t all_or = 0;
+    for (int byte = 0; byte < 256; byte++)
+    {
+        if (bytes[byte])
+        {
+            all_and &= byte;
+            all_or |= byte;
+        }
+    }
+
+    // The bits that are the same in all of the bytes
+    mask = ~(all_and ^ all_or);
+    value = all_and & mask;
+    return mask != 0 &&
+           bytes.count() == (size_t) 1 << (8 - __builtin_popcount(mask));
+}
+
+// Append the fixed bytes at the start of every match of the node to value
+// and mask. Returns false where they end.
+static bool
+collect_prefix(const std::vector<regex_node> & nodes,
+               uint32_t index,
+               std::vector<uint8_t> & value,
+               std::vector<uint8_t> & mask)
+{
+    const regex_node & node = nodes[index];
+    if (value.size() >= k_max_prefix)
+        return false;
+
+    switch (node.type)
+    {
+        case regex_node::k_bytes:
+        {
+            uint8_t byte_value = 0;
+            uint8_t byte_mask = 0;
+            if (!masked_byte(node.bytes, byte_value, byte_mask))
+                return false;
+            value.push_back(byte_value);
+            mask.push_back(byte_mask);
+            return true;
+        }
+        case regex_node::k_concat:
+            for (uint32_t child : node.children)
+            {
+                if (!collect_prefix(nodes, child, value, mask))
+                    return false;
+            }
+            return true;
+        case regex_node::k_repeat:
+            for (uint64_t i = 0; i < node.min; i++)
+            {
+                if (!collect_prefix(nodes, node.children[0], value, mask))
+                    return false;
+            }
+            return node.min == node.max;
+        default:
+            return false;
+    }
+}
+
+// Add the NFA states reachable from state without consuming a byte to set,
+// leaving out the splits. The states are marked in cache.seen until
+// clear_seen() is called.
+static void
+add_closure(dfa_cache & cache, uint32_t state, std::vector<uint32_t> & set)
+{
+    const std::vector<nfa_state> & states = cache.program->states;
+    cache.stack.assign(1, state);
+    while (!cache.stack.empty())
+    {
+        uint32_t current = cache.stack.back();
+        cache.stack.pop_back();
+        if (cache.seen[current])
+            continue;
+        cache.seen[current] = 1;
+        cache.visited.push_back(current);
+
+        if (states[current].op == k_op_split)
+        {
+            cache.stack.push_back(states[current].out2);
+            cache.stack.push_back(states[current].out);
+        }
+        else
+        {
+            set.push_back(current);
+        }
+    }
+}
+
+static void
+clear_seen(dfa_cache & cache)
+{
+    for (uint32_t state : cache.visited)
+        cache.seen[state] = 0;
+    cache.visited.clear();
+}
+
+static void
+init_cache(dfa_cache & cache, const dfa_program & program, bool unanchored)
+{
+    cache.program = &program;
+    cache.unanchored = unanchored;
+    cache.seen.assign(program.states.size(), 0);
+    cache.start_set.clear();
+    add_closure(cache, program.start, cache.start_set);
+    std::sort(cache.start_set.begin(), cache.start_set.end());
+    clear_seen(cache);
+}
+
+// Return the DFA state for a sorted set of NFA states, adding it if needed
+static int32_t
+dfa_state(dfa_cache & cache, const std::vector<uint32_t> & set)
+{
+    std::map<std::vector<uint32_t>, int32_t>::iterator found =
+        cache.ids.find(set);
+    if (found != cache.ids.end())
+        return found->second;
+
+    uint8_t flags = set.empty() ? k_dead : 0;
+    for (uint32_t state : set)
+    {
+        if (cache.program->states[state].op == k_op_match)
+            flags |= k_accepting;
+    }
+
+    int32_t id = cache.sets.size();
+    cache.sets.push_back(set);
+    cache.ids[set] = id;
+    cache.flags.push_back(flags);
+    cache.next.resize(cache.next.size() + 256, -1);
+    return id;
+}
+
+static int32_t
+dfa_start(dfa_cache & cache)
+{
+    if (cache.start < 0)
+        cache.start = dfa_state(cache, cache.start_set);
+    return cache.start;
+}
+
+// Build the transition of state on byte
+static int32_t
+dfa_step(dfa_cache & cache, int32_t state, uint8_t byte)
+{
+    const dfa_program & program = *cache.program;
+    std::vector<uint32_t> set;
+    for (uint32_t nfa : cache.sets[state])
+    {
+        const nfa_state & current = program.states[nfa];
+        if (current.op == k_op_bytes && program.sets[current.bytes][byte])
+            add_closure(cache, current.out, set);
+    }
+    if (cache.unanchored)
+    {
+        for (uint32_t nfa : cache.start_set)
+        {
+            if (!cache.seen[nfa])
+            {
+                cache.seen[nfa] = 1;
+                cache.visited.push_back(nfa);
+                set.push_back(nfa);
+            }
+        }
+    }
+    clear_seen(cache);
+    std::sort(set.begin(), set.end());
+
+    // Start over when the cache is full, keeping only the current state
+    if (cache.sets.size() >= k_max_dfa_states)
+    {
+        std::vector<uint32_t> current = cache.sets[state];
+        cache.next.clear();
+        cache.flags.clear();
+        cache.sets.clear();
+        cache.ids.clear();
+        cache.start = -1;
+        cache.flushes++;
+        state = dfa_state(cache, current);
+    }
+
+    int32_t next = dfa_state(cache, set);
+    cache.next[state * 256 + byte] = next;
+    return next;
+}
+
+regex_searcher::regex_searcher(const pattern & p) :
+    m_forward(new dfa_program()),
+    m_reversed(new dfa_program())
+{
+    memset(m_first_byte, 0, sizeof(m_first_byte));
+
+    regex_parser parser(p.text, p.fold_case);
+    uint32_t root = 0;
+    if (p.regex)
+    {
+        if (!parser.parse(root))
+        {
+            m_error = parser.error;
+            return;
+        }
+    }
+    else
+    {
+        // A fixed pattern is a concatenation of masked bytes
+        parser.nodes.push_back(regex_node());
+        parser.nodes[0].type = regex_node::k_concat;
+        for (uint64_t i = 0; i < p.bytes.size(); i++)
+        {
+            regex_node node;
+            node.type = regex_node::k_bytes;
+            uint8_t mask = p.mask.empty() ? 0xff : p.mask[i];
+            for (int byte = 0; byte < 256; byte++)
+                node.bytes[byte] = (byte & mask) == p.bytes[i];
+            parser.nodes.push_back(node);
+            parser.nodes[0].children.push_back(parser.nodes.size() - 1);
+        }
+    }
+
+    uint64_t min = 0;
+    match_lengths(parser.nodes, root, min, m_max_length);
+    if (min == 0)
+        m_error = "the expression matches an empty string";
+    else if (m_max_length > k_max_match_length)
+        m_error = "matches can be longer than 65535 bytes";
+    else if (nfa_size(parser.nodes, root) > k_max_nfa_states)
+        m_error = "the expression is too large";
+    if (!m_error.empty())
+        return;
+
+    nfa_builder(parser.nodes, *m_forward).build(root, false);
+    nfa_builder(parser.nodes, *m_reversed).build(root, true);
+
+    collect_prefix(parser.nodes, root, m_prefix, m_prefix_mask);
+    for (uint8_t mask : m_prefix_mask)
+        m_prefix_masked = m_prefix_masked || mask != 0xff;
+
+    dfa_cache cache;
+    init_cache(cache, *m_forward, false);
+    for (uint32_t state : cache.start_set)
+    {
+        const nfa_state & start = m_forward->states[state];
+        if (start.op != k_op_bytes)
+            continue;
+        for (int byte = 0; byte < 256; byte++)
+            m_first_byte[byte] = m_first_byte[byte] ||
+                                 m_forward->sets[start.bytes][byte];
+    }
+}
+
+regex_searcher::~regex_searcher()
+{
+}
+
+const std::string &
+regex_searcher::error() const
+{
+    return m_error;
+}
+
+uint64_t
+regex_searcher::max_length() const
+{
+    return m_max_length;
+}
+
+uint64_t
+regex_searcher::prefix_length() const
+{
+    return m_prefix.size();
+}
+
+uint64_t
+regex_searcher::size() const
+{
+    return m_forward->states.size();
+}
+
+std::unique_ptr<regex_searcher::caches>
+regex_searcher::take_caches() const
+{
+    std::unique_ptr<caches> taken;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free_caches.empty())
+        {
+            taken.swap(m_free_caches.back());
+            m_free_caches.pop_back();
+            return taken;
+        }
+    }
+
+    taken.reset(new caches());
+    init_cache(taken->forward, *m_forward, false);
+    init_cache(taken->reversed, *m_reversed, true);
+    return taken;
+}
+
+void
+regex_searcher::return_caches(std::unique_ptr<caches> & taken) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free_caches.push_back(std::move(taken));
+}
+
+uint64_t
+regex_searcher::longest_match(dfa_cache & cache,
+                              const uint8_t * buffer,
+                              uint64_t length) const
+{
+    uint64_t longest = 0;
+    uint64_t end = std::min(length, m_max_length);
+    int32_t state = dfa_start(cache);
+
+    for (uint64_t i = 0; i < end; i++)
+    {
+        int32_t next = cache.next[state * 256 + buffer[i]];
+        if (next < 0)
+            next = dfa_step(cache, state, buffer[i]);
+        state = next;
+
+        uint8_t flags = cache.flags[state];
+        if (flags & k_dead)
+            break;
+        if (flags & k_accepting)
+            longest = i + 1;
+    }
+    return longest;
+}
+
+bool
+regex_searcher::find_reversed(dfa_cache & cache,
+                              const uint8_t * buffer,
+                              uint64_t length,
+                              uint64_t start_limit,
+                              std::vector<uint64_t> & starts) const
+{
+    // No match starting before start_limit ends past this point
+    uint64_t end = std::min(length, start_limit + m_max_length - 1);
+    cache.flushes = 0;
+    int32_t state = dfa_start(cache);
+    const int32_t * transitions = cache.next.data();
+    const uint8_t * flags = cache.flags.data();
+
+    for (uint64_t i = end; i-- > 0; )
+    {
+        int32_t next = transitions[state * 256 + buffer[i]];
+        if (next < 0)
+        {
+            next = dfa_step(cache, state, buffer[i]);
+            if (cache.flushes > k_max_flushes)
+                return false;
+            transitions = cache.next.data();
+            flags = cache.flags.data();
+        }
+        state = next;
+
+        if ((flags[state] & k_accepting) && i < start_limit)
+            starts.push_back(i);
+    }
+    return true;
+}
+
+void
+regex_searcher::find(const uint8_t * buffer,
+                     uint64_t length,
+                     uint64_t start_limit,
+                     uint32_t index,
+                     std::vector<match> & matches) const
+{
+    start_limit = std::min(start_limit, length);
+    std::unique_ptr<caches> taken = take_caches();
+    dfa_cache & forward = taken->forward;
+
+    if (!m_prefix.empty())
+    {
+        // Check the expression where its fixed start is found
+        uint64_t prefix_length = m_prefix.size();
+        uint64_t end = std::min(length, start_limit + prefix_length - 1);
+        uint64_t position = 0;
+        while (position + prefix_length <= end)
+        {
+            const uint8_t * hit = m_prefix_masked ?
+                find_masked_pattern(buffer + position, end - position,
+                                    m_prefix.data(), m_prefix_mask.data(),
+                                    prefix_length) :
+                find_pattern(buffer + position, end - position,
+                             m_prefix.data(), prefix_length);
+            if (!hit)
+                break;
+
+            position = hit - buffer;
+            uint64_t found = longest_match(forward, hit, length - position);
+            if (found)
+                matches.push_back({position, index, 0, (uint32_t) found});
+            position++;
+        }
+    }
+    else
+    {
+        std::vector<uint64_t> & starts = taken->starts;
+        starts.clear();
+        if (find_reversed(taken->reversed, buffer, length, start_limit,
+                          starts))
+        {
+            for (size_t i = starts.size(); i-- > 0; )
+            {
+                uint64_t position = starts[i];
+                uint64_t found = longest_match(forward, buffer + position,
+                                               length - position);
+                matches.push_back({position, index, 0, (uint32_t) found});
+            }
+        }
+        else
+        {
+            // Too many DFA states, try each position that can start a match
+            for (uint64_t position = 0; position < start_limit; position++)
+            {
+                if (!m_first_byte[buffer[position]])
+                    continue;
+                uint64_t found = longest_match(forward, buffer + position,
+                                               length - position);
+                if (found)
+                    matches.push_back({position, index, 0, (uint32_t) found});
+            }
+        }
+    }
+
+    return_caches(taken);
+}
+
+} // namespace bfind
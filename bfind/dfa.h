@@ -0,0 +1,99 @@
+#pragma once
+
+// bfind - regular expressions over bytes with a lazy DFA
+//
+// A regular expression is compiled to a Thompson NFA, which is run as a DFA
+// whose states, sets of NFA states, are only built when the data first leads
+// to them. All positions where a match starts are reported, with the length
+// of the longest match there, like for the fixed patterns.
+//
+// When the expression starts with fixed (or masked) bytes, these are found
+// with the vector scan (scan.h), and a forward DFA checks each candidate.
+// Otherwise a DFA for the reversed expression runs backward over the buffer
+// once, and is in an accepting state exactly where a match starts.
+//
+// Matches must have a bounded length, so that blocks can overlap by the
+// longest match, and * and + are not supported.
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace bfind
+{
+
+struct match;
+struct pattern;
+struct dfa_program;
+struct dfa_cache;
+
+class regex_searcher
+{
+    public:
+        // Compile the pattern: its text if it is a regular expression, and
+        // its bytes under its mask otherwise. Check error() before use.
+        explicit regex_searcher(const pattern & p);
+        ~regex_searcher();
+
+        regex_searcher(const regex_searcher &) = delete;
+        regex_searcher & operator=(const regex_searcher &) = delete;
+
+        // Why the expression could not be compiled, or empty
+        const std::string & error() const;
+
+        // Append the matches that start in buffer[0, start_limit) and end
+        // in buffer[0, length) to matches, as pattern number index, ordered
+        // by position. Positions are relative to buffer. Can be called from
+        // several threads at a time.
+        void find(const uint8_t * buffer,
+                  uint64_t length,
+                  uint64_t start_limit,
+                  uint32_t index,
+                  std::vector<match> & matches) const;
+
+        // Length of the longest possible match
+        uint64_t max_length() const;
+
+        // Number of fixed bytes at the start of every match
+        uint64_t prefix_length() const;
+
+        // Number of NFA states
+        uint64_t size() const;
+
+    private:
+        // The DFA caches of one thread
+        struct caches;
+
+        std::unique_ptr<caches> take_caches() const;
+        void return_caches(std::unique_ptr<caches> & taken) const;
+
+        // Length of the longest match at buffer[0], 0 if there is none
+        uint64_t longest_match(dfa_cache & cache,
+                               const uint8_t * buffer,
+                               uint64_t length) const;
+
+        // Find the match starts with the reversed expression. Returns false
+        // if the DFA has too many states for the data to be worth it.
+        bool find_reversed(dfa_cache & cache,
+                           const uint8_t * buffer,
+                           uint64_t length,
+                           uint64_t start_limit,
+                           std::vector<uint64_t> & starts) const;
+
+        std::string m_error;
+        std::unique_ptr<dfa_program> m_forward;
+        std::unique_ptr<dfa_program> m_reversed;
+        uint64_t m_max_length = 0;
+        std::vector<uint8_t> m_prefix;       // Fixed bytes under m_prefix_mask
+        std::vector<uint8_t> m_prefix_mask;
+        bool m_prefix_masked = false;        // Some mask byte is not 0xff
+        bool m_first_byte[256];              // Bytes that can start a match
+
+        mutable std::mutex m_mutex;
+        mutable std::vector<std::unique_ptr<caches>> m_free_caches;
+};
+
+} // namespace bfind
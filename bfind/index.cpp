@@ -0,0 +1,564 @@
+// bfind - persistent trigram index of a file
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+
+#include "index.h"
+
+using namespace bfind;
+
+static const char k_magic[8] = {'B', 'F', 'I', 'N', 'D', 'X', '0', '1'};
+
+// Bytes per block. Smaller blocks find matches with fewer reads, but make
+// longer posting lists.
+static const uint64_t k_block_size = 256 << 10;
+
+// Blocks with more distinct trigrams than this are always searched
+static const uint64_t k_dense_trigrams = k_block_size / 8;
+
+static const uint32_t k_trigram_count = 1 << 24;
+
+// Postings sorted in memory at a time when building an index, 64 MiB of
+// block numbers. Files with more than k_max_slices times as many postings
+// use larger slices, so that there are not too many temporary files.
+static const uint64_t k_slice_postings = 16 << 20;
+static const uint64_t k_max_slices = 128;
+
+// Trigrams looked up per pattern, the ones in the fewest blocks
+static const size_t k_lookups = 4;
+
+// The index file: the header, the dense block numbers, the entries, and then
+// the posting lists. A posting list is the ascending block numbers, each
+// stored as the difference to the previous one in 7 bit groups, least
+// significant group first, with the top bit set in all but the last byte.
+struct index_header
+{
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t block_size;
+    uint64_t block_count;
+    uint64_t dense_count;       // uint32_t block numbers
+    uint64_t entry_count;
+};
+
+struct index_entry
+{
+    uint32_t trigram;           // Bytes b0 b1 b2 as b0 << 16 | b1 << 8 | b2
+    uint32_t block_count;       // Length of the posting list
+    uint64_t offset;            // Of the posting list, from the first list
+};
+
+std::string
+index_path(const std::string & path)
+{
+    return path + ".bfi";
+}
+
+bool
+is_index_file(const std::string & path)
+{
+    return path.size() >= 4 &&
+           path.compare(path.size() - 4, 4, ".bfi") == 0;
+}
+
+// Call on_trigram once for each distinct trigram that starts in
+// data[start, stop), and return how many there were. seen must be all zero,
+// and is left all zero.
+template <typename callback>
+static uint64_t
+block_trigrams(const uint8_t * data,
+               uint64_t start,
+               uint64_t stop,
+               std::vector<uint64_t> & seen,
+               std::vector<uint32_t> & trigrams,
+               callback on_trigram)
+{
+    trigrams.clear();
+    for (uint64_t i = start; i < stop; i++)
+    {
+        uint32_t trigram = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        uint64_t bit = 1ull << (trigram % 64);
+        if (!(seen[trigram / 64] & bit))
+        {
+            seen[trigram / 64] |= bit;
+            trigrams.push_back(trigram);
+        }
+    }
+
+    for (uint32_t trigram : trigrams)
+        seen[trigram / 64] = 0;
+
+    if (trigrams.size() <= k_dense_trigrams)
+    {
+        for (uint32_t trigram : trigrams)
+            on_trigram(trigram);
+    }
+    return trigrams.size();
+}
+
+// Receives a block in which a trigram starts
+typedef std::function<void (uint32_t block, uint32_t trigram)> posting_callback;
+
+static void
+put_varint(std::vector<uint8_t> & dst, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        dst.push_back(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    dst.push_back(value);
+}
+
+static bool
+write_all(FILE * file, const void * data, size_t length)
+{
+    return length == 0 || fwrite(data, length, 1, file) == 1;
+}
+
+bool
+build_index(const std::string & path, uint64_t & index_size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || 0 != fstat(fd, &file_stat) || !S_ISREG(file_stat.st_mode))
+    {
+        std::cerr << "error: Failed to open " << path << std::endl;
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    uint64_t size = file_stat.st_size;
+    const uint8_t * data = nullptr;
+    if (size > 0)
+    {
+        void * mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            std::cerr << "error: Failed to map " << path << std::endl;
+            close(fd);
+            return false;
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = (const uint8_t *) mapping;
+    }
+    close(fd);
+
+    index_header head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, k_magic, sizeof(k_magic));
+    head.file_size = size;
+    head.mtime_sec = file_stat.st_mtim.tv_sec;
+    head.mtime_nsec = file_stat.st_mtim.tv_nsec;
+    head.block_size = k_block_size;
+    head.block_count = (size + k_block_size - 1) / k_block_size;
+
+    // The first pass counts the blocks of each trigram
+    std::vector<uint64_t> seen(k_trigram_count / 64);
+    std::vector<uint32_t> trigrams;
+    std::vector<uint32_t> counts(k_trigram_count);
+    std::vector<uint32_t> dense;
+    uint64_t positions = size >= 2 ? size - 2 : 0;  // trigram starts
+
+    for (uint64_t block = 0; block < head.block_count; block++)
+    {
+        uint64_t start = block * k_block_size;
+        uint64_t stop = std::min(start + k_block_size, positions);
+        uint64_t distinct =
+            block_trigrams(data, start, std::max(start, stop), seen, trigrams,
+                           [&](uint32_t trigram) { counts[trigram]++; });
+        if (distinct > k_dense_trigrams)
+            dense.push_back(block);
+    }
+
+    // Split the trigrams into slices of consecutive trigrams with about
+    // slice_postings postings. The posting lists of one slice at a time are
+    // sorted in memory.
+    uint64_t total = 0;
+    for (uint32_t count : counts)
+    {
+        total += count;
+        head.entry_count += count > 0;
+    }
+    head.dense_count = dense.size();
+    uint64_t slice_postings =
+        std::max(k_slice_postings, (total + k_max_slices - 1) / k_max_slices);
+    std::vector<uint32_t> slices;       // the first trigram of each slice
+    uint64_t in_slice = 0;
+    for (uint32_t trigram = 0; trigram < k_trigram_count; trigram++)
+    {
+        if (slices.empty() ||
+            (in_slice > 0 && in_slice + counts[trigram] > slice_postings))
+        {
+            slices.push_back(trigram);
+            in_slice = 0;
+        }
+        in_slice += counts[trigram];
+    }
+    slices.push_back(k_trigram_count);
+    size_t slice_count = slices.size() - 1;
+
+    std::string final_path = index_path(path);
+    std::string temporary_path = final_path + ".tmp";
+    bool ok = true;
+
+    // With more than one slice, the second pass spills the postings of each
+    // slice to a temporary file, in block order: the block number, the
+    // number of its trigrams in the slice, and the trigrams
+    std::vector<FILE *> spills;
+    for (size_t s = 0; s < slice_count && slice_count > 1 && ok; s++)
+    {
+        std::string spill_path = temporary_path + std::to_string(s);
+        FILE * spill = fopen(spill_path.c_str(), "w+b");
+        if (spill != NULL)
+        {
+            unlink(spill_path.c_str());
+            spills.push_back(spill);
+        }
+        ok = spill != NULL;
+    }
+
+    size_t next_dense = 0;
+    for (uint64_t block = 0;
+         block < head.block_count && slice_count > 1 && ok;
+         block++)
+    {
+        if (next_dense < dense.size() && dense[next_dense] == block)
+        {
+            next_dense++;
+            continue;
+        }
+
+        uint64_t start = block * k_block_size;
+        uint64_t stop = std::min(start + k_block_size, positions);
+        block_trigrams(data, start, std::max(start, stop), seen, trigrams,
+                       [](uint32_t) {});
+        std::sort(trigrams.begin(), trigrams.end());
+
+        std::vector<uint32_t>::iterator first = trigrams.begin();
+        while (first != trigrams.end())
+        {
+            size_t s = std::upper_bound(slices.begin(), slices.end(),
+                                        *first) - slices.begin() - 1;
+            std::vector<uint32_t>::iterator last =
+                std::lower_bound(first, trigrams.end(), slices[s + 1]);
+            uint32_t record[2] = {(uint32_t) block,
+                                  (uint32_t) (last - first)};
+            ok = ok && write_all(spills[s], record, sizeof(record)) &&
+                 write_all(spills[s], &*first,
+                           (last - first) * sizeof(uint32_t));
+            first = last;
+        }
+    }
+
+    // Call on_posting for each block of each trigram of the slice, in
+    // block order
+    auto slice_postings_in_order = [&](size_t s,
+                                       const posting_callback & on_posting)
+    {
+        if (slice_count == 1)
+        {
+            size_t dense_index = 0;
+            for (uint64_t block = 0; block < head.block_count; block++)
+            {
+                if (dense_index < dense.size() && dense[dense_index] == block)
+                {
+                    dense_index++;
+                    continue;
+                }
+
+                uint64_t start = block * k_block_size;
+                uint64_t stop = std::min(start + k_block_size, positions);
+                block_trigrams(data, start, std::max(start, stop), seen,
+                               trigrams,
+                               [&](uint32_t trigram)
+                               {
+                                   on_posting(block, trigram);
+                               });
+            }
+            return true;
+        }
+
+        FILE * spill = spills[s];
+        if (0 != fflush(spill) || 0 != fseeko(spill, 0, SEEK_SET))
+            return false;
+        uint32_t record[2];
+        while (fread(record, sizeof(record), 1, spill) == 1)
+        {
+            trigrams.resize(record[1]);
+            if (record[1] > 0 &&
+                fread(trigrams.data(), record[1] * sizeof(uint32_t), 1,
+                      spill) != 1)
+                return false;
+            for (uint32_t trigram : trigrams)
+                on_posting(record[0], trigram);
+        }
+        return !ferror(spill);
+    };
+
+    // The index is written through two streams, one for the entries and one
+    // for the posting lists after them, as both grow slice by slice. It goes
+    // to a temporary file that is renamed, so that searches never see a
+    // partial index.
+    uint64_t lists = sizeof(head) + dense.size() * sizeof(uint32_t) +
+                     head.entry_count * sizeof(index_entry);
+    FILE * file = ok ? fopen(temporary_path.c_str(), "wb") : NULL;
+    FILE * list_file = file ? fopen(temporary_path.c_str(), "r+b") : NULL;
+    ok = list_file != NULL &&
+         0 == fseeko(list_file, lists, SEEK_SET) &&
+         write_all(file, &head, sizeof(head)) &&
+         write_all(file, dense.data(), dense.size() * sizeof(uint32_t));
+
+    std::vector<uint32_t> blocks;
+    std::vector<uint8_t> postings;
+    uint64_t postings_size = 0;
+    for (size_t s = 0; s < slice_count && ok; s++)
+    {
+        // counts[t] becomes the start of the list of t in blocks
+        uint64_t slice_total = 0;
+        for (uint32_t trigram = slices[s]; trigram < slices[s + 1]; trigram++)
+        {
+            uint64_t list_length = counts[trigram];
+            counts[trigram] = slice_total;
+            slice_total += list_length;
+        }
+        blocks.resize(slice_total);
+
+        ok = slice_postings_in_order(s, [&](uint32_t block, uint32_t trigram)
+        {
+            blocks[counts[trigram]++] = block;
+        });
+
+        // and then the end of the list
+        uint64_t first = 0;
+        for (uint32_t trigram = slices[s];
+             trigram < slices[s + 1] && ok;
+             trigram++)
+        {
+            uint64_t last = counts[trigram];
+            if (first == last)
+                continue;
+
+            index_entry entry = {trigram, (uint32_t) (last - first),
+                                 postings_size};
+            postings.clear();
+            uint32_t previous = 0;
+            for (uint64_t i = first; i < last; i++)
+            {
+                put_varint(postings, blocks[i] - previous);
+                previous = blocks[i];
+            }
+            ok = write_all(file, &entry, sizeof(entry)) &&
+                 write_all(list_file, postings.data(), postings.size());
+            postings_size += postings.size();
+            first = last;
+        }
+    }
+
+    for (FILE * spill : spills)
+        fclose(spill);
+    if (data)
+        munmap((void *) data, size);
+
+    if (file != NULL && 0 != fclose(file))
+        ok = false;
+    if (list_file != NULL && 0 != fclose(list_file))
+        ok = false;
+    if (!ok || 0 != rename(temporary_path.c_str(), final_path.c_str()))
+    {
+        std::cerr << "error: Failed to write " << final_path << std::endl;
+        unlink(temporary_path.c_str());
+        return false;
+    }
+
+    index_size = lists + postings_size;
+    return true;
+}
+
+file_index::~file_index()
+{
+    if (m_data)
+        munmap((void *) m_data, m_size);
+}
+
+bool
+file_index::open(const std::string & path, const struct stat & file_stat)
+{
+    int fd = ::open(index_path(path).c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat index_stat;
+    void * mapping = MAP_FAILED;
+    if (0 == fstat(fd, &index_stat) &&
+        (uint64_t) index_stat.st_size >= sizeof(index_header))
+        mapping = mmap(nullptr, index_stat.st_size, PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    m_data = (const uint8_t *) mapping;
+    m_size = index_stat.st_size;
+    m_header = (const index_header *) m_data;
+
+    // An index that does not belong to this version of the file is ignored
+    const index_header & head = *m_header;
+    uint64_t lists = sizeof(index_header) +
+                     head.dense_count * sizeof(uint32_t) +
+                     head.entry_count * sizeof(index_entry);
+    if (0 != memcmp(head.magic, k_magic, sizeof(k_magic)) ||
+        head.file_size != (uint64_t) file_stat.st_size ||
+        head.mtime_sec != file_stat.st_mtim.tv_sec ||
+        head.mtime_nsec != file_stat.st_mtim.tv_nsec ||
+        head.block_size == 0 ||
+        head.block_count !=
+            (head.file_size + head.block_size - 1) / head.block_size ||
+        head.dense_count > head.block_count ||
+        head.entry_count > k_trigram_count ||
+        lists > m_size)
+    {
+        munmap((void *) m_data, m_size);
+        m_data = nullptr;
+        return false;
+    }
+
+    m_dense = (const uint32_t *) (m_data + sizeof(index_header));
+    m_entries = (const index_entry *) (m_dense + head.dense_count);
+    m_postings = m_data + lists;
+    return true;
+}
+
+uint32_t
+file_index::lookup(uint32_t trigram, const uint8_t * & postings) const
+{
+    const index_entry * end = m_entries + m_header->entry_count;
+    const index_entry * found =
+        std::lower_bound(m_entries, end, trigram,
+                         [](const index_entry & e, uint32_t value)
+                         {
+                             return e.trigram < value;
+                         });
+    if (found == end || found->trigram != trigram ||
+        found->offset >= (uint64_t) (m_data + m_size - m_postings))
+    {
+        postings = nullptr;
+        return 0;
+    }
+
+    postings = m_postings + found->offset;
+    return found->block_count;
+}
+
+bool
+file_index::add_candidates(const pattern & p,
+                           std::vector<uint8_t> & candidates) const
+{
+    uint64_t block_count = m_header->block_count;
+    const uint8_t * end = m_data + m_size;
+
+    // A trigram at offset i of the pattern starts in the block of the
+    // match, or in the next one if i < block_size
+    uint64_t positions = std::min((uint64_t) p.bytes.size() - 2,
+                                  m_header->block_size);
+    std::vector<std::pair<uint32_t, const uint8_t *>> lookups;
+    for (uint64_t i = 0; i < positions; i++)
+    {
+        if (!p.mask.empty() &&
+            (p.mask[i] != 0xff || p.mask[i + 1] != 0xff ||
+             p.mask[i + 2] != 0xff))
+            continue;
+
+        uint32_t trigram =
+            (p.bytes[i] << 16) | (p.bytes[i + 1] << 8) | p.bytes[i + 2];
+        const uint8_t * postings = nullptr;
+        uint32_t count = lookup(trigram, postings);
+        lookups.push_back({count, postings});
+    }
+    if (lookups.empty())
+        return false;
+
+    std::sort(lookups.begin(), lookups.end(),
+              [](const std::pair<uint32_t, const uint8_t *> & a,
+                 const std::pair<uint32_t, const uint8_t *> & b)
+              {
+                  return a.first < b.first;
+              });
+    lookups.resize(std::min(lookups.size(), k_lookups));
+
+    // Blocks that are candidates for each looked up trigram
+    std::vector<uint8_t> pattern_candidates(block_count, 1);
+    std::vector<uint8_t> has(block_count + 1);
+    for (const std::pair<uint32_t, const uint8_t *> & list : lookups)
+    {
+        std::fill(has.begin(), has.end(), 0);
+        for (uint64_t i = 0; i < m_header->dense_count; i++)
+        {
+            if (m_dense[i] < block_count)
+                has[m_dense[i]] = 1;
+        }
+
+        const uint8_t * src = list.second;
+        uint64_t block = 0;
+        for (uint32_t i = 0; i < list.first; i++)
+        {
+            uint64_t delta = 0;
+            for (int shift = 0; src < end && shift < 64; shift += 7)
+            {
+                uint8_t byte = *src++;
+                delta |= (uint64_t) (byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    break;
+            }
+            block += delta;
+            if (block < block_count)
+                has[block] = 1;
+        }
+
+        for (uint64_t b = 0; b < block_count; b++)
+            pattern_candidates[b] &= has[b] | has[b + 1];
+    }
+
+    for (uint64_t b = 0; b < block_count; b++)
+        candidates[b] |= pattern_candidates[b];
+    return true;
+}
+
+bool
+file_index::candidate_ranges(const std::vector<pattern> & patterns,
+                             std::vector<file_range> & ranges) const
+{
+    std::vector<uint8_t> candidates(m_header->block_count);
+    for (const pattern & p : patterns)
+    {
+        if (p.bit_length || p.regex || p.bytes.size() < 3 ||
+            !add_candidates(p, candidates))
+            return false;
+    }
+
+    ranges.clear();
+    uint64_t block_size = m_header->block_size;
+    for (uint64_t b = 0; b < candidates.size(); b++)
+    {
+        if (!candidates[b])
+            continue;
+
+        uint64_t start = b * block_size;
+        uint64_t stop = std::min(start + block_size, m_header->file_size);
+        if (!ranges.empty() && ranges.back().stop == start)
+            ranges.back().stop = stop;
+        else
+            ranges.push_back({start, stop});
+    }
+    return true;
+}
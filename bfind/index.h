@@ -0,0 +1,88 @@
+#pragma once
+
+// bfind - persistent trigram index of a file
+//
+// The index of file.bin is stored next to it, in file.bin.bfi. The file is
+// split into blocks, and for each trigram, i.e. each 3 byte string, the index
+// lists the blocks in which it starts. A pattern can only start in a block
+// where each of its trigrams starts in that block or in the next one, so a
+// search only has to read the candidate blocks. The index is keyed by the
+// size and modification time of the file, and ignored once they change.
+//
+// Blocks with too many distinct trigrams, e.g. of compressed data, are not
+// listed and are always searched, which bounds the size of the index.
+//
+// The posting lists are built for a slice of the trigrams at a time, so the
+// memory needed to build an index does not grow with the file until it has
+// billions of postings. The postings of the other slices wait in temporary
+// files.
+
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "matcher.h"
+
+struct index_header;
+struct index_entry;
+
+// A range of file offsets [start, stop)
+struct file_range
+{
+    uint64_t start;
+    uint64_t stop;
+};
+
+// Return the path of the index of the file at path
+std::string
+index_path(const std::string & path);
+
+// Return true if path names an index file, which is neither indexed nor
+// searched
+bool
+is_index_file(const std::string & path);
+
+// Write the index of the regular file at path. Prints an error and returns
+// false if it could not be written. index_size is set to the size of the
+// index file.
+bool
+build_index(const std::string & path, uint64_t & index_size);
+
+class file_index
+{
+    public:
+        file_index() {}
+        ~file_index();
+
+        file_index(const file_index &) = delete;
+        file_index & operator=(const file_index &) = delete;
+
+        // Open the index of the file at path. Returns false if there is no
+        // index, or if it is out of date for file_stat.
+        bool open(const std::string & path, const struct stat & file_stat);
+
+        // Set ranges to the parts of the file where a match of any of the
+        // patterns may start, in file order. Returns false if a pattern can
+        // not be looked up, which needs 3 fully known consecutive bytes and
+        // rules out regular expressions.
+        bool candidate_ranges(const std::vector<bfind::pattern> & patterns,
+                              std::vector<file_range> & ranges) const;
+
+    private:
+        // Number of blocks in which the trigram starts, and the start of
+        // its posting list, or 0 and nullptr if it is not in the index
+        uint32_t lookup(uint32_t trigram, const uint8_t * & postings) const;
+
+        // Set candidates[b] for the blocks b in which pattern may start
+        bool add_candidates(const bfind::pattern & p,
+                            std::vector<uint8_t> & candidates) const;
+
+        const uint8_t * m_data = nullptr;         // The mapped index file
+        uint64_t m_size = 0;
+        const index_header * m_header = nullptr;
+        const uint32_t * m_dense = nullptr;       // Blocks without postings
+        const index_entry * m_entries = nullptr;  // Sorted by trigram
+        const uint8_t * m_postings = nullptr;
+};
@@ -0,0 +1,586 @@
+// bfind - pattern matching engines
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "matcher.h"
+#include "scan.h"
+
+namespace bfind
+{
+
+// Patterns at least this long may use the skipping searchers
+static const uint64_t k_long_pattern = 32;
+
+// Bytes ranked at least this common make poor filter bytes
+static const int k_common_rank = 200;
+
+// Strides from which checking each aligned position beats a full search
+static const uint64_t k_probe_stride = 64;
+
+// Return true if the pattern only masks out the case bit of ASCII letters
+static bool
+folds_case(const pattern & p)
+{
+    for (uint64_t i = 0; i < p.bytes.size(); i++)
+    {
+        uint8_t byte = p.bytes[i];
+        uint8_t mask = p.mask.empty() ? 0xff : p.mask[i];
+        bool letter = isalpha(byte);
+        if (!(mask == 0xdf && letter && byte == (byte & 0xdf)) &&
+            !(mask == 0xff && !letter))
+            return false;
+    }
+    return true;
+}
+
+const char *
+algorithm_name(algorithm algo)
+{
+    switch (algo)
+    {
+        case k_algo_auto:         return "auto";
+        case k_algo_simd:         return "simd";
+        case k_algo_horspool:     return "horspool";
+        case k_algo_two_way:      return "two-way";
+        case k_algo_rare:         return "rare";
+        case k_algo_aho_corasick: return "aho-corasick";
+        case k_algo_bits:         return "bits";
+        case k_algo_regex:        return "regex";
+        default:                  return "unknown";
+    }
+}
+
+matcher::matcher(const std::vector<pattern> & patterns, algorithm algo) :
+    m_patterns(patterns),
+    m_algorithm(algo)
+{
+    bool masked = false;
+    bool folded = true;
+    for (const pattern & p : m_patterns)
+    {
+        m_max_length = std::max(m_max_length, (uint64_t) p.bytes.size());
+        masked = masked || !p.mask.empty();
+        folded = folded && folds_case(p);
+        if (p.bit_length)
+            m_algorithm = k_algo_bits;
+        if (p.regex)
+            m_algorithm = k_algo_regex;
+    }
+
+    memset(m_first_byte, 0, sizeof(m_first_byte));
+    if (m_algorithm == k_algo_regex)
+    {
+        // fixed patterns among regular expressions are compiled as well
+        m_max_length = 0;
+        for (const pattern & p : m_patterns)
+        {
+            m_regex_searchers.emplace_back(new regex_searcher(p));
+            m_max_length = std::max(m_max_length,
+                                    m_regex_searchers.back()->max_length());
+        }
+    }
+    else if (m_algorithm == k_algo_bits)
+    {
+        // byte patterns among bit patterns are searched for at bit 0
+        for (const pattern & p : m_patterns)
+        {
+            bool aligned = p.bit_length == 0;
+            uint64_t bits = aligned ? p.bytes.size() * 8 : p.bit_length;
+            m_bit_searchers.emplace_back(
+                new bit_searcher(p.bytes.data(), bits, aligned));
+            m_max_length = std::max(m_max_length,
+                                    m_bit_searchers.back()->max_length());
+        }
+    }
+    else if (masked && folded &&
+             (m_algorithm == k_algo_aho_corasick ||
+              (m_algorithm == k_algo_auto && m_patterns.size() > 1)))
+    {
+        // Case-insensitive patterns fit in one automaton that ignores the
+        // case of the data
+        m_algorithm = k_algo_aho_corasick;
+        m_fold_case = true;
+    }
+    else if (masked)
+    {
+        // The automaton needs exact bytes, so masked patterns are searched
+        // for one at a time
+        m_algorithm = k_algo_simd;
+    }
+    else if (m_patterns.size() > 1)
+        m_algorithm = k_algo_aho_corasick;
+    else if (m_algorithm == k_algo_auto)
+        m_algorithm = choose_algorithm();
+
+    const uint8_t * bytes = m_patterns[0].bytes.data();
+    uint64_t length = m_patterns[0].bytes.size();
+    switch (m_algorithm)
+    {
+        case k_algo_horspool:
+            m_horspool.reset(new horspool_searcher(bytes, length));
+            break;
+        case k_algo_two_way:
+            m_two_way.reset(new two_way_searcher(bytes, length));
+            break;
+        case k_algo_rare:
+            m_rare.reset(new rare_byte_searcher(bytes, length));
+            break;
+        case k_algo_aho_corasick:
+            build_automaton();
+            break;
+        default:
+            break;
+    }
+}
+
+// The vector engine is the fastest choice as long as the first and last
+// pattern bytes filter out most positions. When both are common bytes, e.g.
+// zero padding, it falls back to memcmp at almost every position. Then a
+// rare byte in the pattern is a better anchor, and if there is none, Two-Way
+// keeps long patterns linear. Horspool only beats a scalar vector engine.
+algorithm
+matcher::choose_algorithm() const
+{
+    const std::vector<uint8_t> & bytes = m_patterns[0].bytes;
+    uint64_t length = bytes.size();
+    if (length == 1)
+        return k_algo_simd;
+
+    int end_rank = std::min(byte_rank(bytes[0]), byte_rank(bytes[length - 1]));
+    if (end_rank >= k_common_rank)
+    {
+        rare_byte_searcher rare(bytes.data(), length);
+        if (byte_rank(bytes[rare.anchor()]) < end_rank)
+            return k_algo_rare;
+        return length >= k_long_pattern ? k_algo_two_way : k_algo_simd;
+    }
+
+    if (get_scan_engine() == k_engine_scalar && length >= k_long_pattern)
+    {
+        horspool_searcher horspool(bytes.data(), length);
+        if (horspool.expected_shift() >= length / 2)
+            return k_algo_horspool;
+    }
+
+    return k_algo_simd;
+}
+
+algorithm
+matcher::get_algorithm() const
+{
+    return m_algorithm;
+}
+
+std::string
+matcher::describe() const
+{
+    char text[256];
+    uint64_t length = m_patterns[0].bytes.size();
+    switch (m_algorithm)
+    {
+        case k_algo_simd:
+            if (m_patterns.size() > 1)
+                snprintf(text, sizeof(text),
+                         "simd (%s, %lu patterns one at a time)",
+                         scan_engine_name(get_scan_engine()),
+                         m_patterns.size());
+            else
+                snprintf(text, sizeof(text),
+                         "simd (%s, %spattern length %lu)",
+                         scan_engine_name(get_scan_engine()),
+                         m_patterns[0].mask.empty() ? "" : "masked ", length);
+            break;
+        case k_algo_horspool:
+            snprintf(text, sizeof(text),
+                     "horspool (pattern length %lu, expected shift %.1f)",
+                     length, m_horspool->expected_shift());
+            break;
+        case k_algo_two_way:
+            snprintf(text, sizeof(text),
+                     "two-way (pattern length %lu)", length);
+            break;
+        case k_algo_rare:
+            snprintf(text, sizeof(text),
+                     "rare (pattern length %lu, anchor 0x%02x at index %lu)",
+                     length, m_patterns[0].bytes[m_rare->anchor()],
+                     m_rare->anchor());
+            break;
+        case k_algo_bits:
+            snprintf(text, sizeof(text),
+                     "bits (%lu pattern%s, longest %lu bytes)",
+                     m_patterns.size(), m_patterns.size() > 1 ? "s" : "",
+                     m_max_length);
+            break;
+        case k_algo_regex:
+            if (m_patterns.size() > 1)
+                snprintf(text, sizeof(text),
+                         "regex (%lu patterns one at a time, longest %lu "
+                         "bytes)", m_patterns.size(), m_max_length);
+            else
+                snprintf(text, sizeof(text),
+                         "regex (%lu NFA states, fixed prefix %lu, longest "
+                         "%lu bytes)", m_regex_searchers[0]->size(),
+                         m_regex_searchers[0]->prefix_length(), m_max_length);
+            break;
+        default:
+            snprintf(text, sizeof(text),
+                     "%s (%lu patterns, %lu states%s)",
+                     algorithm_name(m_algorithm), m_patterns.size(),
+                     m_transitions.size() / 256,
+                     m_fold_case ? ", case folded" : "");
+            break;
+    }
+    return text;
+}
+
+uint64_t
+matcher::max_length() const
+{
+    return m_max_length;
+}
+
+uint64_t
+matcher::length(uint32_t index) const
+{
+    return m_patterns[index].bytes.size();
+}
+
+uint64_t
+matcher::match_length(const match & found) const
+{
+    if (m_algorithm == k_algo_bits)
+        return m_bit_searchers[found.pattern]->match_length(found.bit);
+    if (m_algorithm == k_algo_regex)
+        return found.length;
+    return m_patterns[found.pattern].bytes.size();
+}
+
+size_t
+matcher::size() const
+{
+    return m_patterns.size();
+}
+
+void
+matcher::find_matches(const uint8_t * buffer,
+                      uint64_t length,
+                      uint64_t start_limit,
+                      std::vector<match> & matches) const
+{
+    if (m_algorithm == k_algo_aho_corasick)
+        find_multiple(buffer, length, start_limit, matches);
+    else if (m_algorithm == k_algo_bits)
+        find_bits(buffer, length, start_limit, matches);
+    else if (m_algorithm == k_algo_regex)
+        find_regex(buffer, length, start_limit, matches);
+    else
+        find_single(buffer, length, start_limit, matches);
+}
+
+void
+matcher::find_strided(const uint8_t * buffer,
+                      uint64_t length,
+                      uint64_t start_limit,
+                      uint64_t stride,
+                      std::vector<match> & matches) const
+{
+    size_t first_match = matches.size();
+    if (stride < k_probe_stride)
+    {
+        find_matches(buffer, length, start_limit, matches);
+        matches.erase(std::remove_if(matches.begin() + first_match,
+                                     matches.end(),
+                                     [&](const match & found)
+                                     {
+                                         return found.position % stride != 0;
+                                     }),
+                      matches.end());
+        return;
+    }
+
+    bool bytes_only = m_algorithm != k_algo_bits &&
+                      m_algorithm != k_algo_regex;
+    for (uint64_t position = 0; position < start_limit; position += stride)
+    {
+        first_match = matches.size();
+        if (bytes_only)
+            match_at(buffer + position, length - position, matches);
+        else
+            find_matches(buffer + position, length - position, 1, matches);
+        for (size_t i = first_match; i < matches.size(); i++)
+            matches[i].position += position;
+    }
+}
+
+void
+matcher::match_at(const uint8_t * buffer,
+                  uint64_t length,
+                  std::vector<match> & matches) const
+{
+    for (uint32_t index = 0; index < m_patterns.size(); index++)
+    {
+        const pattern & p = m_patterns[index];
+        const uint8_t * bytes = p.bytes.data();
+        uint64_t size = p.bytes.size();
+        if (size > length)
+            continue;
+
+        bool found = true;
+        if (p.mask.empty())
+        {
+            found = buffer[0] == bytes[0] && 0 == memcmp(buffer, bytes, size);
+        }
+        else
+        {
+            const uint8_t * mask = p.mask.data();
+            for (uint64_t i = 0; i < size && found; i++)
+                found = (buffer[i] & mask[i]) == bytes[i];
+        }
+        if (found)
+            matches.push_back({0, index, 0});
+    }
+}
+
+const uint8_t *
+matcher::find_first(const uint8_t * buffer,
+                    uint64_t length,
+                    uint32_t index) const
+{
+    const pattern & p = m_patterns[index];
+    switch (m_algorithm)
+    {
+        case k_algo_horspool: return m_horspool->find(buffer, length);
+        case k_algo_two_way:  return m_two_way->find(buffer, length);
+        case k_algo_rare:     return m_rare->find(buffer, length);
+        default:
+            if (!p.mask.empty())
+                return find_masked_pattern(buffer, length, p.bytes.data(),
+                                           p.mask.data(), p.bytes.size());
+            return find_pattern(buffer, length, p.bytes.data(),
+                                p.bytes.size());
+    }
+}
+
+void
+matcher::find_single(const uint8_t * buffer,
+                     uint64_t length,
+                     uint64_t start_limit,
+                     std::vector<match> & matches) const
+{
+    size_t first_match = matches.size();
+    for (uint32_t index = 0; index < m_patterns.size(); index++)
+    {
+        uint64_t pattern_length = m_patterns[index].bytes.size();
+        uint64_t end = std::min(length, start_limit + pattern_length - 1);
+        uint64_t buffer_pos = 0;
+
+        while (buffer_pos + pattern_length <= end)
+        {
+            const uint8_t * hit = find_first(buffer + buffer_pos,
+                                             end - buffer_pos, index);
+            if (!hit)
+                break;
+
+            buffer_pos = hit - buffer;
+            matches.push_back({buffer_pos, index});
+            buffer_pos++;
+        }
+    }
+
+    if (m_patterns.size() > 1)
+        std::sort(matches.begin() + first_match, matches.end(),
+                  [](const match & a, const match & b)
+                  {
+                      return a.position < b.position ||
+                             (a.position == b.position &&
+                              a.pattern < b.pattern);
+                  });
+}
+
+void
+matcher::find_multiple(const uint8_t * buffer,
+                       uint64_t length,
+                       uint64_t start_limit,
+                       std::vector<match> & matches) const
+{
+    // No match ending past this point can start before start_limit
+    uint64_t end = std::min(length, start_limit + m_max_length - 1);
+    size_t first_match = matches.size();
+    const uint32_t * transitions = m_transitions.data();
+    uint32_t state = 0;
+
+    for (uint64_t i = 0; i < end; i++)
+    {
+        if (state == 0)
+        {
+            // skip ahead to a byte that starts a pattern
+            while (i < end && !m_first_byte[buffer[i]])
+                i++;
+            if (i == end)
+                break;
+        }
+
+        state = transitions[state * 256 + buffer[i]];
+        uint32_t output = m_output_index[state];
+        uint32_t output_end = m_output_index[state + 1];
+        for (; output < output_end; output++)
+        {
+            uint32_t index = m_outputs[output];
+            uint64_t start = i + 1 - m_patterns[index].bytes.size();
+            if (start < start_limit)
+                matches.push_back({start, index});
+        }
+    }
+
+    // Matches are found at their last byte, report them by first byte
+    std::sort(matches.begin() + first_match, matches.end(),
+              [](const match & a, const match & b)
+              {
+                  return a.position < b.position ||
+                         (a.position == b.position && a.pattern < b.pattern);
+              });
+}
+
+void
+matcher::find_bits(const uint8_t * buffer,
+                   uint64_t length,
+                   uint64_t start_limit,
+                   std::vector<match> & matches) const
+{
+    size_t first_match = matches.size();
+    for (uint32_t index = 0; index < m_bit_searchers.size(); index++)
+        m_bit_searchers[index]->find(buffer, length, start_limit, index,
+                                     matches);
+
+    // Each searcher finds its matches one bit offset at a time
+    std::sort(matches.begin() + first_match, matches.end(),
+              [](const match & a, const match & b)
+              {
+                  if (a.position != b.position)
+                      return a.position < b.position;
+                  if (a.bit != b.bit)
+                      return a.bit < b.bit;
+                  return a.pattern < b.pattern;
+              });
+}
+
+void
+matcher::find_regex(const uint8_t * buffer,
+                    uint64_t length,
+                    uint64_t start_limit,
+                    std::vector<match> & matches) const
+{
+    size_t first_match = matches.size();
+    for (uint32_t index = 0; index < m_regex_searchers.size(); index++)
+        m_regex_searchers[index]->find(buffer, length, start_limit, index,
+                                       matches);
+
+    if (m_patterns.size() > 1)
+        std::sort(matches.begin() + first_match, matches.end(),
+                  [](const match & a, const match & b)
+                  {
+                      return a.position < b.position ||
+                             (a.position == b.position &&
+                              a.pattern < b.pattern);
+                  });
+}
+
+void
+matcher::build_automaton()
+{
+    const uint32_t k_none = UINT32_MAX;
+    std::vector<uint32_t> go(256, k_none);           // trie edges
+    std::vector<std::vector<uint32_t>> outputs(1);   // patterns per state
+
+    for (uint32_t index = 0; index < m_patterns.size(); index++)
+    {
+        uint32_t state = 0;
+        for (uint8_t byte : m_patterns[index].bytes)
+        {
+            if (go[state * 256 + byte] == k_none)
+            {
+                go[state * 256 + byte] = outputs.size();
+                outputs.push_back(std::vector<uint32_t>());
+                go.resize(go.size() + 256, k_none);
+            }
+            state = go[state * 256 + byte];
+        }
+        outputs[state].push_back(index);
+    }
+
+    // Breadth first, complete the transitions with the failure links so
+    // the automaton never has to backtrack
+    size_t state_count = outputs.size();
+    std::vector<uint32_t> failure(state_count, 0);
+    std::deque<uint32_t> queue;
+    m_transitions.assign(go.begin(), go.end());
+
+    for (int byte = 0; byte < 256; byte++)
+    {
+        uint32_t next = go[byte];
+        if (next == k_none)
+        {
+            m_transitions[byte] = 0;
+        }
+        else
+        {
+            m_first_byte[byte] = true;
+            queue.push_back(next);
+        }
+    }
+
+    while (!queue.empty())
+    {
+        uint32_t state = queue.front();
+        queue.pop_front();
+
+        // a state also reports everything its failure state reports
+        const std::vector<uint32_t> & inherited = outputs[failure[state]];
+        outputs[state].insert(outputs[state].end(),
+                              inherited.begin(), inherited.end());
+
+        for (int byte = 0; byte < 256; byte++)
+        {
+            uint32_t next = go[state * 256 + byte];
+            uint32_t fallback = m_transitions[failure[state] * 256 + byte];
+            if (next == k_none)
+            {
+                m_transitions[state * 256 + byte] = fallback;
+            }
+            else
+            {
+                failure[next] = fallback;
+                queue.push_back(next);
+            }
+        }
+    }
+
+    // The lower case letters take the transitions of the upper case ones,
+    // which are the only ones in the patterns
+    if (m_fold_case)
+    {
+        for (uint64_t state = 0; state < state_count; state++)
+        {
+            for (int byte = 'a'; byte <= 'z'; byte++)
+                m_transitions[state * 256 + byte] =
+                    m_transitions[state * 256 + (byte & 0xdf)];
+        }
+        for (int byte = 'a'; byte <= 'z'; byte++)
+            m_first_byte[byte] = m_first_byte[byte & 0xdf];
+    }
+
+    m_output_index.assign(1, 0);
+    for (const std::vector<uint32_t> & state_outputs : outputs)
+    {
+        m_outputs.insert(m_outputs.end(),
+                         state_outputs.begin(), state_outputs.end());
+        m_output_index.push_back(m_outputs.size());
+    }
+}
+
+} // namespace bfind
@@ -0,0 +1,186 @@
+#pragma once
+
+// bfind - pattern matching engines
+//
+// A matcher finds all occurrences of a set of patterns in one pass over the
+// data. A single pattern is searched for with the vectorized engines in
+// scan.h or one of the skipping searchers in skip.h. Several patterns are
+// compiled into an Aho-Corasick automaton. Bit granular patterns are
+// searched for with the shifted patterns in bits.h, and regular expressions
+// with the lazy DFAs in dfa.h.
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bits.h"
+#include "dfa.h"
+#include "skip.h"
+
+namespace bfind
+{
+
+enum algorithm
+{
+    k_algo_auto,          // Pick one based on the patterns
+    k_algo_simd,          // First/last byte filter, see scan.h
+    k_algo_horspool,      // Boyer-Moore-Horspool skip table
+    k_algo_two_way,       // Two-Way, linear worst case
+    k_algo_rare,          // memchr for the rarest pattern byte
+    k_algo_aho_corasick,  // Automaton for any number of patterns
+    k_algo_bits,          // Shifted patterns, for bit granular patterns
+    k_algo_regex,         // Lazy DFA, for regular expressions
+    k_algo_count
+};
+
+// Return a printable name of the algorithm, e.g. "two-way"
+const char *
+algorithm_name(algorithm algo);
+
+// A search pattern
+struct pattern
+{
+    std::vector<uint8_t> bytes;  // The bytes to search for
+    std::string text;            // The pattern as given by the user
+    uint64_t bit_length = 0;     // For a pattern that may start at any bit,
+                                 // the number of bits in bytes. 0 otherwise.
+    std::vector<uint8_t> mask;   // The bits of each byte that must match, or
+                                 // empty if all bits must. bytes is zero
+                                 // outside the mask.
+    bool regex = false;          // text is a regular expression, see dfa.h,
+                                 // and bytes is empty
+    bool fold_case = false;      // Letters in a regular expression match
+                                 // either case
+};
+
+// A match of one pattern
+struct match
+{
+    uint64_t position;  // Offset of the first matching byte
+    uint32_t pattern;   // Index of the matching pattern
+    uint8_t bit;        // Offset of the first matching bit in the first
+                        // byte, 0 is the most significant bit
+    uint32_t length;    // Length of a regular expression match, 0 for
+                        // other patterns
+};
+
+class matcher
+{
+    public:
+        // Compile the patterns. Algorithms other than k_algo_auto,
+        // k_algo_aho_corasick, k_algo_bits and k_algo_regex can only be used
+        // for a single pattern. Bit granular patterns are always searched
+        // for with k_algo_bits, regular expressions with k_algo_regex, and
+        // masked patterns with k_algo_simd, one pattern at a time. Several
+        // case-insensitive ASCII patterns can still use k_algo_aho_corasick.
+        // Regular expressions must compile, see regex_searcher::error().
+        matcher(const std::vector<pattern> & patterns,
+                algorithm algo = k_algo_auto);
+
+        // The searchers point into m_patterns
+        matcher(const matcher &) = delete;
+        matcher & operator=(const matcher &) = delete;
+
+        // Append all complete matches in buffer[0, length) that start before
+        // start_limit to matches, ordered by position, bit offset and pattern
+        // index. Positions are relative to buffer.
+        void find_matches(const uint8_t * buffer,
+                          uint64_t length,
+                          uint64_t start_limit,
+                          std::vector<match> & matches) const;
+
+        // Like find_matches(), but only for the matches that start at a
+        // multiple of stride. For large strides, each aligned position is
+        // checked on its own instead of searching the whole buffer.
+        void find_strided(const uint8_t * buffer,
+                          uint64_t length,
+                          uint64_t start_limit,
+                          uint64_t stride,
+                          std::vector<match> & matches) const;
+
+        // Length of the longest pattern. A block that should report all
+        // matches starting in its first n bytes needs max_length() - 1 more
+        // bytes of data.
+        uint64_t max_length() const;
+
+        // Length of pattern number index
+        uint64_t length(uint32_t index) const;
+
+        // Number of bytes covered by a match
+        uint64_t match_length(const match & found) const;
+
+        // Number of patterns
+        size_t size() const;
+
+        // The algorithm in use, never k_algo_auto
+        algorithm get_algorithm() const;
+
+        // Describe the algorithm in use and its parameters
+        std::string describe() const;
+
+    private:
+        // Pick an algorithm for a single pattern
+        algorithm choose_algorithm() const;
+
+        // Return the first occurrence of pattern number index, or nullptr
+        const uint8_t * find_first(const uint8_t * buffer,
+                                   uint64_t length,
+                                   uint32_t index) const;
+
+        // Build the trie, the failure links and the complete transition
+        // table of the automaton
+        void build_automaton();
+
+        void find_single(const uint8_t * buffer,
+                         uint64_t length,
+                         uint64_t start_limit,
+                         std::vector<match> & matches) const;
+
+        void find_multiple(const uint8_t * buffer,
+                           uint64_t length,
+                           uint64_t start_limit,
+                           std::vector<match> & matches) const;
+
+        void find_bits(const uint8_t * buffer,
+                       uint64_t length,
+                       uint64_t start_limit,
+                       std::vector<match> & matches) const;
+
+        void find_regex(const uint8_t * buffer,
+                        uint64_t length,
+                        uint64_t start_limit,
+                        std::vector<match> & matches) const;
+
+        // Append the matches at buffer[0] of the byte patterns
+        void match_at(const uint8_t * buffer,
+                      uint64_t length,
+                      std::vector<match> & matches) const;
+
+        std::vector<pattern> m_patterns;
+        uint64_t m_max_length = 0;
+        algorithm m_algorithm = k_algo_auto;
+
+        // Single pattern searchers, only the one in use is created
+        std::unique_ptr<horspool_searcher> m_horspool;
+        std::unique_ptr<two_way_searcher> m_two_way;
+        std::unique_ptr<rare_byte_searcher> m_rare;
+
+        // One searcher per pattern for k_algo_bits
+        std::vector<std::unique_ptr<bit_searcher>> m_bit_searchers;
+
+        // One searcher per pattern for k_algo_regex
+        std::vector<std::unique_ptr<regex_searcher>> m_regex_searchers;
+
+        // Automaton, state 0 is the root. The next state for byte b in
+        // state s is m_transitions[s * 256 + b]. The patterns ending in
+        // state s are m_outputs[m_output_index[s], m_output_index[s + 1]).
+        std::vector<uint32_t> m_transitions;
+        std::vector<uint32_t> m_output_index;
+        std::vector<uint32_t> m_outputs;
+        bool m_first_byte[256];  // Bytes leaving the root state
+        bool m_fold_case = false; // Letters in the data match either case
+};
+
+} // namespace bfind
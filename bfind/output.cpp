@@ -0,0 +1,148 @@
+// bfind - buffered output
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+const char k_hex_pairs[513] =
+    "000102030405060708090a0b0c0d0e0f"
+    "101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f"
+    "303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f"
+    "505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f"
+    "707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f"
+    "909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+    "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+    "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+output_buffer::output_buffer(int fd, size_t capacity) :
+    m_fd(fd),
+    m_buffer((char *) malloc(capacity)),
+    m_capacity(capacity)
+{
+}
+
+output_buffer::~output_buffer()
+{
+    flush();
+    free(m_buffer);
+}
+
+void
+output_buffer::make_room(size_t length)
+{
+    flush();
+    if (length > m_capacity)
+    {
+        m_capacity = length;
+        m_buffer = (char *) realloc(m_buffer, m_capacity);
+    }
+}
+
+void
+output_buffer::put(const char * text, size_t length)
+{
+    commit(format_text(reserve(length), text, length));
+}
+
+void
+output_buffer::put(const char * text)
+{
+    put(text, strlen(text));
+}
+
+bool
+output_buffer::flush()
+{
+    size_t written = 0;
+    while (written < m_used && !m_failed)
+    {
+        ssize_t result = write(m_fd, m_buffer + written, m_used - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            m_failed = true;
+        else
+            written += result;
+    }
+    m_used = 0;
+    return !m_failed;
+}
+
+char *
+format_text(char * dst, const char * text, size_t length)
+{
+    memcpy(dst, text, length);
+    return dst + length;
+}
+
+char *
+format_hex(char * dst, uint64_t value, int width)
+{
+    static const char k_digits[] = "0123456789ABCDEF";
+    char text[16];
+    int length = 0;
+    do
+    {
+        text[sizeof(text) - ++length] = k_digits[value & 0xf];
+        value >>= 4;
+    }
+    while (value);
+
+    for (; width > length; width--)
+        *dst++ = '0';
+    return format_text(dst, text + sizeof(text) - length, length);
+}
+
+char *
+format_decimal(char * dst, uint64_t value, int width)
+{
+    char text[20];
+    int length = 0;
+    do
+    {
+        text[sizeof(text) - ++length] = '0' + value % 10;
+        value /= 10;
+    }
+    while (value);
+
+    for (; width > length; width--)
+        *dst++ = '0';
+    return format_text(dst, text + sizeof(text) - length, length);
+}
+
+char *
+format_json_string(char * dst, const char * text, size_t length)
+{
+    *dst++ = '"';
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            *dst++ = '\\';
+            *dst++ = c;
+        }
+        else if (c < 0x20)
+        {
+            dst = format_text(dst, "\\u00", 4);
+            dst = format_hex_byte(dst, c);
+        }
+        else
+        {
+            *dst++ = c;
+        }
+    }
+    *dst++ = '"';
+    return dst;
+}
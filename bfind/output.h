@@ -0,0 +1,101 @@
+#pragma once
+
+// bfind - buffered output
+//
+// Match lines are formatted straight into a large buffer, which is written
+// with a single write() per batch, instead of one printf() call per byte.
+
+#include <stddef.h>
+#include <stdint.h>
+
+class output_buffer
+{
+    public:
+        // Write to the file descriptor fd in batches of about capacity bytes
+        explicit output_buffer(int fd, size_t capacity = 1 << 20);
+        ~output_buffer();
+
+        output_buffer(const output_buffer &) = delete;
+        output_buffer & operator=(const output_buffer &) = delete;
+
+        // Return room for at least length bytes. Fill it, and pass the end
+        // of what was written to commit().
+        char * reserve(size_t length)
+        {
+            if (m_used + length > m_capacity)
+                make_room(length);
+            return m_buffer + m_used;
+        }
+
+        void commit(char * end)
+        {
+            m_used = end - m_buffer;
+        }
+
+        void put(const char * text, size_t length);
+        void put(const char * text);
+
+        // Write the buffered output. Returns false if the write failed.
+        bool flush();
+
+    private:
+        // Flush, and grow the buffer if length bytes still do not fit
+        void make_room(size_t length);
+
+        int m_fd;
+        char * m_buffer;
+        size_t m_capacity;
+        size_t m_used = 0;
+        bool m_failed = false;
+};
+
+// Formatting helpers for output_buffer::reserve(). Each writes to dst and
+// returns the end of what it wrote.
+
+// Copy length bytes of text
+char *
+format_text(char * dst, const char * text, size_t length);
+
+// A byte as two lower case hexadecimal digits, from a table
+extern const char k_hex_pairs[513];  // "000102...feff"
+
+inline char *
+format_hex_byte(char * dst, uint8_t byte)
+{
+    dst[0] = k_hex_pairs[2 * byte];
+    dst[1] = k_hex_pairs[2 * byte + 1];
+    return dst + 2;
+}
+
+// A number with at least width digits, zero padded, like printf("%0*lX")
+// and printf("%0*lu")
+char *
+format_hex(char * dst, uint64_t value, int width);
+
+char *
+format_decimal(char * dst, uint64_t value, int width);
+
+// text as a JSON string, with quotes. Needs room for 6 * length + 2 bytes.
+// Bytes that are not ASCII are copied as they are.
+char *
+format_json_string(char * dst, const char * text, size_t length);
+
+// A byte if it is printable ASCII, '.' otherwise
+inline char
+printable(uint8_t byte)
+{
+    return byte >= 0x20 && byte < 0x7f ? byte : '.';
+}
+
+// A match in the --output-format bin stream, which is a plain array of these
+// records in native byte order, so that it can be memory mapped as is
+struct match_record
+{
+    uint64_t offset;    // File offset of the first byte of the match
+    uint32_t pattern;   // Index of the matching pattern, from 0
+    uint16_t length;    // Number of bytes covered by the match
+    uint8_t bit;        // First matching bit with -b, 0 is the most significant
+    uint8_t reserved;   // Always 0
+};
+
+static_assert(sizeof(match_record) == 16, "match_record must be packed");
@@ -0,0 +1,463 @@
+// bfind - vectorized pattern scanning
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BFIND_X86
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+namespace bfind
+{
+
+typedef const uint8_t * (*find_function)(const uint8_t *, uint64_t,
+                                         const uint8_t *, uint64_t);
+
+// A masked pattern, with the two bytes used to filter positions
+struct masked_pattern
+{
+    const uint8_t * bytes;
+    const uint8_t * mask;
+    uint64_t length;
+    uint64_t first;     // Index of the first filter byte
+    uint64_t last;      // Index of the last filter byte
+};
+
+typedef const uint8_t * (*find_masked_function)(const uint8_t *, uint64_t,
+                                                const masked_pattern &);
+
+// Compare the masked bytes, eight at a time
+static inline bool
+masked_equal(const uint8_t * data, const masked_pattern & pattern)
+{
+    uint64_t i = 0;
+    for (; i + 8 <= pattern.length; i += 8)
+    {
+        uint64_t data_word;
+        uint64_t pattern_word;
+        uint64_t mask_word;
+        memcpy(&data_word, data + i, 8);
+        memcpy(&pattern_word, pattern.bytes + i, 8);
+        memcpy(&mask_word, pattern.mask + i, 8);
+        if ((data_word ^ pattern_word) & mask_word)
+            return false;
+    }
+    for (; i < pattern.length; i++)
+    {
+        if ((data[i] ^ pattern.bytes[i]) & pattern.mask[i])
+            return false;
+    }
+    return true;
+}
+
+static const uint8_t *
+find_masked_scalar(const uint8_t * haystack,
+                   uint64_t haystack_length,
+                   const masked_pattern & pattern)
+{
+    if (haystack_length < pattern.length)
+        return nullptr;
+
+    const uint8_t first = pattern.bytes[pattern.first];
+    const uint8_t first_mask = pattern.mask[pattern.first];
+    const uint64_t last_position = haystack_length - pattern.length;
+    for (uint64_t i = 0; i <= last_position; i++)
+    {
+        if ((haystack[i + pattern.first] & first_mask) == first &&
+            masked_equal(haystack + i, pattern))
+            return haystack + i;
+    }
+    return nullptr;
+}
+
+// Compare every position with the whole pattern
+static const uint8_t *
+find_scalar(const uint8_t * haystack,
+            uint64_t haystack_length,
+            const uint8_t * pattern,
+            uint64_t pattern_length)
+{
+    if (haystack_length < pattern_length)
+        return nullptr;
+
+    const uint8_t first = pattern[0];
+    const uint64_t last_position = haystack_length - pattern_length;
+    for (uint64_t i = 0; i <= last_position; i++)
+    {
+        if (haystack[i] == first &&
+            0 == memcmp(haystack + i + 1, pattern + 1, pattern_length - 1))
+            return haystack + i;
+    }
+    return nullptr;
+}
+
+#ifdef BFIND_X86
+
+// Check candidate positions, given as set bits in mask, with a full compare.
+// The first and last bytes are already known to match.
+static inline const uint8_t *
+check_candidates(const uint8_t * position,
+                 uint64_t mask,
+                 const uint8_t * pattern,
+                 uint64_t pattern_length)
+{
+    while (mask)
+    {
+        unsigned lane = __builtin_ctzll(mask);
+        if (pattern_length <= 2 ||
+            0 == memcmp(position + lane + 1, pattern + 1, pattern_length - 2))
+            return position + lane;
+        mask &= mask - 1;
+    }
+    return nullptr;
+}
+
+// Check candidate positions, given as set bits in mask, with a full
+// masked compare
+static inline const uint8_t *
+check_masked_candidates(const uint8_t * position,
+                        uint64_t mask,
+                        const masked_pattern & pattern)
+{
+    while (mask)
+    {
+        unsigned lane = __builtin_ctzll(mask);
+        if (masked_equal(position + lane, pattern))
+            return position + lane;
+        mask &= mask - 1;
+    }
+    return nullptr;
+}
+
+__attribute__((target("sse2")))
+static const uint8_t *
+find_sse2(const uint8_t * haystack,
+          uint64_t haystack_length,
+          const uint8_t * pattern,
+          uint64_t pattern_length)
+{
+    const uint64_t k_lanes = 16;
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+    uint64_t i = 0;
+
+    for (; i + pattern_length - 1 + k_lanes <= haystack_length; i += k_lanes)
+    {
+        const uint8_t * position = haystack + i;
+        __m128i block_first = _mm_loadu_si128((const __m128i *) position);
+        __m128i block_last = _mm_loadu_si128(
+            (const __m128i *) (position + pattern_length - 1));
+        __m128i hits = _mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                     _mm_cmpeq_epi8(last, block_last));
+        uint64_t mask = (uint32_t) _mm_movemask_epi8(hits);
+        const uint8_t * match = check_candidates(position, mask,
+                                                 pattern, pattern_length);
+        if (match)
+            return match;
+    }
+
+    return find_scalar(haystack + i, haystack_length - i,
+                       pattern, pattern_length);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+find_avx2(const uint8_t * haystack,
+          uint64_t haystack_length,
+          const uint8_t * pattern,
+          uint64_t pattern_length)
+{
+    const uint64_t k_lanes = 32;
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+    uint64_t i = 0;
+
+    for (; i + pattern_length - 1 + k_lanes <= haystack_length; i += k_lanes)
+    {
+        const uint8_t * position = haystack + i;
+        __m256i block_first = _mm256_loadu_si256((const __m256i *) position);
+        __m256i block_last = _mm256_loadu_si256(
+            (const __m256i *) (position + pattern_length - 1));
+        __m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                        _mm256_cmpeq_epi8(last, block_last));
+        uint64_t mask = (uint32_t) _mm256_movemask_epi8(hits);
+        const uint8_t * match = check_candidates(position, mask,
+                                                 pattern, pattern_length);
+        if (match)
+            return match;
+    }
+
+    return find_sse2(haystack + i, haystack_length - i,
+                     pattern, pattern_length);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const uint8_t *
+find_avx512(const uint8_t * haystack,
+            uint64_t haystack_length,
+            const uint8_t * pattern,
+            uint64_t pattern_length)
+{
+    const uint64_t k_lanes = 64;
+    const __m512i first = _mm512_set1_epi8(pattern[0]);
+    const __m512i last = _mm512_set1_epi8(pattern[pattern_length - 1]);
+    uint64_t i = 0;
+
+    for (; i + pattern_length - 1 + k_lanes <= haystack_length; i += k_lanes)
+    {
+        const uint8_t * position = haystack + i;
+        __m512i block_first = _mm512_loadu_si512(position);
+        __m512i block_last = _mm512_loadu_si512(position + pattern_length - 1);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(first, block_first) &
+                        _mm512_cmpeq_epi8_mask(last, block_last);
+        const uint8_t * match = check_candidates(position, mask,
+                                                 pattern, pattern_length);
+        if (match)
+            return match;
+    }
+
+    return find_sse2(haystack + i, haystack_length - i,
+                     pattern, pattern_length);
+}
+
+__attribute__((target("sse2")))
+static const uint8_t *
+find_masked_sse2(const uint8_t * haystack,
+                 uint64_t haystack_length,
+                 const masked_pattern & pattern)
+{
+    const uint64_t k_lanes = 16;
+    const __m128i first = _mm_set1_epi8(pattern.bytes[pattern.first]);
+    const __m128i first_mask = _mm_set1_epi8(pattern.mask[pattern.first]);
+    const __m128i last = _mm_set1_epi8(pattern.bytes[pattern.last]);
+    const __m128i last_mask = _mm_set1_epi8(pattern.mask[pattern.last]);
+    uint64_t i = 0;
+
+    for (; i + pattern.length - 1 + k_lanes <= haystack_length; i += k_lanes)
+    {
+        const uint8_t * position = haystack + i;
+        __m128i block_first = _mm_and_si128(first_mask, _mm_loadu_si128(
+            (const __m128i *) (position + pattern.first)));
+        __m128i block_last = _mm_and_si128(last_mask, _mm_loadu_si128(
+            (const __m128i *) (position + pattern.last)));
+        __m128i hits = _mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                     _mm_cmpeq_epi8(last, block_last));
+        uint64_t mask = (uint32_t) _mm_movemask_epi8(hits);
+        const uint8_t * match = check_masked_candidates(position, mask,
+                                                        pattern);
+        if (match)
+            return match;
+    }
+
+    return find_masked_scalar(haystack + i, haystack_length - i, pattern);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+find_masked_avx2(const uint8_t * haystack,
+                 uint64_t haystack_length,
+                 const masked_pattern & pattern)
+{
+    const uint64_t k_lanes = 32;
+    const __m256i first = _mm256_set1_epi8(pattern.bytes[pattern.first]);
+    const __m256i first_mask = _mm256_set1_epi8(pattern.mask[pattern.first]);
+    const __m256i last = _mm256_set1_epi8(pattern.bytes[pattern.last]);
+    const __m256i last_mask = _mm256_set1_epi8(pattern.mask[pattern.last]);
+    uint64_t i = 0;
+
+    for (; i + pattern.length - 1 + k_lanes <= haystack_length; i += k_lanes)
+    {
+        const uint8_t * position = haystack + i;
+        __m256i block_first = _mm256_and_si256(first_mask, _mm256_loadu_si256(
+            (const __m256i *) (position + pattern.first)));
+        __m256i block_last = _mm256_and_si256(last_mask, _mm256_loadu_si256(
+            (const __m256i *) (position + pattern.last)));
+        __m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                        _mm256_cmpeq_epi8(last, block_last));
+        uint64_t mask = (uint32_t) _mm256_movemask_epi8(hits);
+        const uint8_t * match = check_masked_candidates(position, mask,
+                                                        pattern);
+        if (match)
+            return match;
+    }
+
+    return find_masked_sse2(haystack + i, haystack_length - i, pattern);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const uint8_t *
+find_masked_avx512(const uint8_t * haystack,
+                   uint64_t haystack_length,
+                   const masked_pattern & pattern)
+{
+    const uint64_t k_lanes = 64;
+    const __m512i first = _mm512_set1_epi8(pattern.bytes[pattern.first]);
+    const __m512i first_mask = _mm512_set1_epi8(pattern.mask[pattern.first]);
+    const __m512i last = _mm512_set1_epi8(pattern.bytes[pattern.last]);
+    const __m512i last_mask = _mm512_set1_epi8(pattern.mask[pattern.last]);
+    uint64_t i = 0;
+
+    for (; i + pattern.length - 1 + k_lanes <= haystack_length; i += k_lanes)
+    {
+        const uint8_t * position = haystack + i;
+        __m512i block_first = _mm512_loadu_si512(position + pattern.first);
+        __m512i block_last = _mm512_loadu_si512(position + pattern.last);
+        uint64_t mask =
+            _mm512_cmpeq_epi8_mask(first,
+                                   _mm512_and_si512(first_mask, block_first)) &
+            _mm512_cmpeq_epi8_mask(last,
+                                   _mm512_and_si512(last_mask, block_last));
+        const uint8_t * match = check_masked_candidates(position, mask,
+                                                        pattern);
+        if (match)
+            return match;
+    }
+
+    return find_masked_sse2(haystack + i, haystack_length - i, pattern);
+}
+
+#endif // BFIND_X86
+
+static const find_function k_find_functions[k_engine_count] =
+{
+    find_scalar,
+#ifdef BFIND_X86
+    find_sse2,
+    find_avx2,
+    find_avx512,
+#else
+    nullptr,
+    nullptr,
+    nullptr,
+#endif
+};
+
+static const find_masked_function k_find_masked_functions[k_engine_count] =
+{
+    find_masked_scalar,
+#ifdef BFIND_X86
+    find_masked_sse2,
+    find_masked_avx2,
+    find_masked_avx512,
+#else
+    nullptr,
+    nullptr,
+    nullptr,
+#endif
+};
+
+bool
+scan_engine_supported(scan_engine engine)
+{
+#ifdef BFIND_X86
+    // Might run before static constructors, so make sure the CPU model
+    // has been initialized.
+    __builtin_cpu_init();
+    switch (engine)
+    {
+        case k_engine_scalar: return true;
+        case k_engine_sse2:   return __builtin_cpu_supports("sse2");
+        case k_engine_avx2:   return __builtin_cpu_supports("avx2");
+        case k_engine_avx512: return __builtin_cpu_supports("avx512f") &&
+                                     __builtin_cpu_supports("avx512bw");
+        default:              return false;
+    }
+#else
+    return engine == k_engine_scalar;
+#endif
+}
+
+// Pick the widest engine supported by the CPU
+static scan_engine
+best_scan_engine()
+{
+    for (int engine = k_engine_count - 1; engine > k_engine_scalar; engine--)
+    {
+        if (scan_engine_supported((scan_engine) engine))
+            return (scan_engine) engine;
+    }
+    return k_engine_scalar;
+}
+
+static scan_engine g_engine = best_scan_engine();
+static find_function g_find = k_find_functions[g_engine];
+static find_masked_function g_find_masked = k_find_masked_functions[g_engine];
+
+const uint8_t *
+find_pattern(const uint8_t * haystack,
+             uint64_t haystack_length,
+             const uint8_t * pattern,
+             uint64_t pattern_length)
+{
+    if (pattern_length == 0)
+        return haystack;
+    if (haystack_length < pattern_length)
+        return nullptr;
+    return g_find(haystack, haystack_length, pattern, pattern_length);
+}
+
+const uint8_t *
+find_masked_pattern(const uint8_t * haystack,
+                    uint64_t haystack_length,
+                    const uint8_t * pattern,
+                    const uint8_t * mask,
+                    uint64_t pattern_length)
+{
+    if (haystack_length < pattern_length)
+        return nullptr;
+
+    // Filter on the outermost fully masked bytes, or else on the outermost
+    // bytes with any mask bits
+    masked_pattern masked = {pattern, mask, pattern_length, 0, 0};
+    bool full = false;
+    bool any = false;
+    for (uint64_t i = 0; i < pattern_length; i++)
+    {
+        if (mask[i] == 0 || (full && mask[i] != 0xff))
+            continue;
+        if (!any || (!full && mask[i] == 0xff))
+            masked.first = i;
+        masked.last = i;
+        full = full || mask[i] == 0xff;
+        any = true;
+    }
+
+    // everything matches a pattern of wildcards
+    if (!any)
+        return haystack;
+    return g_find_masked(haystack, haystack_length, masked);
+}
+
+bool
+set_scan_engine(scan_engine engine)
+{
+    if (!scan_engine_supported(engine))
+        return false;
+    g_engine = engine;
+    g_find = k_find_functions[engine];
+    g_find_masked = k_find_masked_functions[engine];
+    return true;
+}
+
+scan_engine
+get_scan_engine()
+{
+    return g_engine;
+}
+
+const char *
+scan_engine_name(scan_engine engine)
+{
+    switch (engine)
+    {
+        case k_engine_scalar: return "scalar";
+        case k_engine_sse2:   return "sse2";
+        case k_engine_avx2:   return "avx2";
+        case k_engine_avx512: return "avx512";
+        default:              return "unknown";
+    }
+}
+
+} // namespace bfind
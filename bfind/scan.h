@@ -0,0 +1,61 @@
+#pragma once
+
+// bfind - vectorized pattern scanning
+//
+// The scan engines compare the first and the last byte of the pattern against
+// 16, 32 or 64 buffer positions at a time (SSE2, AVX2, AVX-512) and only run
+// a full comparison for positions where both bytes match. The fastest engine
+// supported by the CPU is picked at startup. Masked patterns, where only some
+// bits of each byte must match, are filtered the same way with an AND before
+// each compare.
+
+#include <stdint.h>
+
+namespace bfind
+{
+
+enum scan_engine
+{
+    k_engine_scalar,   // byte-by-byte, portable
+    k_engine_sse2,     // 16 positions per step
+    k_engine_avx2,     // 32 positions per step
+    k_engine_avx512,   // 64 positions per step
+    k_engine_count
+};
+
+// Return a pointer to the first occurrence of pattern in haystack, or nullptr
+// if there is none. Only complete occurrences are reported.
+const uint8_t *
+find_pattern(const uint8_t * haystack,
+             uint64_t haystack_length,
+             const uint8_t * pattern,
+             uint64_t pattern_length);
+
+// Like find_pattern(), for the first position p where
+// (haystack[p + i] & mask[i]) == pattern[i] for all i. The pattern bytes must
+// be zero outside the mask.
+const uint8_t *
+find_masked_pattern(const uint8_t * haystack,
+                    uint64_t haystack_length,
+                    const uint8_t * pattern,
+                    const uint8_t * mask,
+                    uint64_t pattern_length);
+
+// Return true if the engine can be used on this CPU
+bool
+scan_engine_supported(scan_engine engine);
+
+// Select the engine used by find_pattern(). Returns false, leaving the
+// current engine in place, if the engine is not supported by this CPU.
+bool
+set_scan_engine(scan_engine engine);
+
+// Return the engine currently used by find_pattern()
+scan_engine
+get_scan_engine();
+
+// Return a printable name of the engine, e.g. "avx2"
+const char *
+scan_engine_name(scan_engine engine);
+
+} // namespace bfind
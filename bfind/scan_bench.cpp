@@ -0,0 +1,217 @@
+//
+// scan_bench
+//
+// Throughput comparison of the byte-by-byte search loop bfind used to have
+// and the vectorized scan engines in scan.cpp, for exact and for masked
+// patterns. Run with make bench.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+
+#include "scan.h"
+
+using namespace bfind;
+
+// The search loop from bfind's original search() function
+static uint64_t
+count_reference(const uint8_t * buffer,
+                uint64_t length,
+                const uint8_t * pattern,
+                uint64_t pattern_length)
+{
+    uint64_t match_count = 0;
+    for (uint64_t buffer_pos = 0;
+         buffer_pos + pattern_length <= length;
+         buffer_pos++)
+    {
+        const uint8_t * buffer_ptr = buffer + buffer_pos;
+        bool match = true;
+        for (uint64_t pattern_pos = 0; pattern_pos < pattern_length; pattern_pos++)
+        {
+            if (buffer_ptr[pattern_pos] != pattern[pattern_pos])
+            {
+                match = false;
+                break;
+            }
+        }
+        if (match)
+            match_count++;
+    }
+    return match_count;
+}
+
+// Byte-by-byte masked search
+static uint64_t
+count_masked_reference(const uint8_t * buffer,
+                       uint64_t length,
+                       const uint8_t * pattern,
+                       const uint8_t * mask,
+                       uint64_t pattern_length)
+{
+    uint64_t match_count = 0;
+    for (uint64_t buffer_pos = 0;
+         buffer_pos + pattern_length <= length;
+         buffer_pos++)
+    {
+        uint64_t pattern_pos = 0;
+        while (pattern_pos < pattern_length &&
+               (buffer[buffer_pos + pattern_pos] & mask[pattern_pos]) ==
+               pattern[pattern_pos])
+            pattern_pos++;
+        if (pattern_pos == pattern_length)
+            match_count++;
+    }
+    return match_count;
+}
+
+static uint64_t
+count_masked_engine(const uint8_t * buffer,
+                    uint64_t length,
+                    const uint8_t * pattern,
+                    const uint8_t * mask,
+                    uint64_t pattern_length)
+{
+    uint64_t match_count = 0;
+    const uint8_t * position = buffer;
+    const uint8_t * end = buffer + length;
+    while ((position = find_masked_pattern(position, end - position,
+                                           pattern, mask,
+                                           pattern_length)) != nullptr)
+    {
+        match_count++;
+        position++;
+    }
+    return match_count;
+}
+
+static uint64_t
+count_engine(const uint8_t * buffer,
+             uint64_t length,
+             const uint8_t * pattern,
+             uint64_t pattern_length)
+{
+    uint64_t match_count = 0;
+    const uint8_t * position = buffer;
+    const uint8_t * end = buffer + length;
+    while ((position = find_pattern(position, end - position,
+                                    pattern, pattern_length)) != nullptr)
+    {
+        match_count++;
+        position++;
+    }
+    return match_count;
+}
+
+// Deterministic pseudo random bytes (xorshift64)
+static void
+fill_random(uint8_t * buffer, uint64_t length, uint64_t seed)
+{
+    for (uint64_t i = 0; i < length; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        buffer[i] = (uint8_t) seed;
+    }
+}
+
+static double
+seconds_since(std::chrono::steady_clock::time_point start)
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now() - start).count();
+}
+
+int
+main(int argc, char * argv [])
+{
+    const uint64_t k_corpus_size = 64 << 20;
+    const uint64_t k_pattern_lengths[] = { 1, 2, 4, 8, 16, 32, 64 };
+    const uint64_t k_planted = 1000; // pattern copies per corpus
+    uint8_t * corpus = (uint8_t*) malloc(k_corpus_size);
+    uint8_t pattern[64];
+    uint8_t masked_pattern[64];
+    uint8_t mask[64];
+    int status = 0;
+
+    printf("corpus: %lu MiB random data, %lu planted matches\n",
+           k_corpus_size >> 20, k_planted);
+    printf("%8s  %-12s %12s %10s\n", "length", "engine", "MB/s", "matches");
+
+    for (uint64_t pattern_length : k_pattern_lengths)
+    {
+        fill_random(corpus, k_corpus_size, 0x9e3779b97f4a7c15ULL);
+        fill_random(pattern, sizeof(pattern), pattern_length);
+        for (uint64_t i = 0; i < k_planted; i++)
+        {
+            uint64_t offset = (k_corpus_size / k_planted) * i;
+            memcpy(corpus + offset, pattern, pattern_length);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t expected = count_reference(corpus, k_corpus_size,
+                                            pattern, pattern_length);
+        double seconds = seconds_since(start);
+        printf("%8lu  %-12s %12.1f %10lu\n", pattern_length, "reference",
+               k_corpus_size / seconds / 1e6, expected);
+
+        for (int engine = 0; engine < k_engine_count; engine++)
+        {
+            if (!set_scan_engine((scan_engine) engine))
+                continue;
+
+            start = std::chrono::steady_clock::now();
+            uint64_t matches = count_engine(corpus, k_corpus_size,
+                                            pattern, pattern_length);
+            seconds = seconds_since(start);
+            printf("%8lu  %-12s %12.1f %10lu%s\n", pattern_length,
+                   scan_engine_name((scan_engine) engine),
+                   k_corpus_size / seconds / 1e6, matches,
+                   matches == expected ? "" : "  MISMATCH");
+            if (matches != expected)
+                status = 1;
+        }
+
+        // the same pattern with a wildcard nibble in the middle
+        memset(mask, 0xff, sizeof(mask));
+        mask[pattern_length / 2] = 0x0f;
+        for (uint64_t i = 0; i < pattern_length; i++)
+            masked_pattern[i] = pattern[i] & mask[i];
+
+        start = std::chrono::steady_clock::now();
+        expected = count_masked_reference(corpus, k_corpus_size,
+                                          masked_pattern, mask,
+                                          pattern_length);
+        seconds = seconds_since(start);
+        printf("%8lu  %-12s %12.1f %10lu\n", pattern_length, "ref/mask",
+               k_corpus_size / seconds / 1e6, expected);
+
+        for (int engine = 0; engine < k_engine_count; engine++)
+        {
+            if (!set_scan_engine((scan_engine) engine))
+                continue;
+
+            std::string name = scan_engine_name((scan_engine) engine);
+            name += "/mask";
+            start = std::chrono::steady_clock::now();
+            uint64_t matches = count_masked_engine(corpus, k_corpus_size,
+                                                   masked_pattern, mask,
+                                                   pattern_length);
+            seconds = seconds_since(start);
+            printf("%8lu  %-12s %12.1f %10lu%s\n", pattern_length,
+                   name.c_str(), k_corpus_size / seconds / 1e6, matches,
+                   matches == expected ? "" : "  MISMATCH");
+            if (matches != expected)
+                status = 1;
+        }
+    }
+
+    free(corpus);
+    return status;
+}
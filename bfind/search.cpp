@@ -0,0 +1,526 @@
+// bfind - search API of libbfind
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "search.h"
+
+namespace bfind
+{
+
+static bool
+is_hex_character(uint8_t c)
+{
+    c = toupper(c);
+    if (isalpha(c))
+        return c <= 'F' && c >= 'A';
+    else
+        return c <= '9' && c >= '0';
+}
+
+static uint8_t
+nibble2byte(uint8_t c)
+{
+    uint8_t d = 0;
+    c = toupper(c);
+
+    if (isalpha(c))
+        d = c - 'A' + 10; // 'A' should equal 10
+    else
+        d = c - '0';      // the value of the digit
+
+    return d;
+}
+
+bool
+parse_pattern(const char * text,
+              format pattern_format,
+              bool case_sensitive,
+              bool any_bit,
+              pattern & dst,
+              std::string & error)
+{
+    uint64_t length = strlen(text);
+    dst.text = text;
+    dst.bytes.clear();
+
+    if (length == 0)
+    {
+        error = "Empty search string";
+        return false;
+    }
+
+    if (pattern_format != k_ascii && pattern_format != k_regex &&
+        case_sensitive == false)
+    {
+        error = "Case can only be ignored when searching for ASCII "
+                "strings.";
+        return false;
+    }
+
+    if (k_regex == pattern_format)
+    {
+        dst.regex = true;
+        dst.fold_case = !case_sensitive;
+        regex_searcher check(dst);
+        if (!check.error().empty())
+        {
+            error = std::string("Bad regular expression ") + text + ": " +
+                    check.error();
+            return false;
+        }
+    }
+    else if (k_ascii == pattern_format)
+    {
+        dst.bytes.assign(text, text + length);
+
+        // Upper and lower case ASCII letters only differ in bit 0x20. The
+        // search compares under the mask, so the data is never rewritten.
+        if (case_sensitive == false)
+        {
+            dst.mask.assign(length, 0xff);
+            bool masked = false;
+            for (uint64_t i = 0; i < length; i++)
+            {
+                if (isalpha(dst.bytes[i]))
+                {
+                    dst.bytes[i] &= 0xdf;
+                    dst.mask[i] = 0xdf;
+                    masked = true;
+                }
+            }
+            if (!masked)
+                dst.mask.clear();
+        }
+    }
+    else if (k_hex == pattern_format)
+    {
+        // An optional mask follows a slash, e.g. 4d5a0000/ffff00f0
+        const char * mask_text = strchr(text, '/');
+        if (mask_text)
+        {
+            length = mask_text - text;
+            mask_text++;
+        }
+
+        if (length & 1)
+        {
+            error = "Hexadecimal search string length should be a "
+                    "multiple of two.";
+            return false;
+        }
+
+        if (mask_text && strlen(mask_text) != length)
+        {
+            error = "Hexadecimal mask length should be the search "
+                    "string length.";
+            return false;
+        }
+
+        // A ? matches any nibble
+        bool masked = false;
+        for (uint64_t i = 0; i < length; i+=2)
+        {
+            uint8_t value = 0;
+            uint8_t mask = 0;
+            for (uint64_t j = i; j < i + 2; j++)
+            {
+                value <<= 4;
+                mask <<= 4;
+                if (text[j] == '?')
+                {
+                    continue;
+                }
+                else if (!is_hex_character(text[j]))
+                {
+                    error = "Non-hexadecimal character in search pattern";
+                    return false;
+                }
+                value |= nibble2byte(text[j]);
+                mask |= 0xf;
+            }
+
+            if (mask_text)
+            {
+                if (!is_hex_character(mask_text[i]) ||
+                    !is_hex_character(mask_text[i + 1]))
+                {
+                    error = "Non-hexadecimal character in search pattern mask";
+                    return false;
+                }
+                mask &= (nibble2byte(mask_text[i]) << 4) |
+                        nibble2byte(mask_text[i + 1]);
+            }
+
+            masked = masked || mask != 0xff;
+            dst.bytes.push_back(value & mask);
+            dst.mask.push_back(mask);
+        }
+
+        if (!masked)
+            dst.mask.clear();
+    }
+    else if (k_bin == pattern_format && any_bit)
+    {
+        dst.bytes.assign((length + 7) / 8, 0);
+        dst.bit_length = length;
+        for (uint64_t i = 0; i < length; i++)
+        {
+            if ('1' == text[i])
+            {
+                dst.bytes[i / 8] |= 0x80 >> (i % 8);
+            }
+            else if ('0' != text[i])
+            {
+                error = "Non-binary character in search pattern";
+                return false;
+            }
+        }
+    }
+    else if (k_bin == pattern_format)
+    {
+        if (length % 8)
+        {
+            error = "Binary search string length should be a multiple "
+                    "of eight.";
+            return false;
+        }
+
+        for (uint64_t i = 0; i < length; i+=8)
+        {
+            uint8_t dst_value = 0;
+            for (uint64_t j = 0; j < 8; j++)
+            {
+                dst_value <<= 1;
+                uint8_t bit_char = text[i + j];
+                if ('1' == bit_char)
+                {
+                    dst_value |= 1;
+                }
+                else if ('0' != bit_char)
+                {
+                    error = "Non-binary character in search pattern";
+                    return false;
+                }
+            }
+            dst.bytes.push_back(dst_value);
+        }
+    }
+
+    return true;
+}
+
+
+void
+find_in_range(const matcher & engine,
+              const search_range & range,
+              const uint8_t * buffer,
+              uint64_t length,
+              uint64_t search_start,
+              uint64_t start_limit,
+              uint64_t data_pos,
+              std::vector<match> & matches)
+{
+    if (range.end < data_pos + length)
+        length = range.end > data_pos ? range.end - data_pos : 0;
+    if (range.start > data_pos)
+        search_start = std::max(search_start, range.start - data_pos);
+    if (range.stride > 1)
+    {
+        // round up to the next offset range.start + k * stride
+        uint64_t misaligned =
+            (data_pos + search_start - range.start) % range.stride;
+        if (misaligned)
+            search_start += range.stride - misaligned;
+    }
+    start_limit = std::min(start_limit, length);
+    if (search_start >= start_limit)
+        return;
+
+    size_t first_match = matches.size();
+    if (range.stride > 1)
+        engine.find_strided(buffer + search_start, length - search_start,
+                            start_limit - search_start, range.stride,
+                            matches);
+    else
+        engine.find_matches(buffer + search_start, length - search_start,
+                            start_limit - search_start, matches);
+    for (size_t i = first_match; i < matches.size(); i++)
+        matches[i].position += search_start;
+}
+
+uint64_t
+block_headroom(uint64_t overlap, uint64_t side_bytes)
+{
+    return overlap + 2 * side_bytes;
+}
+
+uint64_t
+scan_blocks(const block_source & next_block,
+            uint64_t overlap,
+            uint64_t side_bytes,
+            uint64_t data_end,
+            const block_scanner & scan)
+{
+    uint64_t lookahead = overlap + side_bytes;
+    std::vector<uint8_t> tail_bytes(lookahead + side_bytes);
+    uint64_t tail = 0;          // bytes carried from the previous block
+    uint64_t searched = 0;      // bytes of the tail that are searched already
+    uint64_t data_pos = 0;      // offset of the next block
+    uint8_t * block = nullptr;
+    uint64_t block_length = 0;
+
+    while (data_pos < data_end && next_block(block, block_length))
+    {
+        // the source leaves room for the tail in front of the block
+        uint8_t * buffer = block - tail;
+        uint64_t buffer_fill = tail + block_length;
+        memcpy(buffer, tail_bytes.data(), tail);
+
+        // matches starting in the lookahead may continue in the next block
+        uint64_t start_limit = buffer_fill > lookahead ?
+                               buffer_fill - lookahead : 0;
+        start_limit = std::max(start_limit, searched);
+        if (!scan(buffer, buffer_fill, searched, start_limit,
+                  data_pos - tail, false))
+            return data_pos + block_length;
+
+        uint64_t next_tail = std::min(buffer_fill - start_limit + side_bytes,
+                                      buffer_fill);
+        memcpy(tail_bytes.data(), buffer + buffer_fill - next_tail, next_tail);
+        searched = next_tail - (buffer_fill - start_limit);
+        data_pos += block_length;
+        tail = next_tail;
+    }
+
+    // the tail ends the data
+    scan(tail_bytes.data(), tail, searched, tail, data_pos - tail, true);
+    return data_pos;
+}
+
+searcher::searcher(const std::vector<pattern> & patterns,
+                   const search_options & options) :
+    m_options(options)
+{
+    if (patterns.empty())
+        m_error = "No search string specified";
+    for (const pattern & p : patterns)
+    {
+        if (!p.regex && p.bytes.empty())
+            m_error = "Empty search string";
+        if (!p.regex || !m_error.empty())
+            continue;
+
+        // the matcher expects regular expressions that compile
+        regex_searcher check(p);
+        if (!check.error().empty())
+            m_error = "Bad regular expression " + p.text + ": " +
+                      check.error();
+    }
+    if (m_options.range.start >= m_options.range.end)
+        m_error = "The range start must be below its end";
+    if (m_options.range.stride == 0 || m_options.buffer_size == 0)
+        m_error = "The stride and the buffer size can not be 0";
+
+    if (m_error.empty())
+        m_engine.reset(new matcher(patterns, m_options.algo));
+}
+
+const std::string &
+searcher::error() const
+{
+    return m_error;
+}
+
+const matcher *
+searcher::engine() const
+{
+    return m_engine.get();
+}
+
+bool
+searcher::scan_block(const uint8_t * buffer,
+                     uint64_t length,
+                     uint64_t search_start,
+                     uint64_t start_limit,
+                     uint64_t data_pos,
+                     const match_callback & callback,
+                     scan_result & result) const
+{
+    std::vector<match> matches;
+    for (uint64_t offset = search_start;
+         offset < start_limit;
+         offset += m_options.buffer_size)
+    {
+        matches.clear();
+        uint64_t step_limit = std::min(offset + m_options.buffer_size,
+                                       start_limit);
+        find_in_range(*m_engine, m_options.range, buffer, length, offset,
+                      step_limit, data_pos, matches);
+
+        for (match & found : matches)
+        {
+            const uint8_t * bytes = buffer + found.position;
+            found.position += data_pos;
+            result.matches++;
+            if (!callback(found, bytes, m_engine->match_length(found)) ||
+                result.matches == m_options.max_count)
+            {
+                result.stopped = true;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+scan_result
+searcher::scan(const uint8_t * data,
+               uint64_t length,
+               const match_callback & callback) const
+{
+    scan_result result;
+    result.bytes = length;
+    if (!m_engine)
+    {
+        result.error = m_error;
+        return result;
+    }
+
+    // find_in_range() skips the rest, this only saves empty steps
+    uint64_t start = std::min(m_options.range.start, length);
+    uint64_t stop = std::min(m_options.range.end, length);
+    scan_block(data, length, start, stop, 0, callback, result);
+    return result;
+}
+
+void
+searcher::scan_source(const block_source & next_block,
+                      const match_callback & callback,
+                      scan_result & result) const
+{
+    result.bytes = scan_blocks(next_block, m_engine->max_length() - 1, 0,
+                               m_options.range.end,
+                               [&](const uint8_t * buffer,
+                                   uint64_t length,
+                                   uint64_t search_start,
+                                   uint64_t start_limit,
+                                   uint64_t data_pos,
+                                   bool)
+                               {
+                                   return scan_block(buffer, length,
+                                                     search_start,
+                                                     start_limit, data_pos,
+                                                     callback, result);
+                               });
+}
+
+void
+searcher::scan_compressed(int fd,
+                          compression kind,
+                          const match_callback & callback,
+                          scan_result & result) const
+{
+    decompressor reader(fd, kind, m_options.buffer_size,
+                        block_headroom(m_engine->max_length() - 1, 0));
+    if (!reader.start())
+    {
+        result.error = reader.error();
+        return;
+    }
+
+    bool ended = false;         // next() failed, at the end or on bad data
+    scan_source([&](uint8_t * & block, uint64_t & length)
+                {
+                    ended = !reader.next(block, length);
+                    return !ended;
+                },
+                callback, result);
+    if (ended)
+        result.error = reader.error();
+}
+
+scan_result
+searcher::scan_fd(int fd, const match_callback & callback) const
+{
+    scan_result result;
+    if (!m_engine)
+    {
+        result.error = m_error;
+        return result;
+    }
+
+    compression kind = m_options.decompress ? detect_compression(fd)
+                                            : k_compression_none;
+    if (kind != k_compression_none)
+    {
+        scan_compressed(fd, kind, callback, result);
+        return result;
+    }
+
+    uint64_t headroom = block_headroom(m_engine->max_length() - 1, 0);
+    std::vector<uint8_t> buffer(headroom + m_options.buffer_size);
+    scan_source([&](uint8_t * & block, uint64_t & length)
+                {
+                    ssize_t bytes_read;
+                    do
+                    {
+                        bytes_read = read(fd, buffer.data() + headroom,
+                                          m_options.buffer_size);
+                    } while (bytes_read < 0 && errno == EINTR);
+                    if (bytes_read < 0)
+                        result.error = strerror(errno);
+
+                    block = buffer.data() + headroom;
+                    length = bytes_read > 0 ? bytes_read : 0;
+                    return bytes_read > 0;
+                },
+                callback, result);
+    return result;
+}
+
+scan_result
+searcher::scan_file(const std::string & path,
+                    const match_callback & callback) const
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        scan_result result;
+        result.error = "Failed to open " + path + ": " + strerror(errno);
+        return result;
+    }
+
+    struct stat file_stat;
+    bool mappable = fstat(fd, &file_stat) == 0 &&
+                    S_ISREG(file_stat.st_mode) && file_stat.st_size > 0 &&
+                    (!m_options.decompress ||
+                     detect_compression(fd) == k_compression_none);
+    void * mapping = MAP_FAILED;
+    if (mappable && m_engine)
+        mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+
+    scan_result result;
+    if (mapping != MAP_FAILED)
+    {
+        madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+        result = scan((const uint8_t *) mapping, file_stat.st_size,
+                      callback);
+        munmap(mapping, file_stat.st_size);
+    }
+    else
+        result = scan_fd(fd, callback);
+
+    close(fd);
+    return result;
+}
+
+} // namespace bfind
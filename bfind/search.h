@@ -0,0 +1,202 @@
+#pragma once
+
+// bfind - search API of libbfind
+//
+// libbfind is the search engine of bfind without the command line. A
+// searcher compiles a set of patterns once, and then scans buffers, memory
+// mapped files and file descriptors, passing each match to a callback
+// instead of printing it. The scan functions are const, so one searcher can
+// scan on several threads at a time. Everything is in namespace bfind.
+//
+//     bfind::pattern p;
+//     std::string error;
+//     if (!bfind::parse_pattern("4d5a90", bfind::k_hex, true, false, p,
+//                               error))
+//         ...
+//     bfind::searcher s({p});
+//     s.scan_file("file.bin", [](const bfind::match & found,
+//                                const uint8_t * bytes,
+//                                uint64_t length)
+//     {
+//         printf("%llx\n", (unsigned long long) found.position);
+//         return true;
+//     });
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "decompress.h"
+#include "matcher.h"
+
+namespace bfind
+{
+
+enum format
+{
+    k_ascii,   // ASCII text
+    k_dec,     // decimal
+    k_hex,     // hexadecimal
+    k_bin,     // binary
+    k_regex,   // regular expression
+};
+
+// Convert text in the given format to the bytes of a search pattern.
+// Letters in ASCII patterns are masked to match either case unless the
+// search is case sensitive. Regular expressions are kept as text, and only
+// checked here.
+// Binary patterns may have any number of bits, and start at any bit, if
+// any_bit is set.
+// Returns false, with the reason in error, if text is not a valid pattern.
+bool
+parse_pattern(const char * text,
+              format pattern_format,
+              bool case_sensitive,
+              bool any_bit,
+              pattern & dst,
+              std::string & error);
+
+// The part of the data that matches may start in
+struct search_range
+{
+    uint64_t start = 0;             // Only search the offsets from here
+    uint64_t end = UINT64_MAX;      // up to here, exclusive
+    uint64_t stride = 1;            // Matches start at start + k * stride
+};
+
+// Append the matches in buffer[0, length) that start in [search_start,
+// start_limit) to matches, leaving out those outside of range and those at
+// offsets the stride skips. data_pos is the offset of buffer[0] in the
+// data, and positions are relative to buffer.
+void
+find_in_range(const matcher & engine,
+              const search_range & range,
+              const uint8_t * buffer,
+              uint64_t length,
+              uint64_t search_start,
+              uint64_t start_limit,
+              uint64_t data_pos,
+              std::vector<match> & matches);
+
+struct search_options
+{
+    algorithm algo = k_algo_auto;   // Search algorithm, see matcher
+    search_range range;             // Where matches may start
+    uint64_t max_count = 0;         // Stop after this many matches, or 0
+    uint64_t buffer_size = 1 << 20; // Bytes per read, and per search step
+    bool decompress = true;         // Scan compressed files decompressed
+};
+
+// Returns the next block of data in block, with block_headroom() free bytes
+// in front of it, or false at the end of the data
+typedef std::function<bool (uint8_t * & block,
+                            uint64_t & length)> block_source;
+
+// Receives buffer[0, length), in which the matches that start in
+// [search_start, start_limit) are to be searched. data_pos is the offset of
+// buffer[0] in the data, and last is set for the buffer that ends the data.
+// Returning false stops the scan.
+typedef std::function<bool (const uint8_t * buffer,
+                            uint64_t length,
+                            uint64_t search_start,
+                            uint64_t start_limit,
+                            uint64_t data_pos,
+                            bool last)> block_scanner;
+
+// Room needed in front of each block by scan_blocks()
+uint64_t
+block_headroom(uint64_t overlap, uint64_t side_bytes);
+
+// Pass the data of next_block to scan, block by block, until data_end has
+// been read. A match may start in the last overlap bytes of a block and end
+// in the next one, so those bytes are carried to the front of the next
+// block and searched with it. side_bytes more bytes are kept on both sides
+// of the part to search, for data that can not be read back to show the
+// bytes around a match. Returns the size of the data read.
+uint64_t
+scan_blocks(const block_source & next_block,
+            uint64_t overlap,
+            uint64_t side_bytes,
+            uint64_t data_end,
+            const block_scanner & scan);
+
+// Receives each match, with its position in the data, and the bytes it
+// covers, which are only valid during the call. Returning false stops the
+// scan.
+typedef std::function<bool (const match & found,
+                            const uint8_t * bytes,
+                            uint64_t length)> match_callback;
+
+// The outcome of a scan
+struct scan_result
+{
+    uint64_t matches = 0;           // Matches passed to the callback
+    uint64_t bytes = 0;             // Bytes of data, as far as it was read
+    bool stopped = false;           // The callback or max_count ended the scan
+    std::string error;              // Why the data could not be read, or empty
+};
+
+class searcher
+{
+    public:
+        // Compile the patterns. A searcher whose error() is not empty
+        // finds nothing.
+        searcher(const std::vector<pattern> & patterns,
+                 const search_options & options = search_options());
+
+        searcher(const searcher &) = delete;
+        searcher & operator=(const searcher &) = delete;
+
+        // Why the patterns could not be compiled, or empty
+        const std::string & error() const;
+
+        // Scan data[0, length), e.g. a buffer or a mapped file
+        scan_result scan(const uint8_t * data,
+                         uint64_t length,
+                         const match_callback & callback) const;
+
+        // Scan the data read from fd, from its current offset to its end.
+        // Positions count from where reading started. Compressed files are
+        // scanned decompressed unless the options say otherwise.
+        scan_result scan_fd(int fd, const match_callback & callback) const;
+
+        // Scan the file at path, memory mapped if it is a regular file that
+        // is not compressed, and read with scan_fd() otherwise
+        scan_result scan_file(const std::string & path,
+                              const match_callback & callback) const;
+
+        // The compiled patterns, or nullptr if they did not compile
+        const matcher * engine() const;
+
+    private:
+        // Pass the matches in buffer[0, length) that start in [search_start,
+        // start_limit) to callback, one search step at a time. data_pos is
+        // the offset of buffer[0]. Returns false once the scan should stop.
+        bool scan_block(const uint8_t * buffer,
+                        uint64_t length,
+                        uint64_t search_start,
+                        uint64_t start_limit,
+                        uint64_t data_pos,
+                        const match_callback & callback,
+                        scan_result & result) const;
+
+        // Scan the blocks of next_block, with their size in result.bytes
+        void scan_source(const block_source & next_block,
+                         const match_callback & callback,
+                         scan_result & result) const;
+
+        // Scan the data of fd as it is decompressed
+        void scan_compressed(int fd,
+                             compression kind,
+                             const match_callback & callback,
+                             scan_result & result) const;
+
+        search_options m_options;
+        std::unique_ptr<matcher> m_engine;
+        std::string m_error;
+};
+
+} // namespace bfind
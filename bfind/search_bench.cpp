@@ -0,0 +1,516 @@
+//
+// search_bench
+//
+// Throughput of the whole search engine, the matcher in matcher.h, on
+// generated corpora: random data, zeros, English-like text and random data
+// dense with matches. Each pattern length is searched for with every
+// algorithm that can search for it, case-insensitively, with several
+// patterns at once, and on several threads. Each run prints one tab
+// separated line, and --compare flags the runs that got slower than in the
+// report of another build. Run with make bench.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "matcher.h"
+
+using namespace bfind;
+
+enum corpus_kind
+{
+    k_corpus_random,    // Random bytes, the pattern planted 1000 times
+    k_corpus_zeros,     // Zeros, the pattern ends in 01 so nothing matches
+    k_corpus_text,      // Words and lines, the pattern is a piece of it
+    k_corpus_dense,     // Random bytes, the pattern planted every 64 bytes
+    k_corpus_count
+};
+
+static const char *
+corpus_name(corpus_kind kind)
+{
+    switch (kind)
+    {
+        case k_corpus_random: return "random";
+        case k_corpus_zeros:  return "zeros";
+        case k_corpus_text:   return "text";
+        case k_corpus_dense:  return "dense";
+        default:              return "unknown";
+    }
+}
+
+// Deterministic pseudo random numbers (xorshift64)
+static uint64_t
+next_random(uint64_t & state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static void
+fill_random(uint8_t * buffer, uint64_t length, uint64_t seed)
+{
+    for (uint64_t i = 0; i < length; i++)
+        buffer[i] = (uint8_t) next_random(seed);
+}
+
+// Words separated by spaces, with a capital letter now and then and a line
+// break every dozen words or so
+static void
+fill_text(uint8_t * buffer, uint64_t length, uint64_t seed)
+{
+    static const char * const k_words[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "with", "was", "on", "be", "by", "this", "from", "file", "data",
+        "search", "binary", "offset", "pattern", "buffer", "header",
+        "section", "library", "function", "return", "error", "value",
+        "string", "memory", "thread", "kernel", "process", "request",
+    };
+    const uint64_t word_count = sizeof(k_words) / sizeof(k_words[0]);
+
+    uint64_t i = 0;
+    while (i < length)
+    {
+        uint64_t random = next_random(seed);
+        const char * word = k_words[random % word_count];
+        for (uint64_t j = 0; word[j] && i < length; j++)
+        {
+            uint8_t c = word[j];
+            buffer[i++] = j == 0 && (random >> 8) % 16 == 0 ? toupper(c) : c;
+        }
+        if (i < length)
+            buffer[i++] = (random >> 16) % 12 == 0 ? '\n' : ' ';
+    }
+}
+
+// Fill corpus with the data of the given kind, and pattern with length bytes
+// to search for in it
+static void
+make_corpus(corpus_kind kind,
+            std::vector<uint8_t> & corpus,
+            uint64_t length,
+            std::vector<uint8_t> & pattern)
+{
+    uint64_t size = corpus.size();
+    pattern.resize(length);
+    fill_random(pattern.data(), length, 0x2545f4914f6cdd1dULL + length);
+
+    switch (kind)
+    {
+        case k_corpus_random:
+            fill_random(corpus.data(), size, 0x9e3779b97f4a7c15ULL);
+            for (uint64_t i = 0; i < 1000; i++)
+                memcpy(corpus.data() + size / 1000 * i, pattern.data(),
+                       length);
+            break;
+        case k_corpus_zeros:
+            memset(corpus.data(), 0, size);
+            memset(pattern.data(), 0, length);
+            pattern[length - 1] = 0x01;
+            break;
+        case k_corpus_text:
+            fill_text(corpus.data(), size, 0x9e3779b97f4a7c15ULL);
+            memcpy(pattern.data(), corpus.data() + size / 2, length);
+            break;
+        case k_corpus_dense:
+        {
+            fill_random(corpus.data(), size, 0x9e3779b97f4a7c15ULL);
+            uint64_t period = std::max(length, (uint64_t) 64);
+            for (uint64_t i = 0; i + length <= size; i += period)
+                memcpy(corpus.data() + i, pattern.data(), length);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Build the pattern the way bfind does for -i, or for -f regex
+static pattern
+make_pattern(const std::vector<uint8_t> & bytes, bool fold_case, bool regex)
+{
+    pattern p;
+    p.bytes = bytes;
+    if (fold_case)
+    {
+        p.mask.assign(bytes.size(), 0xff);
+        for (uint64_t i = 0; i < bytes.size(); i++)
+        {
+            if (isalpha(bytes[i]))
+            {
+                p.bytes[i] &= 0xdf;
+                p.mask[i] = 0xdf;
+            }
+        }
+    }
+    if (regex)
+    {
+        static const char k_digits[] = "0123456789abcdef";
+        for (uint8_t byte : bytes)
+        {
+            p.text += "\\x";
+            p.text += k_digits[byte >> 4];
+            p.text += k_digits[byte & 0xf];
+        }
+        p.bytes.clear();
+        p.regex = true;
+    }
+    return p;
+}
+
+// Search the corpus in 4 MiB chunks on the given number of threads, like
+// bfind -j does, and return the number of matches
+static uint64_t
+count_matches(const matcher & engine,
+              const std::vector<uint8_t> & corpus,
+              uint64_t threads)
+{
+    const uint64_t k_chunk_size = 4 << 20;
+    uint64_t size = corpus.size();
+    uint64_t overlap = engine.max_length() - 1;
+    std::atomic<uint64_t> next_chunk(0);
+    std::atomic<uint64_t> total(0);
+
+    auto worker = [&]()
+    {
+        std::vector<match> matches;
+        uint64_t count = 0;
+        uint64_t start = 0;
+        while ((start = k_chunk_size * next_chunk++) < size)
+        {
+            matches.clear();
+            uint64_t length = std::min(k_chunk_size + overlap, size - start);
+            engine.find_matches(corpus.data() + start, length,
+                                std::min(k_chunk_size, size - start),
+                                matches);
+            count += matches.size();
+        }
+        total += count;
+    };
+
+    std::vector<std::thread> workers;
+    for (uint64_t i = 1; i < threads; i++)
+        workers.push_back(std::thread(worker));
+    worker();
+    for (std::thread & thread : workers)
+        thread.join();
+    return total;
+}
+
+static double
+seconds_since(std::chrono::steady_clock::time_point start)
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now() - start).count();
+}
+
+// The throughput of the runs in an earlier report, by the columns that
+// identify a run
+static bool
+read_report(const char * path, std::map<std::string, double> & dst)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        // corpus, case, length, patterns, algorithm, threads, engine, GB/s
+        size_t end = 0;
+        for (int column = 0; column < 6 && end != std::string::npos;
+             column++)
+            end = line.find('\t', end + 1);
+        size_t rate = line.find('\t', end + 1);
+        if (end == std::string::npos || rate == std::string::npos)
+            continue;
+        dst[line.substr(0, end)] = atof(line.c_str() + rate + 1);
+    }
+    return true;
+}
+
+struct bench_options
+{
+    uint64_t size = 32 << 20;       // Corpus size
+    int repeat = 3;                 // Runs per configuration, the best counts
+    const char * compare = nullptr; // Report to compare with
+    double threshold = 10;          // Slowdown in percent that is reported
+    const char * corpus_dir = nullptr; // Write the corpora there and exit
+};
+
+// Runs the configurations and prints the report
+class bench
+{
+    public:
+        bench(const bench_options & options,
+              const std::map<std::string, double> & baseline) :
+            m_options(options),
+            m_baseline(baseline)
+        {
+        }
+
+        // Search for the patterns and print the report line. Returns the
+        // number of matches.
+        uint64_t run(corpus_kind kind,
+                     const std::vector<uint8_t> & corpus,
+                     const std::vector<pattern> & patterns,
+                     uint64_t length,
+                     bool fold_case,
+                     algorithm algo,
+                     uint64_t threads);
+
+        // Flag a run whose match count differs from the first run of the
+        // same search
+        void check(uint64_t matches, uint64_t expected);
+
+        // 0, or 1 if a run got slower or found the wrong matches
+        int status() const
+        {
+            return m_status;
+        }
+
+    private:
+        const bench_options & m_options;
+        const std::map<std::string, double> & m_baseline;
+        int m_status = 0;
+};
+
+uint64_t
+bench::run(corpus_kind kind,
+           const std::vector<uint8_t> & corpus,
+           const std::vector<pattern> & patterns,
+           uint64_t length,
+           bool fold_case,
+           algorithm algo,
+           uint64_t threads)
+{
+    matcher engine(patterns, algo);
+    double best = 0;
+    uint64_t matches = 0;
+    for (int i = 0; i < m_options.repeat; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        matches = count_matches(engine, corpus, threads);
+        double seconds = seconds_since(start);
+        if (i == 0 || seconds < best)
+            best = seconds;
+    }
+
+    char key[256];
+    snprintf(key, sizeof(key), "%s\t%s\t%lu\t%lu\t%s\t%lu",
+             corpus_name(kind), fold_case ? "nocase" : "exact", length,
+             patterns.size(), algorithm_name(algo), threads);
+    double rate = corpus.size() / best / 1e9;
+    printf("%s\t%s\t%.3f\t%.0f\t%lu", key,
+           algorithm_name(engine.get_algorithm()), rate, matches / best,
+           matches);
+
+    std::map<std::string, double>::const_iterator previous =
+        m_baseline.find(key);
+    if (previous != m_baseline.end() && previous->second > 0)
+    {
+        double change = (rate / previous->second - 1) * 100;
+        printf("\t%+.1f%%", change);
+        if (change < -m_options.threshold)
+        {
+            printf("  REGRESSION");
+            m_status = 1;
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+    return matches;
+}
+
+void
+bench::check(uint64_t matches, uint64_t expected)
+{
+    if (matches != expected)
+    {
+        printf("# MISMATCH: %lu matches, expected %lu\n", matches,
+               expected);
+        m_status = 1;
+    }
+}
+
+static void
+print_usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s [--size <MiB>] [--repeat <N>] [--compare <report>]\n"
+            "       [--threshold <percent>] [--corpus-dir <dir>]\n",
+            name);
+}
+
+// Write each corpus, with its 16 byte pattern in hexadecimal, e.g. to run
+// bfind itself on them
+static int
+write_corpora(const bench_options & options)
+{
+    std::vector<uint8_t> corpus(options.size);
+    std::vector<uint8_t> bytes;
+    for (int kind = 0; kind < k_corpus_count; kind++)
+    {
+        make_corpus((corpus_kind) kind, corpus, 16, bytes);
+        std::string path = std::string(options.corpus_dir) + "/" +
+                           corpus_name((corpus_kind) kind) + ".bin";
+        FILE * file = fopen(path.c_str(), "wb");
+        if (!file ||
+            fwrite(corpus.data(), 1, corpus.size(), file) != corpus.size())
+        {
+            fprintf(stderr, "error: Failed to write %s\n", path.c_str());
+            if (file)
+                fclose(file);
+            return 1;
+        }
+        fclose(file);
+
+        printf("%s\t", path.c_str());
+        for (uint8_t byte : bytes)
+            printf("%02x", byte);
+        printf("\n");
+    }
+    return 0;
+}
+
+int
+main(int argc, char * argv [])
+{
+    const uint64_t k_pattern_lengths[] = { 1, 2, 3, 4, 8, 16, 32, 64, 128,
+                                           256 };
+    const algorithm k_single_algorithms[] = {
+        k_algo_auto, k_algo_simd, k_algo_horspool, k_algo_two_way,
+        k_algo_rare, k_algo_aho_corasick, k_algo_regex };
+    const uint64_t k_regex_length = 64;
+    const uint64_t k_pattern_counts[] = { 8, 64 };
+    const uint64_t k_multi_length = 8;
+    const uint64_t k_thread_length = 16;
+
+    bench_options options;
+    for (int i = 1; i < argc; i++)
+    {
+        const char * option = argv[i];
+        const char * value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!value)
+        {
+            print_usage(argv[0]);
+            return 2;
+        }
+        if (0 == strcmp(option, "--size"))
+            options.size = strtoull(value, nullptr, 10) << 20;
+        else if (0 == strcmp(option, "--repeat"))
+            options.repeat = atoi(value);
+        else if (0 == strcmp(option, "--compare"))
+            options.compare = value;
+        else if (0 == strcmp(option, "--threshold"))
+            options.threshold = atof(value);
+        else if (0 == strcmp(option, "--corpus-dir"))
+            options.corpus_dir = value;
+        else
+        {
+            print_usage(argv[0]);
+            return 2;
+        }
+        i++;
+    }
+    if (options.size < (1 << 20) || options.repeat < 1)
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+    if (options.corpus_dir)
+        return write_corpora(options);
+
+    std::map<std::string, double> baseline;
+    if (options.compare && !read_report(options.compare, baseline))
+    {
+        fprintf(stderr, "error: Failed to read %s\n", options.compare);
+        return 2;
+    }
+    bench b(options, baseline);
+
+    uint64_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint8_t> corpus(options.size);
+    std::vector<uint8_t> bytes;
+
+    printf("# corpus size %lu MiB, best of %d runs\n", options.size >> 20,
+           options.repeat);
+    printf("# corpus\tcase\tlength\tpatterns\talgorithm\tthreads\tengine\t"
+           "GB/s\tmatches/s\tmatches\n");
+
+    for (int index = 0; index < k_corpus_count; index++)
+    {
+        corpus_kind kind = (corpus_kind) index;
+
+        // one pattern, with each algorithm and case mode
+        for (uint64_t length : k_pattern_lengths)
+        {
+            make_corpus(kind, corpus, length, bytes);
+            std::vector<pattern> exact(1, make_pattern(bytes, false, false));
+            uint64_t expected = 0;
+            for (algorithm algo : k_single_algorithms)
+            {
+                // expressions are scanned for by their first 64 bytes,
+                // so longer ones are slow on zeros, like no other search
+                std::vector<pattern> patterns = exact;
+                if (algo == k_algo_regex && length > k_regex_length)
+                    continue;
+                if (algo == k_algo_regex)
+                    patterns[0] = make_pattern(bytes, false, true);
+                uint64_t matches = b.run(kind, corpus, patterns, length,
+                                         false, algo, 1);
+                if (algo == k_algo_auto)
+                    expected = matches;
+                b.check(matches, expected);
+            }
+
+            std::vector<pattern> folded(1, make_pattern(bytes, true, false));
+            b.run(kind, corpus, folded, length, true, k_algo_auto, 1);
+        }
+
+        // several patterns of the same length, the first one planted
+        for (uint64_t count : k_pattern_counts)
+        {
+            make_corpus(kind, corpus, k_multi_length, bytes);
+            std::vector<pattern> patterns;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                patterns.push_back(make_pattern(bytes, false, false));
+                patterns.back().bytes[0] += i;
+            }
+            b.run(kind, corpus, patterns, k_multi_length, false,
+                  k_algo_auto, 1);
+        }
+
+        // scaling with the number of threads
+        make_corpus(kind, corpus, k_thread_length, bytes);
+        std::vector<pattern> patterns(1, make_pattern(bytes, false, false));
+        uint64_t expected = 0;
+        for (uint64_t threads = 1; threads <= max_threads; threads *= 2)
+        {
+            uint64_t matches = b.run(kind, corpus, patterns, k_thread_length,
+                                     false, k_algo_auto, threads);
+            if (threads == 1)
+                expected = matches;
+            b.check(matches, expected);
+        }
+    }
+
+    return b.status();
+}
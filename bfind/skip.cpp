@@ -0,0 +1,237 @@
+// bfind - sublinear single pattern search
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "skip.h"
+
+namespace bfind
+{
+
+horspool_searcher::horspool_searcher(const uint8_t * pattern,
+                                     uint64_t pattern_length) :
+    m_pattern(pattern),
+    m_length(pattern_length)
+{
+    for (int byte = 0; byte < 256; byte++)
+        m_shift[byte] = m_length;
+    for (uint64_t i = 0; i + 1 < m_length; i++)
+        m_shift[m_pattern[i]] = m_length - 1 - i;
+}
+
+const uint8_t *
+horspool_searcher::find(const uint8_t * haystack, uint64_t length) const
+{
+    const uint8_t last = m_pattern[m_length - 1];
+    uint64_t position = 0;
+
+    while (position + m_length <= length)
+    {
+        uint8_t byte = haystack[position + m_length - 1];
+        if (byte == last &&
+            0 == memcmp(haystack + position, m_pattern, m_length - 1))
+            return haystack + position;
+        position += m_shift[byte];
+    }
+    return nullptr;
+}
+
+double
+horspool_searcher::expected_shift() const
+{
+    double sum = 0;
+    for (int byte = 0; byte < 256; byte++)
+        sum += m_shift[byte];
+    return sum / 256;
+}
+
+two_way_searcher::two_way_searcher(const uint8_t * pattern,
+                                   uint64_t pattern_length) :
+    m_pattern(pattern),
+    m_length(pattern_length)
+{
+    const uint8_t * n = m_pattern;
+    const uint64_t l = m_length;
+
+    memset(m_last, 0, sizeof(m_last));
+    for (uint64_t i = 0; i < l; i++)
+        m_last[n[i]] = i + 1;
+
+    // Maximal suffix for each of the two byte orderings. The critical
+    // position is the start of the longer of them. Index arithmetic is
+    // unsigned and starts at -1, like in the original description.
+    uint64_t split[2];
+    uint64_t period[2];
+    for (int order = 0; order < 2; order++)
+    {
+        uint64_t i = -1;
+        uint64_t j = 0;
+        uint64_t k = 1;
+        uint64_t p = 1;
+        while (j + k < l)
+        {
+            uint8_t a = n[i + k];
+            uint8_t b = n[j + k];
+            if (a == b)
+            {
+                if (k == p)
+                {
+                    j += p;
+                    k = 1;
+                }
+                else
+                {
+                    k++;
+                }
+            }
+            else if (order == 0 ? a > b : a < b)
+            {
+                j += k;
+                k = 1;
+                p = j - i;
+            }
+            else
+            {
+                i = j++;
+                k = p = 1;
+            }
+        }
+        split[order] = i;
+        period[order] = p;
+    }
+
+    int longer = split[1] + 1 > split[0] + 1 ? 1 : 0;
+    m_split = split[longer];
+    m_period = period[longer];
+
+    if (0 == memcmp(n, n + m_period, m_split + 1))
+    {
+        // periodic, remember the bytes known to match after a shift
+        m_memory = l - m_period;
+    }
+    else
+    {
+        m_memory = 0;
+        m_period = std::max(m_split, l - m_split - 1) + 1;
+    }
+}
+
+const uint8_t *
+two_way_searcher::find(const uint8_t * haystack, uint64_t length) const
+{
+    const uint8_t * n = m_pattern;
+    const uint64_t l = m_length;
+    const uint8_t * h = haystack;
+    const uint8_t * end = haystack + length;
+    uint64_t memory = 0;
+    uint64_t k = 0;
+
+    while ((uint64_t) (end - h) >= l)
+    {
+        // shift on the last byte first
+        uint64_t last = m_last[h[l - 1]];
+        if (last == 0)
+        {
+            h += l;
+            memory = 0;
+            continue;
+        }
+        k = l - last;
+        if (k)
+        {
+            h += std::max(k, memory);
+            memory = 0;
+            continue;
+        }
+
+        // right part
+        for (k = std::max(m_split + 1, memory); k < l && n[k] == h[k]; k++)
+            ;
+        if (k < l)
+        {
+            h += k - m_split;
+            memory = 0;
+            continue;
+        }
+
+        // left part
+        for (k = m_split + 1; k > memory && n[k - 1] == h[k - 1]; k--)
+            ;
+        if (k <= memory)
+            return h;
+        h += m_period;
+        memory = m_memory;
+    }
+    return nullptr;
+}
+
+rare_byte_searcher::rare_byte_searcher(const uint8_t * pattern,
+                                       uint64_t pattern_length) :
+    m_pattern(pattern),
+    m_length(pattern_length),
+    m_anchor(0)
+{
+    for (uint64_t i = 1; i < m_length; i++)
+    {
+        if (byte_rank(m_pattern[i]) < byte_rank(m_pattern[m_anchor]))
+            m_anchor = i;
+    }
+}
+
+const uint8_t *
+rare_byte_searcher::find(const uint8_t * haystack, uint64_t length) const
+{
+    if (length < m_length)
+        return nullptr;
+
+    const uint8_t anchor_byte = m_pattern[m_anchor];
+    const uint8_t * position = haystack + m_anchor;
+    const uint8_t * end = haystack + length - m_length + m_anchor + 1;
+
+    while (position < end)
+    {
+        const uint8_t * hit =
+            (const uint8_t *) memchr(position, anchor_byte, end - position);
+        if (!hit)
+            break;
+
+        const uint8_t * start = hit - m_anchor;
+        if (0 == memcmp(start, m_pattern, m_length))
+            return start;
+        position = hit + 1;
+    }
+    return nullptr;
+}
+
+uint64_t
+rare_byte_searcher::anchor() const
+{
+    return m_anchor;
+}
+
+int
+byte_rank(uint8_t byte)
+{
+    // padding, fill and sign extension
+    if (byte == 0x00)
+        return 255;
+    if (byte == 0xff)
+        return 230;
+    // text and small integers
+    if (byte == ' ' || byte == '\n')
+        return 200;
+    if (byte == 0x01)
+        return 180;
+    if (byte >= 'a' && byte <= 'z')
+        return 160;
+    if ((byte >= 'A' && byte <= 'Z') || (byte >= '0' && byte <= '9'))
+        return 140;
+    if (byte < 0x10 || byte == 0x80 || byte == 0xfe)
+        return 120;
+    if (byte >= 0x20 && byte < 0x7f)
+        return 100;
+    return 50;
+}
+
+} // namespace bfind
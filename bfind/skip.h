@@ -0,0 +1,82 @@
+#pragma once
+
+// bfind - sublinear single pattern search
+//
+// Searchers that skip over data that cannot contain a match, instead of
+// looking at every byte. Each searcher is compiled for one pattern, which
+// must outlive it.
+
+#include <stdint.h>
+
+namespace bfind
+{
+
+// Boyer-Moore-Horspool. Shifts by the distance from the last occurrence of
+// the byte under the pattern's last position, up to the pattern length.
+// Fast for long patterns with many distinct bytes.
+class horspool_searcher
+{
+    public:
+        horspool_searcher(const uint8_t * pattern, uint64_t pattern_length);
+
+        // Return the first occurrence of the pattern, or nullptr
+        const uint8_t * find(const uint8_t * haystack, uint64_t length) const;
+
+        // Average shift over all byte values, a measure of how well the
+        // pattern skips on random data
+        double expected_shift() const;
+
+    private:
+        const uint8_t * m_pattern;
+        uint64_t m_length;
+        uint64_t m_shift[256];
+};
+
+// Crochemore-Perrin Two-Way. The pattern is split at a critical position;
+// the right part is matched first and the left part after it. Linear in the
+// worst case, also for periodic patterns like 000...001 that make the
+// other searchers compare the same bytes over and over. A Horspool shift on
+// the last byte is added for the common case.
+class two_way_searcher
+{
+    public:
+        two_way_searcher(const uint8_t * pattern, uint64_t pattern_length);
+
+        // Return the first occurrence of the pattern, or nullptr
+        const uint8_t * find(const uint8_t * haystack, uint64_t length) const;
+
+    private:
+        const uint8_t * m_pattern;
+        uint64_t m_length;
+        uint64_t m_split;      // Last index of the left part
+        uint64_t m_period;     // Shift after a complete right part match
+        uint64_t m_memory;     // Bytes known to match after such a shift
+        uint64_t m_last[256];  // Last index + 1 of each byte, 0 if absent
+};
+
+// Rarest byte anchor. The pattern byte least likely to occur in binary
+// files is located with memchr and the rest of the pattern is compared at
+// each hit. Fast when the first and last bytes are common, e.g. 0x00.
+class rare_byte_searcher
+{
+    public:
+        rare_byte_searcher(const uint8_t * pattern, uint64_t pattern_length);
+
+        // Return the first occurrence of the pattern, or nullptr
+        const uint8_t * find(const uint8_t * haystack, uint64_t length) const;
+
+        // Index of the anchor byte in the pattern
+        uint64_t anchor() const;
+
+    private:
+        const uint8_t * m_pattern;
+        uint64_t m_length;
+        uint64_t m_anchor;
+};
+
+// Rough rank of how common a byte value is in binary files, from 0 (rare)
+// to 255 (very common)
+int
+byte_rank(uint8_t byte);
+
+} // namespace bfind
@@ -0,0 +1,256 @@
+// bfind - asynchronous file reads with io_uring
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "uring.h"
+
+// O_DIRECT needs buffers, offsets and lengths aligned to the device blocks
+static const uint64_t k_alignment = 4096;
+
+static uint64_t
+align_up(uint64_t value)
+{
+    return (value + k_alignment - 1) / k_alignment * k_alignment;
+}
+
+async_reader::async_reader(int fd,
+                           uint64_t file_size,
+                           uint64_t block_size,
+                           unsigned queue_depth,
+                           uint64_t headroom,
+                           int buffered_fd) :
+    m_fd(fd),
+    m_buffered_fd(buffered_fd >= 0 ? buffered_fd : fd),
+    m_file_size(file_size),
+    m_block_size(align_up(block_size)),
+    m_headroom(align_up(headroom)),
+    m_depth(queue_depth)
+{
+}
+
+async_reader::~async_reader()
+{
+    // the kernel may still write to m_memory, also after the ring is closed
+    while (m_in_flight > 0 && reap(true))
+    {
+    }
+
+    if (m_sqes)
+        munmap(m_sqes, m_sqes_size);
+    if (m_cq_ring && m_cq_ring != m_sq_ring)
+        munmap(m_cq_ring, m_cq_ring_size);
+    if (m_sq_ring)
+        munmap(m_sq_ring, m_sq_ring_size);
+    if (m_ring_fd >= 0)
+        close(m_ring_fd);
+    free(m_memory);
+}
+
+bool
+async_reader::start()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_ring_fd = syscall(__NR_io_uring_setup, m_depth, &params);
+    if (m_ring_fd < 0)
+        return false;
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        m_sq_ring_size = m_cq_ring_size =
+            m_sq_ring_size > m_cq_ring_size ? m_sq_ring_size : m_cq_ring_size;
+
+    m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED)
+    {
+        m_sq_ring = nullptr;
+        return false;
+    }
+
+    if (single_mmap)
+    {
+        m_cq_ring = m_sq_ring;
+    }
+    else
+    {
+        m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, m_ring_fd,
+                         IORING_OFF_CQ_RING);
+        if (m_cq_ring == MAP_FAILED)
+        {
+            m_cq_ring = nullptr;
+            return false;
+        }
+    }
+
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED)
+    {
+        m_sqes = nullptr;
+        return false;
+    }
+
+    uint8_t * sq = (uint8_t *) m_sq_ring;
+    uint8_t * cq = (uint8_t *) m_cq_ring;
+    m_sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    m_sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    m_sq_array = (unsigned *) (sq + params.sq_off.array);
+    m_cq_head = (unsigned *) (cq + params.cq_off.head);
+    m_cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    m_cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    m_cqes = cq + params.cq_off.cqes;
+
+    uint64_t slot_size = m_headroom + m_block_size;
+    if (0 != posix_memalign((void **) &m_memory, k_alignment,
+                            slot_size * m_depth))
+    {
+        m_memory = nullptr;
+        return false;
+    }
+
+    m_slots.resize(m_depth);
+    for (unsigned i = 0; i < m_depth; i++)
+    {
+        m_slots[i].buffer = m_memory + i * slot_size + m_headroom;
+        submit(i, m_next_offset);
+    }
+    return true;
+}
+
+void
+async_reader::submit(unsigned index, uint64_t offset)
+{
+    slot & s = m_slots[index];
+    s.offset = offset;
+    s.result = 0;
+    s.done = offset >= m_file_size;  // nothing to read past the end
+    if (s.done)
+        return;
+    m_next_offset = offset + m_block_size;
+
+    unsigned tail = *m_sq_tail;
+    unsigned position = tail & *m_sq_mask;
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) m_sqes + position;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_fd;
+    sqe->addr = (uint64_t) s.buffer;
+    sqe->len = m_block_size;
+    sqe->off = offset;
+    sqe->user_data = index;
+    m_sq_array[position] = position;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, m_ring_fd, 1, 0, 0, nullptr, 0) < 0)
+    {
+        // the entry stays in the ring, take it back
+        __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+        s.result = -errno;
+        s.done = true;
+        return;
+    }
+    m_in_flight++;
+}
+
+bool
+async_reader::reap(bool wait)
+{
+    unsigned head = *m_cq_head;
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail && wait)
+    {
+        if (syscall(__NR_io_uring_enter, m_ring_fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+            errno != EINTR)
+        {
+            std::cerr << "error: io_uring wait failed: "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+        tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe * cqe =
+            (struct io_uring_cqe *) m_cqes + (head & *m_cq_mask);
+        slot & s = m_slots[cqe->user_data];
+        s.result = cqe->res;
+        s.done = true;
+        m_in_flight--;
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool
+async_reader::wait(unsigned index)
+{
+    while (!m_slots[index].done)
+    {
+        if (!reap(true))
+            return false;
+    }
+    return true;
+}
+
+bool
+async_reader::next(uint8_t * & data, uint64_t & length)
+{
+    // the caller is done with the previous block, reuse its buffer
+    if (m_returned)
+    {
+        unsigned previous = (m_next_slot + m_depth - 1) % m_depth;
+        submit(previous, m_next_offset);
+        m_returned = false;
+    }
+
+    slot & s = m_slots[m_next_slot];
+    if (s.offset >= m_file_size || !wait(m_next_slot))
+        return false;
+
+    if (s.result < 0)
+    {
+        std::cerr << "error: read failed @ " << s.offset << ": "
+                  << strerror(-s.result) << std::endl;
+        return false;
+    }
+
+    // finish a short read synchronously, the kernel rarely returns one.
+    // The rest is not aligned, so O_DIRECT would refuse it.
+    uint64_t expected = m_file_size - s.offset;
+    if (expected > m_block_size)
+        expected = m_block_size;
+    while ((uint64_t) s.result < expected)
+    {
+        ssize_t bytes_read = pread(m_buffered_fd, s.buffer + s.result,
+                                   expected - s.result, s.offset + s.result);
+        if (bytes_read <= 0)
+        {
+            std::cerr << "error: read failed @ " << s.offset + s.result
+                      << std::endl;
+            return false;
+        }
+        s.result += bytes_read;
+    }
+
+    data = s.buffer;
+    length = expected;
+    m_next_slot = (m_next_slot + 1) % m_depth;
+    m_returned = true;
+    return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+// bfind - asynchronous file reads with io_uring
+//
+// An async_reader keeps several block reads of a file in flight while the
+// caller scans the blocks that have already been read. It talks to the kernel
+// through the io_uring system calls directly, so no library is needed.
+
+#include <stdint.h>
+
+#include <vector>
+
+class async_reader
+{
+    public:
+        // Read the file fd, which is file_size bytes long, in blocks of
+        // block_size bytes with up to queue_depth reads in flight. At least
+        // headroom bytes in front of each block are free for the caller.
+        // Buffers and block sizes are aligned for O_DIRECT. The rare short
+        // read is finished with pread on buffered_fd, which may be an fd of
+        // the same file opened without O_DIRECT, or -1 to use fd.
+        async_reader(int fd,
+                     uint64_t file_size,
+                     uint64_t block_size,
+                     unsigned queue_depth,
+                     uint64_t headroom,
+                     int buffered_fd = -1);
+
+        // Waits for the reads still in flight, which write to the buffers
+        ~async_reader();
+
+        async_reader(const async_reader &) = delete;
+        async_reader & operator=(const async_reader &) = delete;
+
+        // Set up the ring and queue the first reads. Returns false if
+        // io_uring is not available.
+        bool start();
+
+        // Wait for the next block in file order. The block stays valid until
+        // the next call. Returns false at the end of the file, or after
+        // printing an error if a read failed.
+        bool next(uint8_t * & data, uint64_t & length);
+
+    private:
+        struct slot
+        {
+            uint8_t * buffer;    // Block data, after the headroom
+            uint64_t offset;     // File offset of the block
+            int64_t result;      // Bytes read or -errno, once done
+            bool done;
+        };
+
+        // Queue a read of the block at offset into slot number index
+        void submit(unsigned index, uint64_t offset);
+
+        // Wait for completions until the slot number index is done
+        bool wait(unsigned index);
+
+        // Mark the slots of the completions in the ring as done. Waits for
+        // at least one if wait is set and none are there yet.
+        bool reap(bool wait);
+
+        int m_fd;
+        int m_buffered_fd;
+        uint64_t m_file_size;
+        uint64_t m_block_size;
+        uint64_t m_headroom;
+        unsigned m_depth;
+        std::vector<slot> m_slots;
+        uint8_t * m_memory = nullptr;
+
+        uint64_t m_next_offset = 0;     // Next block to queue
+        unsigned m_next_slot = 0;       // Slot of the next block to return
+        bool m_returned = false;        // A block is held by the caller
+        unsigned m_in_flight = 0;       // Reads submitted and not completed
+
+        // The ring, shared with the kernel
+        int m_ring_fd = -1;
+        void * m_sq_ring = nullptr;
+        void * m_cq_ring = nullptr;
+        size_t m_sq_ring_size = 0;
+        size_t m_cq_ring_size = 0;
+        void * m_sqes = nullptr;
+        size_t m_sqes_size = 0;
+        unsigned * m_sq_tail = nullptr;
+        unsigned * m_sq_mask = nullptr;
+        unsigned * m_sq_array = nullptr;
+        unsigned * m_cq_head = nullptr;
+        unsigned * m_cq_tail = nullptr;
+        unsigned * m_cq_mask = nullptr;
+        void * m_cqes = nullptr;
+};
@@ -0,0 +1,126 @@
+// bfind - input file discovery
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "walk.h"
+
+// Return true if name matches any of the globs
+static bool
+matches_any(const std::vector<std::string> & globs, const char * name)
+{
+    for (const std::string & glob : globs)
+    {
+        if (0 == fnmatch(glob.c_str(), name, 0))
+            return true;
+    }
+    return false;
+}
+
+static bool
+walk_directory(const std::string & path,
+               const walk_options & options,
+               const file_callback & on_file,
+               bool & stopped)
+{
+    DIR * directory = opendir(path.c_str());
+    if (directory == NULL)
+    {
+        std::cerr << "error: Failed to open " << path << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names;
+    while (struct dirent * entry = readdir(directory))
+    {
+        if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+            continue;
+        names.push_back(entry->d_name);
+    }
+    closedir(directory);
+    std::sort(names.begin(), names.end());
+
+    bool ok = true;
+    std::string separator = path[path.size() - 1] == '/' ? "" : "/";
+    for (const std::string & name : names)
+    {
+        if (stopped)
+            break;
+        if (matches_any(options.exclude, name.c_str()))
+            continue;
+
+        std::string entry_path = path + separator + name;
+        struct stat entry_stat;
+        if (0 != lstat(entry_path.c_str(), &entry_stat))
+        {
+            std::cerr << "error: Failed to stat " << entry_path << std::endl;
+            ok = false;
+        }
+        else if (S_ISDIR(entry_stat.st_mode))
+        {
+            ok = walk_directory(entry_path, options, on_file, stopped) && ok;
+        }
+        else if (S_ISREG(entry_stat.st_mode))
+        {
+            if (options.include.empty() ||
+                matches_any(options.include, name.c_str()))
+                stopped = !on_file(entry_path, entry_stat);
+        }
+    }
+    return ok;
+}
+
+int
+open_input(const std::string & path)
+{
+    if (path == "-")
+        return dup(STDIN_FILENO);
+    return open(path.c_str(), O_RDONLY);
+}
+
+bool
+walk_paths(const std::vector<std::string> & paths,
+           const walk_options & options,
+           const file_callback & on_file)
+{
+    bool ok = true;
+    bool stopped = false;
+    for (const std::string & path : paths)
+    {
+        if (stopped)
+            break;
+
+        struct stat path_stat;
+        int result = path == "-" ? fstat(STDIN_FILENO, &path_stat)
+                                 : stat(path.c_str(), &path_stat);
+        if (0 != result)
+        {
+            std::cerr << "error: Failed to open " << path << std::endl;
+            ok = false;
+        }
+        else if (S_ISDIR(path_stat.st_mode))
+        {
+            if (options.recursive)
+            {
+                ok = walk_directory(path, options, on_file, stopped) && ok;
+            }
+            else
+            {
+                std::cerr << "error: " << path << " is a directory, "
+                          << "use -r to search it" << std::endl;
+                ok = false;
+            }
+        }
+        else
+        {
+            stopped = !on_file(path, path_stat);
+        }
+    }
+    return ok;
+}
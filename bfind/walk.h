@@ -0,0 +1,39 @@
+#pragma once
+
+// bfind - input file discovery
+
+#include <sys/stat.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+struct walk_options
+{
+    bool recursive = false;            // Descend into directories
+    std::vector<std::string> include;  // File name globs, empty for all
+    std::vector<std::string> exclude;  // File and directory name globs
+};
+
+// Returns false to stop the walk
+typedef std::function<bool(const std::string & path,
+                           const struct stat & file_stat)> file_callback;
+
+// Open path for reading. The path - stands for standard input, which is
+// duplicated so that the descriptor can be closed like any other. Returns
+// -1 if the file could not be opened.
+int
+open_input(const std::string & path);
+
+// Call on_file for each file to search, in command line order. Directories
+// are only searched with options.recursive, and their entries are visited in
+// name order. Symbolic links inside directories are not followed and only
+// regular files are searched there. The include and exclude globs apply to
+// the names of files and directories found inside directories; paths given
+// on the command line are always searched, and - is standard input. Returns
+// false if any path could not be read. The walk stops early, without an
+// error, once on_file returns false.
+bool
+walk_paths(const std::vector<std::string> & paths,
+           const walk_options & options,
+           const file_callback & on_file);
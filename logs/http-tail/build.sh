@@ -1,2 +1,2 @@
 #!/bin/sh
-g++ -pedantic -g -O2 -o http-tail http-tail.cpp
+g++ -pedantic -g -O2 -pthread -o http-tail http-tail.cpp
@@ -5,19 +5,33 @@
 #include <cmath>
 #include <ctime>
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-/* Log line format (field 0..n) */
-#define DATE_INDEX 3
-#define STATUS_INDEX 8
-#define BYTES_INDEX 9
+/* Highest field number of a positional log format */
+#define MAX_FIELDS 64
+
+/* Request durations are counted in microseconds in an HDR histogram. Values
+   below 256 have a bucket each and larger ones 128 buckets per power of two,
+   so a percentile is within 1% of the exact one at any scale. */
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_MAX_BITS 40  /* About 12 days, longer durations are clamped */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
 
 /* Supported date formats */
-const char* DATE_FORMATS[3] =
+const char* DATE_FORMATS[5] =
 {
     "[%d/%b/%Y:%T",  /* E.g. [06/May/2022:14:12:03 */
     "[%Y-%m-%dT%T",  /* E.g. [2021-09-17T10:01:01 */
+    "%d/%b/%Y:%T",   /* E.g. 06/May/2022:14:12:03, in JSON logs */
+    "%Y-%m-%dT%T",   /* E.g. 2021-09-17T10:01:01, in JSON logs */
     NULL
 };
 
@@ -34,6 +48,47 @@ enum mode
     scan
 };
 
+/* A field of a log line. It points into the line and is not NUL terminated. */
+struct field
+{
+    const char* data;
+    size_t length;
+};
+
+/* The fields of a log line that are read */
+enum field_id
+{
+    date_field,
+    status_field,
+    bytes_field,
+    duration_field,  /* Optional, only read if the format gives it */
+    num_field_ids
+};
+
+const char* FIELD_NAMES[num_field_ids] = {"date", "status", "bytes", "duration"};
+
+/* Where the fields are in a line, compiled from the --format spec */
+struct log_format
+{
+    bool json;
+    size_t num_ids;                  /* Fields read, duration_field + 1 if given */
+    size_t indexes[num_field_ids];   /* Positional field numbers, from 0 */
+    size_t num_fields;               /* Fields to split, the rest is skipped */
+    std::string keys[num_field_ids]; /* Keys of the fields in JSON lines */
+    double duration_scale;           /* Microseconds per unit of duration */
+};
+
+/* The start of the last hour read from the log. While lines stay within the
+   same hour, only their minutes and seconds need to be parsed. */
+struct date_cache
+{
+    const char* format;
+    size_t prefix_length;  /* Bytes of a date up to the hour, 0 if unknown */
+    char prefix[32];       /* The date up to the hour, e.g. [06/May/2022:14 */
+    double hour_start;
+    bool valid;
+};
+
 struct counters
 {
     uint64_t codes[6];  /* 0xx, 1xx, 2xx, ... status codes */
@@ -43,19 +98,102 @@ struct counters
     double end_time;
 };
 
+/* Fixed size, so one interval costs the same however many requests it has.
+   Histograms merge by adding their counts. */
+struct histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+};
+
+/* The lines of a scanned log with the same date in a row. The first line may
+   end an interval and the rest then start the next one, so they are counted
+   apart. Logs with few lines per second have a run per line, so a run only
+   holds what the replay adds up; the rest of the lines, durations and
+   warnings are kept by the chunk. */
+struct date_run
+{
+    double time;
+    const char* line;       /* The first line, to check its date if it starts an interval */
+    counters first;
+    bool has_rest;          /* The next entry of the chunk's rests is this run's */
+    uint32_t first_buckets; /* Entries of the chunk's durations for the first line */
+    uint32_t rest_buckets;  /* And for the rest */
+};
+
+/* Requests of a run that took the same time, as a histogram bucket */
+struct bucket_count
+{
+    uint16_t bucket;
+    uint32_t count;
+};
+
+/* Warnings of a run's first line, or of its rest */
+struct run_warnings
+{
+    size_t run;
+    bool rest;
+    std::string text;
+};
+
+/* A part of a log scanned by one thread, from the start of a line to the
+   start of another. A line that stops the scan ends the chunk early. */
+struct log_chunk
+{
+    const char* begin;
+    const char* end;
+    const log_format* format;
+    const char* date_format;  /* Of the first line of the log */
+    std::vector<date_run> runs;
+    std::vector<counters> rests;          /* Of the runs that have a rest */
+    std::vector<bucket_count> durations;  /* Of the runs, in order */
+    std::vector<run_warnings> warnings;   /* Only of the runs that have any */
+    std::string error;  /* Why the scan stops after the runs, or empty */
+    bool done;          /* Set by the thread that scanned it */
+};
+
 void reset_counters(counters* stats);
-void print_counters(counters* stats, bool header);
+void add_run_counters(counters* stats, const counters* run);
+void print_counters(counters* stats, histogram* durations, bool header);
+
+void reset_histogram(histogram* durations);
+void add_duration(histogram* durations, uint16_t bucket, uint32_t count);
+uint16_t histogram_bucket(uint64_t micros);
+uint64_t histogram_value(size_t bucket);
+void histogram_percentiles(histogram* durations, const double* quantiles,
+                           size_t num_quantiles, uint64_t* values);
+void duration_print(uint64_t micros, char* dst);
 
 double current_time();
 const char* determine_date_format(const char* date_string);
 double parse_date(const char* date_string, const char* format);
-double get_time(mode mode, const char* date_string, const char* format);
+double get_time(mode mode, const char* date_string, date_cache* cache);
+void init_date_cache(date_cache* cache, const char* format);
+double parse_date_cached(const char* date_string, date_cache* cache);
 void list_date_formats();
 void human_print(uint64_t number, char* dst);
 
-status process_input(FILE* input, mode mode, double interval);
-size_t split_line(char** fields, size_t num_fields, char* line);
-status add_counters(char** fields, size_t num_fields, counters* stats);
+status parse_format(const char* spec, log_format* format);
+std::string date_format_error(const log_format* format, const field& date);
+
+status process_input(FILE* input, mode mode, double interval, const log_format* format);
+status scan_input(FILE* input, double interval, const log_format* format);
+const char* line_start(const char* data, size_t size, size_t offset);
+void scan_chunk(log_chunk* chunk);
+status replay_chunk(log_chunk* chunk, double interval, counters* stats,
+                    histogram* durations, uint64_t* output_count);
+std::string interval_date_error(const log_chunk* chunk, const char* line);
+void flush_durations(log_chunk* chunk, histogram* durations, std::vector<uint16_t>* used);
+size_t split_line(field* fields, size_t num_fields, const char* line, size_t length);
+const char* skip_json_string(const char* pos, const char* end);
+const char* skip_json_value(const char* pos, const char* end);
+bool split_json(const log_format* format, const char* line, size_t length, field* fields);
+void warn(std::string* warnings, const char* message);
+status extract_fields(const log_format* format, const char* line, size_t length,
+                      field* fields, std::string* warnings);
+bool parse_duration(const field& text, double scale, uint64_t* micros);
+bool add_counters(const log_format* format, field* fields, counters* stats,
+                  uint16_t* bucket, std::string* warnings);
 
 
 void print_usage(char* arg0)
@@ -80,14 +218,28 @@ void print_usage(char* arg0)
     fprintf(stderr, "\n");
     fprintf(stderr, "    -s <logfile>\n");
     fprintf(stderr, "        Scan mode\n");
-    fprintf(stderr, "          Read dates from log. Process as fast as possible.\n");
+    fprintf(stderr, "          Read dates from log. Process as fast as possible, on all cores.\n");
     fprintf(stderr, "          %s -s access.log\n", basename(arg0));
     fprintf(stderr, "\n");
-    fprintf(stderr, "Log line format (defined in %s):\n", __FILE__);
-    fprintf(stderr, "    Date.........: field %d\n", DATE_INDEX + 1);
-    fprintf(stderr, "    Status.......: field %d\n", STATUS_INDEX + 1);
-    fprintf(stderr, "    Byte count...: field %d\n", BYTES_INDEX + 1);
-    fprintf(stderr, "    Date formats.: ");
+    fprintf(stderr, "    --format <spec>\n");
+    fprintf(stderr, "        Log line format, given before the mode\n");
+    fprintf(stderr, "          combined (default)\n");
+    fprintf(stderr, "            nginx or Apache combined or common log format. The date,\n");
+    fprintf(stderr, "            status and byte count are space separated fields 4, 9 and 10.\n");
+    fprintf(stderr, "          fields:date=<n>,status=<n>,bytes=<n>,duration=<n>\n");
+    fprintf(stderr, "            Space separated fields at other positions, from 1 to %d.\n", MAX_FIELDS);
+    fprintf(stderr, "            Fields that are not given keep their combined positions.\n");
+    fprintf(stderr, "          json[:date=<key>,status=<key>,bytes=<key>,duration=<key>]\n");
+    fprintf(stderr, "            One JSON object per line. The keys default to time, status\n");
+    fprintf(stderr, "            and bytes.\n");
+    fprintf(stderr, "          <spec>,duration_unit=s|ms|us\n");
+    fprintf(stderr, "            Unit of the duration in fields and json specs, seconds by\n");
+    fprintf(stderr, "            default like nginx $request_time. Use us for Apache %%D.\n");
+    fprintf(stderr, "        With a duration field, the p50, p90, p99 and p99.9 request\n");
+    fprintf(stderr, "        durations of each interval are printed too.\n");
+    fprintf(stderr, "          %s --format json:date=time_iso8601,duration=request_time -s access.json\n", basename(arg0));
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Date formats: ");
     list_date_formats();
     fprintf(stderr, "\n");
     fprintf(stderr, "\n");
@@ -109,6 +261,19 @@ main(int argc, char* argv[])
     mode mode = follow;
     FILE* input = stdin;
 
+    log_format format;
+    parse_format("combined", &format);
+    if (argc >= 3 && strcmp(argv[1], "--format") == 0)
+    {
+        if (parse_format(argv[2], &format) != success)
+        {
+            fprintf(stderr, "error: Unsupported log format %s\n", argv[2]);
+            exit(failure);
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
     if (argc == 3 && strcmp(argv[1], "-r") == 0)
     {
         input = open_file(argv[2]);
@@ -134,7 +299,8 @@ main(int argc, char* argv[])
     double interval = 1.0;
     fprintf(stderr, "info: using interval of %.2f sec\n", interval);
 
-    status status = process_input(input, mode, interval);
+    status status = mode == scan ? scan_input(input, interval, &format)
+                                 : process_input(input, mode, interval, &format);
     fclose(input);
     return status;
 }
@@ -144,16 +310,37 @@ void reset_counters(counters* stats)
     memset(stats, 0, sizeof(counters));
 }
 
-void print_counters(counters* stats, bool header)
+void add_run_counters(counters* stats, const counters* run)
+{
+    for (size_t i = 0; i < 6; i++)
+        stats->codes[i] += run->codes[i];
+    stats->requests += run->requests;
+    stats->bytes += run->bytes;
+}
+
+/* Print a line of counters, and the duration percentiles if durations is not
+   NULL */
+void print_counters(counters* stats, histogram* durations, bool header)
 {
+    const double quantiles[4] = {0.5, 0.9, 0.99, 0.999};
+
     if (header)
     {
         printf(".-------.-------.-------.-------"
-               ".-------.-------.-------.-------------.\n");
+               ".-------.-------.-------.-------------.");
+        if (durations)
+            printf("---------.---------.---------.---------.");
+        printf("\n");
         printf("|   0xx |   1xx |   2xx |   3xx "
-               "|   4xx |   5xx |   all |        rate |\n");
+               "|   4xx |   5xx |   all |        rate |");
+        if (durations)
+            printf("     p50 |     p90 |     p99 |   p99.9 |");
+        printf("\n");
         printf("'-------'-------'-------'-------"
-               "'-------'-------'-------'-------------'\n");
+               "'-------'-------'-------'-------------'");
+        if (durations)
+            printf("---------'---------'---------'---------'");
+        printf("\n");
     }
 
     double duration = stats->end_time - stats->start_time;
@@ -161,10 +348,95 @@ void print_counters(counters* stats, bool header)
     char bitrate_buf[32];
     human_print(bitrate, bitrate_buf);
     printf("| %5lu | %5lu | %5lu | %5lu "
-           "| %5lu | %5lu | %5lu | %8sbps |\n",
+           "| %5lu | %5lu | %5lu | %8sbps |",
            stats->codes[0], stats->codes[1], stats->codes[2],
            stats->codes[3], stats->codes[4], stats->codes[5],
            stats->requests, bitrate_buf);
+
+    if (durations)
+    {
+        uint64_t values[4];
+        histogram_percentiles(durations, quantiles, 4, values);
+        for (size_t i = 0; i < 4; i++)
+        {
+            char duration_buf[32] = "- ";
+            if (durations->total > 0)
+                duration_print(values[i], duration_buf);
+            printf(" %7s |", duration_buf);
+        }
+    }
+    printf("\n");
+}
+
+void reset_histogram(histogram* durations)
+{
+    if (durations)
+        memset(durations, 0, sizeof(histogram));
+}
+
+void add_duration(histogram* durations, uint16_t bucket, uint32_t count)
+{
+    if (durations == NULL)
+        return;
+    durations->counts[bucket] += count;
+    durations->total += count;
+}
+
+/* The bucket of a duration is the duration itself below 256. Above, it is
+   made of the position of the highest set bit and the 7 bits after it. */
+uint16_t histogram_bucket(uint64_t micros)
+{
+    micros = std::min(micros, (uint64_t(1) << HISTOGRAM_MAX_BITS) - 1);
+    unsigned shift = 0;
+    if (micros >> (HISTOGRAM_SUB_BITS + 1))
+        shift = 63 - __builtin_clzll(micros) - HISTOGRAM_SUB_BITS;
+    return uint16_t((shift << HISTOGRAM_SUB_BITS) + (micros >> shift));
+}
+
+/* The middle of the durations in a bucket */
+uint64_t histogram_value(size_t bucket)
+{
+    if (bucket < (2u << HISTOGRAM_SUB_BITS))
+        return bucket;
+    unsigned shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t lowest = uint64_t(bucket - (shift << HISTOGRAM_SUB_BITS)) << shift;
+    return lowest + (uint64_t(1) << shift) / 2;
+}
+
+/* Find the durations at the given quantiles, in increasing order, in one pass
+   over the buckets */
+void histogram_percentiles(histogram* durations, const double* quantiles,
+                           size_t num_quantiles, uint64_t* values)
+{
+    uint64_t count = 0;
+    size_t q = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS && q < num_quantiles; bucket++)
+    {
+        count += durations->counts[bucket];
+        while (q < num_quantiles && count > 0 &&
+               count >= uint64_t(ceil(quantiles[q] * durations->total)))
+            values[q++] = histogram_value(bucket);
+    }
+    while (q < num_quantiles)
+        values[q++] = 0;
+}
+
+void duration_print(uint64_t micros, char* dst)
+{
+    if (micros < 1000)
+        sprintf(dst, "%lu us", micros);
+    else if (micros < 10000)
+        sprintf(dst, "%.2f ms", micros / 1000.0);
+    else if (micros < 100000)
+        sprintf(dst, "%.1f ms", micros / 1000.0);
+    else if (micros < 1000000)
+        sprintf(dst, "%.0f ms", micros / 1000.0);
+    else if (micros < 10000000)
+        sprintf(dst, "%.2f s", micros / 1000000.0);
+    else if (micros < 100000000)
+        sprintf(dst, "%.1f s", micros / 1000000.0);
+    else
+        sprintf(dst, "%.0f s", micros / 1000000.0);
 }
 
 void human_print(uint64_t number, char* dst)
@@ -198,14 +470,85 @@ double parse_date(const char* date_string, const char* format)
     return double(mktime(&t));
 }
 
-double get_time(mode mode, const char* date_string, const char* format)
+double get_time(mode mode, const char* date_string, date_cache* cache)
 {
     if (mode != follow)
-        return parse_date(date_string, format);
+        return parse_date_cached(date_string, cache);
     else
         return current_time();
 }
 
+/* The date layout is fixed up to the hour if the format only uses fixed width
+   fields before %T, as log dates are zero padded. */
+void init_date_cache(date_cache* cache, const char* format)
+{
+    memset(cache, 0, sizeof(date_cache));
+    cache->format = format;
+
+    size_t length = 0;
+    for (const char* f = format; f && *f; f++)
+    {
+        if (*f != '%')
+        {
+            length++;
+            continue;
+        }
+
+        f++;
+        if (*f == 'd' || *f == 'm')
+            length += 2;
+        else if (*f == 'b')
+            length += 3;
+        else if (*f == 'Y')
+            length += 4;
+        else if (*f == 'T')
+        {
+            length += 2;
+            if (length < sizeof(cache->prefix))
+                cache->prefix_length = length;
+            return;
+        }
+        else
+            return;
+    }
+}
+
+/* Read two digits at text. Returns -1 if they are not digits. */
+int two_digits(const char* text)
+{
+    unsigned tens = text[0] - '0';
+    unsigned ones = text[1] - '0';
+    if (tens > 9 || ones > 9)
+        return -1;
+    return tens * 10 + ones;
+}
+
+/* Like parse_date, but strptime and mktime only run when the hour changes */
+double parse_date_cached(const char* date_string, date_cache* cache)
+{
+    /* The hour is followed by :MM:SS */
+    size_t length = cache->prefix_length;
+    int minutes = -1;
+    int seconds = -1;
+    if (length > 0 && strnlen(date_string, length + 6) == length + 6 &&
+        date_string[length] == ':' && date_string[length + 3] == ':')
+    {
+        minutes = two_digits(date_string + length + 1);
+        seconds = two_digits(date_string + length + 4);
+    }
+    if (minutes < 0 || seconds < 0)
+        return parse_date(date_string, cache->format);
+
+    if (cache->valid && memcmp(date_string, cache->prefix, length) == 0)
+        return cache->hour_start + minutes * 60 + seconds;
+
+    double time = parse_date(date_string, cache->format);
+    memcpy(cache->prefix, date_string, length);
+    cache->hour_start = time - minutes * 60 - seconds;
+    cache->valid = true;
+    return time;
+}
+
 void list_date_formats()
 {
     for (size_t i = 0; ; i++)
@@ -229,45 +572,153 @@ const char* determine_date_format(const char* date_string)
     }
 }
 
-status process_input(FILE* input, mode mode, double interval)
+/* Compile a --format spec into the positions or keys of the fields, so that
+   lines are not searched for field names. */
+status parse_format(const char* spec, log_format* format)
+{
+    format->json = false;
+    format->num_ids = duration_field;
+    format->indexes[date_field] = 3;
+    format->indexes[status_field] = 8;
+    format->indexes[bytes_field] = 9;
+    format->indexes[duration_field] = 0;
+    format->keys[date_field] = "time";
+    format->keys[status_field] = "status";
+    format->keys[bytes_field] = "bytes";
+    format->duration_scale = 1000000.0;
+
+    const char* settings;
+    if (strcmp(spec, "combined") == 0 || strcmp(spec, "common") == 0)
+        settings = "";
+    else if (strncmp(spec, "fields:", 7) == 0)
+        settings = spec + 7;
+    else if (strcmp(spec, "json") == 0 || strncmp(spec, "json:", 5) == 0)
+    {
+        format->json = true;
+        settings = spec[4] ? spec + 5 : "";
+    }
+    else
+        return failure;
+
+    /* name=value pairs, separated by commas */
+    while (*settings)
+    {
+        const char* end = strchr(settings, ',');
+        if (end == NULL)
+            end = settings + strlen(settings);
+        const char* equals = (const char*) memchr(settings, '=', end - settings);
+        if (equals == NULL || equals + 1 == end)
+            return failure;
+
+        std::string value(equals + 1, end);
+        if (strncmp(settings, "duration_unit=", 14) == 0)
+        {
+            if (value == "s")
+                format->duration_scale = 1000000.0;
+            else if (value == "ms")
+                format->duration_scale = 1000.0;
+            else if (value == "us")
+                format->duration_scale = 1.0;
+            else
+                return failure;
+            settings = *end ? end + 1 : end;
+            continue;
+        }
+
+        size_t id = 0;
+        while (id < num_field_ids &&
+               (strlen(FIELD_NAMES[id]) != size_t(equals - settings) ||
+                strncmp(FIELD_NAMES[id], settings, equals - settings) != 0))
+            id++;
+        if (id == num_field_ids)
+            return failure;
+        if (id == duration_field)
+            format->num_ids = duration_field + 1;
+
+        if (format->json)
+            format->keys[id] = value;
+        else
+        {
+            char* number_end;
+            long number = strtol(value.c_str(), &number_end, 10);
+            if (*number_end || number < 1 || number > MAX_FIELDS)
+                return failure;
+            format->indexes[id] = number - 1;
+        }
+        settings = *end ? end + 1 : end;
+    }
+
+    format->num_fields = 0;
+    for (size_t i = 0; i < format->num_ids; i++)
+        format->num_fields = std::max(format->num_fields, format->indexes[i] + 1);
+    return success;
+}
+
+/* Message for a first date that matches none of the DATE_FORMATS */
+std::string date_format_error(const log_format* format, const field& date)
+{
+    char where[128];
+    if (format->json)
+        snprintf(where, sizeof(where), "key %s", format->keys[date_field].c_str());
+    else
+        snprintf(where, sizeof(where), "field %u", unsigned(format->indexes[date_field] + 1));
+
+    char message[256];
+    snprintf(message, sizeof(message),
+             "error: Unsupported date format\n"
+             "error: Could not read %.*s of %s as a date\n",
+             int(std::min(date.length, size_t(64))), date.data, where);
+    return message;
+}
+
+status process_input(FILE* input, mode mode, double interval, const log_format* format)
 {
     status status = success;
 
     char* line_buf = NULL;
     size_t buf_len = 0;
-    const size_t max_fields = 50;
-    char* fields[max_fields];
+    ssize_t line_len = 0;
+    field fields[num_field_ids];
     const char* date_format = NULL;
+    date_cache cache;
+    init_date_cache(&cache, NULL);
 
     counters stats;
     reset_counters(&stats);
+    histogram* durations = NULL;
+    if (format->num_ids > duration_field)
+        durations = (histogram*) calloc(1, sizeof(histogram));
     uint64_t output_count = 0;
-    while (getline(&line_buf, &buf_len, input) != -1)
+    uint16_t bucket = 0;
+    while ((line_len = getline(&line_buf, &buf_len, input)) != -1)
     {
-        size_t num_fields = split_line(fields, max_fields, line_buf);
-        status = add_counters(fields, num_fields, &stats);
+        status = extract_fields(format, line_buf, line_len, fields, NULL);
         if (status != success)
             goto error;
+        if (add_counters(format, fields, &stats, &bucket, NULL))
+            add_duration(durations, bucket, 1);
 
-        const char* date = fields[DATE_INDEX];
+        /* strptime stops at the end of the date, the line is NUL terminated */
+        const char* date = fields[date_field].data;
         if (stats.start_time == 0.0)
         {
             date_format = determine_date_format(date);
             if (date_format == NULL)
             {
-                fprintf(stderr, "error: Unsupported date format\n");
-                fprintf(stderr, "error: Could not read %s of field %u as a date\n",
-                        date, DATE_INDEX + 1);
+                fputs(date_format_error(format, fields[date_field]).c_str(), stderr);
                 exit(failure);
             }
-            stats.start_time = get_time(mode, date, date_format);
+            if (date_format != cache.format)
+                init_date_cache(&cache, date_format);
+            stats.start_time = get_time(mode, date, &cache);
         }
 
-        stats.end_time = get_time(mode, date, date_format);
+        stats.end_time = get_time(mode, date, &cache);
         if (stats.end_time - stats.start_time >= interval)
         {
-            print_counters(&stats, output_count % 10 == 0);
+            print_counters(&stats, durations, output_count % 10 == 0);
             reset_counters(&stats);
+            reset_histogram(durations);
             output_count++;
             stats.start_time = stats.end_time;
             if (mode == replay)
@@ -278,41 +729,535 @@ status process_input(FILE* input, mode mode, double interval)
 error:
     if (line_buf)
         free(line_buf);
+    free(durations);
     return status;
 }
 
-/* Split line at spaces. strtok is used so input is destroyed. */
-size_t split_line(char** fields, size_t num_fields, char* line)
+/* Scan mode on all cores. The log is mapped and split at line boundaries into
+   chunks, which threads turn into runs of lines with the same date. The runs
+   of each chunk are replayed in log order as soon as it is scanned, through
+   the same interval logic as process_input, so the output does not depend
+   on the number of threads.
+   Input that can not be mapped, like a pipe, is read by process_input, and
+   so is a log whose first line has no date in a supported format. */
+status scan_input(FILE* input, double interval, const log_format* format)
 {
-    size_t field = 0;
-    char* token = strtok(line, " ");
-    if (token == NULL)
-        return 0;
-    fields[field] = token;
+    int fd = fileno(input);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return process_input(input, scan, interval, format);
+    size_t size = st.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+        return process_input(input, scan, interval, format);
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    /* The date format is taken from the first line only, like process_input
+       does, whichever chunk a line is in */
+    const char* data = (const char*) mapping;
+    const char* first_newline = (const char*) memchr(data, '\n', size);
+    std::string first_line(data, first_newline ? first_newline + 1 - data : size);
+    field first_fields[num_field_ids];
+    std::string first_warnings;
+    const char* date_format = NULL;
+    if (extract_fields(format, first_line.c_str(), first_line.size(), first_fields,
+                       &first_warnings) == success)
+        date_format = determine_date_format(first_fields[date_field].data);
+    if (date_format == NULL)
+    {
+        munmap(mapping, size);
+        return process_input(input, scan, interval, format);
+    }
+
+    /* Small chunks even out lines that are slower to parse. Threads only
+       scan a window of chunks ahead of the replay, and the runs of a chunk
+       are freed once it is replayed, so memory does not grow with the log. */
+    const size_t chunk_size = 1 << 20;
+    size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t window = 2 * num_threads;
 
-    for (field = 1; field < num_fields; field++)
+    /* Chunk c has the lines that start in [c, c + 1) * chunk_size. The
+       thread that scans it finds them, so that the log is only read once. */
+    std::vector<log_chunk> chunks((size + chunk_size - 1) / chunk_size);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t next_chunk = 0;  /* The next chunk to scan */
+    size_t replayed = 0;    /* Chunks replayed so far */
+    bool stop = false;      /* Set when the replay fails */
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min(num_threads, chunks.size()); i++)
     {
-        token = strtok(NULL, " ");
-        if (token == NULL)
+        threads.push_back(std::thread([&]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                changed.wait(lock, [&]()
+                {
+                    return stop || next_chunk == chunks.size() ||
+                           next_chunk < replayed + window;
+                });
+                if (stop || next_chunk == chunks.size())
+                    return;
+                size_t c = next_chunk++;
+                lock.unlock();
+                log_chunk* chunk = &chunks[c];
+                chunk->format = format;
+                chunk->date_format = date_format;
+                chunk->begin = line_start(data, size, c * chunk_size);
+                chunk->end = line_start(data, size, (c + 1) * chunk_size);
+                scan_chunk(chunk);
+                lock.lock();
+                chunk->done = true;
+                changed.notify_all();
+            }
+        }));
+    }
+
+    /* Replay the chunks in log order as they are scanned */
+    status status = success;
+    counters stats;
+    reset_counters(&stats);
+    histogram* durations = NULL;
+    if (format->num_ids > duration_field)
+        durations = (histogram*) calloc(1, sizeof(histogram));
+    uint64_t output_count = 0;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t unmapped = 0;    /* Bytes at the start of the mapping unmapped already */
+    for (size_t c = 0; c < chunks.size() && status == success; c++)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return chunks[c].done; });
+        }
+        status = replay_chunk(&chunks[c], interval, &stats, durations, &output_count);
+
+        /* Neither the runs nor the lines of the chunk are needed again. The
+           lines are unmapped rather than dropped, as the pages around a
+           page fault of a later chunk would be mapped again. Finding the
+           start of the next chunk reads the byte before it. */
+        size_t end = std::min((c + 1) * chunk_size - 1, size) / page_size * page_size;
+        if (end > unmapped)
+        {
+            munmap((char*) mapping + unmapped, end - unmapped);
+            unmapped = end;
+        }
+        chunks[c] = log_chunk();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        replayed = c + 1;
+        stop = status != success;
+        changed.notify_all();
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    free(durations);
+    munmap((char*) mapping + unmapped, size - unmapped);
+    return status;
+}
+
+/* The start of the first line that starts at offset or after it */
+const char* line_start(const char* data, size_t size, size_t offset)
+{
+    if (offset == 0 || offset >= size)
+        return data + std::min(offset, size);
+    const char* newline = (const char*) memchr(data + offset - 1, '\n', size - offset + 1);
+    return newline ? newline + 1 : data + size;
+}
+
+/* Replay the runs of a chunk, one line with the run's date at a time,
+   through the same interval logic as process_input */
+status replay_chunk(log_chunk* chunk, double interval, counters* stats,
+                    histogram* durations, uint64_t* output_count)
+{
+    size_t rest = 0;     /* Next entry of chunk->rests */
+    size_t bucket = 0;   /* Of chunk->durations */
+    size_t warning = 0;  /* Of chunk->warnings */
+    for (size_t r = 0; r < chunk->runs.size(); r++)
+    {
+        const date_run& run = chunk->runs[r];
+        const char* line = run.line;
+        for (int part = 0; part < (run.has_rest ? 2 : 1); part++)
+        {
+            bool is_rest = part == 1;
+            if (is_rest)
+                line = (const char*) memchr(line, '\n', chunk->end - line) + 1;
+            add_run_counters(stats, is_rest ? &chunk->rests[rest++] : &run.first);
+            uint32_t num_buckets = is_rest ? run.rest_buckets : run.first_buckets;
+            for (uint32_t i = 0; i < num_buckets; i++, bucket++)
+                add_duration(durations, chunk->durations[bucket].bucket,
+                             chunk->durations[bucket].count);
+            while (warning < chunk->warnings.size() &&
+                   chunk->warnings[warning].run == r &&
+                   chunk->warnings[warning].rest == is_rest)
+                fputs(chunk->warnings[warning++].text.c_str(), stderr);
+
+            /* Like process_input, check the date format again at the start
+               of each interval */
+            if (stats->start_time == 0.0)
+            {
+                std::string error = interval_date_error(chunk, line);
+                if (!error.empty())
+                {
+                    fputs(error.c_str(), stderr);
+                    return failure;
+                }
+                stats->start_time = run.time;
+            }
+            stats->end_time = run.time;
+
+            /* The rest has the same date, it can not end the interval */
+            if (!is_rest && stats->end_time - stats->start_time >= interval)
+            {
+                print_counters(stats, durations, *output_count % 10 == 0);
+                reset_counters(stats);
+                reset_histogram(durations);
+                (*output_count)++;
+                stats->start_time = stats->end_time;
+            }
+        }
+    }
+
+    if (!chunk->error.empty())
+    {
+        fputs(chunk->error.c_str(), stderr);
+        return failure;
+    }
+    return success;
+}
+
+/* The error to print if the date of a line that starts an interval is in no
+   supported format, or an empty string */
+std::string interval_date_error(const log_chunk* chunk, const char* line)
+{
+    /* strptime stops at the end of the date, the copy is NUL terminated */
+    const char* newline = (const char*) memchr(line, '\n', chunk->end - line);
+    std::string copy(line, newline ? newline + 1 - line : chunk->end - line);
+    field fields[num_field_ids];
+    std::string warnings;  /* Printed already, when the line was scanned */
+    if (extract_fields(chunk->format, copy.c_str(), copy.size(), fields, &warnings) != success ||
+        determine_date_format(fields[date_field].data) != NULL)
+        return "";
+    return date_format_error(chunk->format, fields[date_field]);
+}
+
+/* Move the durations of the current run's first line, or of its rest, from
+   the histogram to the chunk. used lists the buckets that are not 0. */
+void flush_durations(log_chunk* chunk, histogram* durations, std::vector<uint16_t>* used)
+{
+    if (chunk->runs.empty())
+        return;
+    date_run& run = chunk->runs.back();
+    (run.has_rest ? run.rest_buckets : run.first_buckets) = used->size();
+    for (size_t i = 0; i < used->size(); i++)
+    {
+        bucket_count entry = {(*used)[i], uint32_t(durations->counts[(*used)[i]])};
+        chunk->durations.push_back(entry);
+        durations->counts[(*used)[i]] = 0;
+    }
+    used->clear();
+}
+
+/* Count the lines of a chunk into runs of lines with the same date */
+void scan_chunk(log_chunk* chunk)
+{
+    field fields[num_field_ids];
+    date_cache cache;
+    init_date_cache(&cache, chunk->date_format);
+    std::string last_line;
+    std::string warnings;
+    histogram* durations = NULL;  /* Of the current run's first line or rest */
+    if (chunk->format->num_ids > duration_field)
+        durations = (histogram*) calloc(1, sizeof(histogram));
+    std::vector<uint16_t> used;  /* Buckets of durations that are not 0 */
+    uint16_t bucket = 0;
+
+    const char* pos = chunk->begin;
+    while (pos < chunk->end)
+    {
+        const char* start = pos;
+        const char* line = pos;
+        const char* newline = (const char*) memchr(pos, '\n', chunk->end - pos);
+        size_t length = newline ? newline + 1 - pos : chunk->end - pos;
+        pos += length;
+        if (newline == NULL)
+        {
+            /* strptime needs a NUL after a date at the end of the log */
+            last_line.assign(line, length);
+            line = last_line.c_str();
+        }
+
+        if (extract_fields(chunk->format, line, length, fields, &chunk->error) != success)
             break;
-        fields[field] = token;
+
+        double time = parse_date_cached(fields[date_field].data, &cache);
+        if (chunk->runs.empty() || chunk->runs.back().time != time)
+        {
+            flush_durations(chunk, durations, &used);
+            date_run run;
+            memset(&run, 0, sizeof(run));
+            run.time = time;
+            run.line = start;
+            chunk->runs.push_back(run);
+        }
+        else if (!chunk->runs.back().has_rest)
+        {
+            flush_durations(chunk, durations, &used);
+            chunk->runs.back().has_rest = true;
+            chunk->rests.push_back(counters());
+            reset_counters(&chunk->rests.back());
+        }
+
+        date_run& run = chunk->runs.back();
+        counters* stats = run.has_rest ? &chunk->rests.back() : &run.first;
+        if (add_counters(chunk->format, fields, stats, &bucket, &warnings) &&
+            durations->counts[bucket]++ == 0)
+            used.push_back(bucket);
+        if (warnings.empty())
+            continue;
+
+        /* Warnings are rare, they are only kept for the runs that have them */
+        size_t r = chunk->runs.size() - 1;
+        if (chunk->warnings.empty() || chunk->warnings.back().run != r ||
+            chunk->warnings.back().rest != run.has_rest)
+        {
+            run_warnings entry = {r, run.has_rest, ""};
+            chunk->warnings.push_back(entry);
+        }
+        chunk->warnings.back().text += warnings;
+        warnings.clear();
+    }
+
+    flush_durations(chunk, durations, &used);
+    free(durations);
+}
+
+/* Split line at spaces into at most num_fields fields, like strtok but without
+   modifying the line. Runs of spaces separate two fields, and the newline at
+   the end is not part of the last field. The scan stops at the last field
+   asked for, memchr skips over long fields like URLs and user agents. */
+size_t split_line(field* fields, size_t num_fields, const char* line, size_t length)
+{
+    const char* end = line + length;
+    if (end > line && end[-1] == '\n')
+        end--;
+
+    size_t field = 0;
+    const char* pos = line;
+    while (field < num_fields)
+    {
+        while (pos < end && *pos == ' ')
+            pos++;
+        if (pos == end)
+            break;
+
+        const char* token_end = (const char*) memchr(pos, ' ', end - pos);
+        if (token_end == NULL)
+            token_end = end;
+        fields[field].data = pos;
+        fields[field].length = token_end - pos;
+        pos = token_end;
+        field++;
     }
     return field;
 }
 
-/* Read status code and byte count from fields and update counters. */
-status add_counters(char** fields, size_t num_fields, counters* stats)
+/* Skip the JSON string at pos, which is the opening quote. Returns the
+   position after the closing quote, or NULL if the line ends first. */
+const char* skip_json_string(const char* pos, const char* end)
+{
+    for (pos++; pos < end; pos++)
+    {
+        if (*pos == '\\')
+            pos++;
+        else if (*pos == '"')
+            return pos + 1;
+    }
+    return NULL;
+}
+
+/* Skip the JSON value at pos, up to the comma or brace after it. Returns
+   NULL if the line ends first. */
+const char* skip_json_value(const char* pos, const char* end)
+{
+    int depth = 0;
+    while (pos < end)
+    {
+        if (*pos == '"')
+        {
+            pos = skip_json_string(pos, end);
+            if (pos == NULL)
+                return NULL;
+            continue;
+        }
+        if (*pos == '{' || *pos == '[')
+            depth++;
+        else if (*pos == '}' || *pos == ']')
+        {
+            if (depth == 0)
+                return pos;
+            depth--;
+        }
+        else if (*pos == ',' && depth == 0)
+            return pos;
+        pos++;
+    }
+    return NULL;
+}
+
+/* Find the values of the format's keys among the top level members of the
+   JSON object in line, in one pass. String values are returned without their
+   quotes and escapes are left as they are. Returns false if a key is
+   missing. */
+bool split_json(const log_format* format, const char* line, size_t length, field* fields)
+{
+    const char* end = line + length;
+    const char* pos = (const char*) memchr(line, '{', length);
+    if (pos == NULL)
+        return false;
+    pos++;
+
+    size_t found = 0;
+    bool seen[num_field_ids] = {};
+    while (found < format->num_ids)
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+            pos++;
+        if (pos == end || *pos != '"')
+            return false;
+
+        const char* key = pos + 1;
+        pos = skip_json_string(pos, end);
+        if (pos == NULL)
+            return false;
+        size_t key_length = pos - 1 - key;
+
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ':'))
+            pos++;
+        const char* value = pos;
+        pos = skip_json_value(pos, end);
+        if (pos == NULL)
+            return false;
+
+        for (size_t i = 0; i < format->num_ids; i++)
+        {
+            if (seen[i] || format->keys[i].size() != key_length ||
+                memcmp(format->keys[i].data(), key, key_length) != 0)
+                continue;
+
+            const char* value_end = pos;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                value_end--;
+            if (value_end - value >= 2 && *value == '"')
+            {
+                value++;
+                value_end--;
+            }
+            fields[i].data = value;
+            fields[i].length = value_end - value;
+            seen[i] = true;
+            found++;
+        }
+    }
+    return true;
+}
+
+/* Read a decimal duration like 0.012 in units of scale microseconds. Only the
+   first of a list like nginx's "0.010, 0.020" is read. */
+bool parse_duration(const field& text, double scale, uint64_t* micros)
 {
-    /* Assuming status code at index 8 and byte count at index 9 */
-    size_t min_fields = std::max(DATE_INDEX, std::max(STATUS_INDEX, BYTES_INDEX));
-    if (num_fields < min_fields)
+    uint64_t number = 0;
+    uint64_t divisor = 1;
+    bool digits = false;
+    bool point = false;
+    size_t i = 0;
+    for (; i < text.length; i++)
     {
-        fprintf(stderr, "error: line has too few fields\n");
+        char c = text.data[i];
+        if (c >= '0' && c <= '9')
+        {
+            if (number < UINT64_MAX / 100)
+            {
+                number = number * 10 + (c - '0');
+                if (point)
+                    divisor *= 10;
+            }
+            digits = true;
+        }
+        else if (c == '.' && !point)
+            point = true;
+        else
+            break;
+    }
+    if (!digits || (i < text.length && text.data[i] != ','))
+        return false;
+
+    *micros = uint64_t(number * scale / divisor + 0.5);
+    return true;
+}
+
+/* Parse a field of decimal digits. Returns false if it holds anything else. */
+bool parse_number(const field& text, uint64_t* value)
+{
+    if (text.length == 0)
+        return false;
+
+    uint64_t number = 0;
+    for (size_t i = 0; i < text.length; i++)
+    {
+        unsigned digit = text.data[i] - '0';
+        if (digit > 9)
+            return false;
+        number = number * 10 + digit;
+    }
+    *value = number;
+    return true;
+}
+
+/* Print a warning, or append it to warnings if that is not NULL */
+void warn(std::string* warnings, const char* message)
+{
+    if (warnings)
+        warnings->append(message);
+    else
+        fputs(message, stderr);
+}
+
+/* Find the fields of a line, indexed by field_id. Returns failure, after a
+   warning, if the line lacks any of them. */
+status extract_fields(const log_format* format, const char* line, size_t length,
+                      field* fields, std::string* warnings)
+{
+    if (format->json)
+    {
+        if (split_json(format, line, length, fields))
+            return success;
+        warn(warnings, "error: line lacks a date, status, bytes or duration key\n");
         return failure;
     }
 
+    field split[MAX_FIELDS];
+    if (split_line(split, format->num_fields, line, length) < format->num_fields)
+    {
+        warn(warnings, "error: line has too few fields\n");
+        return failure;
+    }
+    for (size_t i = 0; i < format->num_ids; i++)
+        fields[i] = split[format->indexes[i]];
+    return success;
+}
+
+/* Read status code, byte count and duration from fields and update counters.
+   Returns true, with the histogram bucket of the duration in bucket, if the
+   format has a duration and the line a valid one. Warnings go to stderr, or
+   to warnings if that is not NULL. */
+bool add_counters(const log_format* format, field* fields, counters* stats,
+                  uint16_t* bucket, std::string* warnings)
+{
     /* Determine the type of status code */
-    char first_char = fields[STATUS_INDEX][0];
+    char first_char = fields[status_field].length ? fields[status_field].data[0] : 0;
     if (first_char >= '0' && first_char <= '5')
     {
         stats->codes[first_char - '0']++;
@@ -320,16 +1265,27 @@ status add_counters(char** fields, size_t num_fields, counters* stats)
     }
     else
     {
-        fprintf(stderr, "error: could not parse response code\n");
+        warn(warnings, "error: could not parse response code\n");
     }
 
     /* Read byte count */
-    char* endptr = fields[BYTES_INDEX];
-    uint64_t bytes = strtoul(fields[BYTES_INDEX], &endptr, 10);
-    if (*endptr == '\0')
+    uint64_t bytes = 0;
+    if (parse_number(fields[bytes_field], &bytes))
         stats->bytes += bytes;
     else
-        fprintf(stderr, "error: could not parse byte count\n");
+        warn(warnings, "error: could not parse byte count\n");
 
-    return success;
+    /* Read duration, - is logged for requests that had no upstream */
+    if (format->num_ids <= duration_field)
+        return false;
+    const field& duration = fields[duration_field];
+    uint64_t micros = 0;
+    if (parse_duration(duration, format->duration_scale, &micros))
+    {
+        *bucket = histogram_bucket(micros);
+        return true;
+    }
+    if (duration.length != 1 || duration.data[0] != '-')
+        warn(warnings, "error: could not parse duration\n");
+    return false;
 }